@@ -0,0 +1,431 @@
+#include "async.hpp"
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+
+#include "utils/jstrings/jstrings.hpp"
+
+namespace js = JStrings;
+
+namespace Structs {
+
+AsyncQueue::AsyncQueue(unsigned depth) : m_slots(std::max(depth, 1u)) {
+    for (size_t i = m_slots.size(); i > 0; i--) {
+        m_free.push_back(i - 1);
+    }
+}
+
+bool AsyncQueue::submit(const JStringList &args, AsyncDone done) {
+    while (m_free.empty()) {
+        run_completions(true);
+    }
+
+    const size_t i = m_free.back();
+    m_free.pop_back();
+
+    Slot &slot = m_slots[i];
+    slot.args = args;
+    slot.done = std::move(done);
+    slot.writing = false;
+
+    OpReq &req = slot.req;
+    if (!parse_struct_cmd(slot.args, &req)) {
+        finish(i);
+        return false;
+    }
+    if (req.instances.size() > 1) {
+        req.err = "Can't queue a command over several instances of a bank";
+        finish(i);
+        return false;
+    }
+    if (req.op != OpReq::PRINT && req.op != OpReq::PASS && in_transaction(req)) {
+        req.err = "Can't queue a write to a struct in a transaction";
+        finish(i);
+        return false;
+    }
+
+    // nothing to transfer
+    if (req.op == OpReq::PASS || req.mapped) {
+        if (req.op == OpReq::PRINT) {
+            req.print(req);
+            flush_struct_out();
+        } else if (req.op != OpReq::PASS) {
+            req.set_val(req);
+        }
+        finish(i);
+        return true;
+    }
+
+    if (req.op == OpReq::WRITE) {
+        req.set_val(req);
+        if (req.err.length() > 0) {
+            finish(i);
+            return true;
+        }
+        slot.writing = true;
+        swap_struct_req(req);
+    }
+
+    start(i);
+    return true;
+}
+
+size_t AsyncQueue::poll() { return run_completions(false); }
+
+void AsyncQueue::wait() {
+    while (in_flight() > 0) {
+        run_completions(true);
+    }
+}
+
+void AsyncQueue::finish(size_t i) {
+    Slot &slot = m_slots[i];
+    const bool wrote = slot.req.op == OpReq::WRITE || slot.req.op == OpReq::READ_WRITE;
+    if (wrote && slot.req.err.empty()) {
+        cache_struct_write(slot.req);
+    }
+    record_struct_cmd(slot.req);
+    if (slot.done) {
+        slot.done(slot.req);
+    }
+    slot.done = nullptr;
+    m_free.push_back(i);
+}
+
+void AsyncQueue::complete(const Completion &c) {
+    Slot &slot = m_slots[c.slot];
+    OpReq &req = slot.req;
+
+    // whatever was transferred is in the device's byte order
+    swap_struct_req(req);
+
+    if (!c.ok) {
+        req.err = js::fmt("%s of %lu bytes at 0x%lx failed", slot.writing ? "write" : "read",
+                          req.size, req.offset);
+        finish(c.slot);
+        return;
+    }
+
+    if (!slot.writing && req.op == OpReq::PRINT) {
+        req.print(req);
+        flush_struct_out();
+    } else if (!slot.writing) {
+        // the read half of a read-modify-write
+        req.set_val(req);
+        if (req.err.length() == 0) {
+            slot.writing = true;
+            swap_struct_req(req);
+            start(c.slot);
+            return;
+        }
+    }
+    finish(c.slot);
+}
+
+size_t AsyncQueue::run_completions(bool block) {
+    m_done.clear();
+    reap(block, &m_done);
+    for (const Completion &c : m_done) {
+        complete(c);
+    }
+    return m_done.size();
+}
+
+/*================================================================================*/
+
+//
+// io_uring without liburing: the rings are mapped straight from the kernel
+// and every transfer is a one entry READV/WRITEV. Submissions are only
+// handed to the kernel when reaping, so a burst of submit() calls costs a
+// single io_uring_enter().
+//
+class UringQueue : public AsyncQueue {
+  public:
+    static std::unique_ptr<UringQueue> open(int fd, size_t base, unsigned depth) {
+        std::unique_ptr<UringQueue> q{new UringQueue(fd, base, depth)};
+
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        q->m_ring_fd = syscall(__NR_io_uring_setup, (unsigned)q->m_slots.size(), &params);
+        if (q->m_ring_fd < 0) {
+            return nullptr;
+        }
+
+        q->m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        q->m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            q->m_sq_size = q->m_cq_size = std::max(q->m_sq_size, q->m_cq_size);
+        }
+
+        q->m_sq = q->map(q->m_sq_size, IORING_OFF_SQ_RING);
+        q->m_cq = (params.features & IORING_FEAT_SINGLE_MMAP)
+                      ? q->m_sq
+                      : q->map(q->m_cq_size, IORING_OFF_CQ_RING);
+        q->m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        q->m_sqes = (io_uring_sqe *)q->map(q->m_sqes_size, IORING_OFF_SQES);
+        if (!q->m_sq || !q->m_cq || !q->m_sqes) {
+            return nullptr;
+        }
+
+        q->m_sq_tail = (unsigned *)(q->m_sq + params.sq_off.tail);
+        q->m_sq_mask = *(unsigned *)(q->m_sq + params.sq_off.ring_mask);
+        q->m_sq_array = (unsigned *)(q->m_sq + params.sq_off.array);
+        q->m_cq_head = (unsigned *)(q->m_cq + params.cq_off.head);
+        q->m_cq_tail = (unsigned *)(q->m_cq + params.cq_off.tail);
+        q->m_cq_mask = *(unsigned *)(q->m_cq + params.cq_off.ring_mask);
+        q->m_cqes = (io_uring_cqe *)(q->m_cq + params.cq_off.cqes);
+
+        return q;
+    }
+
+    ~UringQueue() override {
+        if (m_sq) {
+            wait();
+        }
+        if (m_sqes) {
+            munmap(m_sqes, m_sqes_size);
+        }
+        if (m_cq && m_cq != m_sq) {
+            munmap(m_cq, m_cq_size);
+        }
+        if (m_sq) {
+            munmap(m_sq, m_sq_size);
+        }
+        if (m_ring_fd >= 0) {
+            close(m_ring_fd);
+        }
+        close(m_fd);
+    }
+
+    const char *backend() const override { return "io_uring"; }
+
+  protected:
+    void start(size_t i) override {
+        const OpReq &req = m_slots[i].req;
+        m_iovs[i] = {req.data, req.size};
+        m_pending[i] = true;
+
+        // the next reap fails it
+        if (m_broken) {
+            return;
+        }
+
+        // only this thread produces, so the tail can be read plainly
+        const unsigned tail = *m_sq_tail;
+        const unsigned index = tail & m_sq_mask;
+
+        io_uring_sqe *sqe = &m_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = m_slots[i].writing ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = m_fd;
+        sqe->addr = (uint64_t)&m_iovs[i];
+        sqe->len = 1;
+        sqe->off = m_base + req.offset;
+        sqe->user_data = i;
+
+        m_sq_array[index] = index;
+        __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+        m_to_submit++;
+    }
+
+    void reap(bool block, std::vector<Completion> *done) override {
+        const bool wait = block && in_flight() > 0 && !completions_ready();
+        if (!m_broken && (m_to_submit > 0 || wait)) {
+            const long n = syscall(__NR_io_uring_enter, m_ring_fd, m_to_submit, wait ? 1 : 0,
+                                   wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (n > 0) {
+                m_to_submit -= n;
+            } else if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                // nothing more is going to complete, so wait() and a full
+                // submit() would spin forever
+                m_broken = true;
+            }
+        }
+
+        unsigned head = *m_cq_head;
+        const unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const io_uring_cqe &cqe = m_cqes[head & m_cq_mask];
+            const size_t i = cqe.user_data;
+            m_pending[i] = false;
+            done->push_back({i, cqe.res >= 0 && (size_t)cqe.res == m_iovs[i].iov_len});
+        }
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+
+        // once the ring is broken whatever is left fails, with req.err set
+        if (m_broken) {
+            m_to_submit = 0;
+            for (size_t i = 0; i < m_pending.size(); i++) {
+                if (m_pending[i]) {
+                    m_pending[i] = false;
+                    done->push_back({i, false});
+                }
+            }
+        }
+    }
+
+  private:
+    UringQueue(int fd, size_t base, unsigned depth)
+        : AsyncQueue(depth), m_fd(fd), m_base(base), m_iovs(m_slots.size()),
+          m_pending(m_slots.size()) {}
+
+    uint8_t *map(size_t size, off_t what) {
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       m_ring_fd, what);
+        return p == MAP_FAILED ? nullptr : (uint8_t *)p;
+    }
+
+    bool completions_ready() const {
+        return *m_cq_head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    int m_fd;
+    size_t m_base;
+    std::vector<iovec> m_iovs; // one per slot, has to live until the transfer's done
+    std::vector<bool> m_pending; // started and not reaped yet
+
+    int m_ring_fd = -1;
+    uint8_t *m_sq = nullptr;
+    uint8_t *m_cq = nullptr;
+    io_uring_sqe *m_sqes = nullptr;
+    size_t m_sq_size = 0;
+    size_t m_cq_size = 0;
+    size_t m_sqes_size = 0;
+
+    unsigned *m_sq_tail = nullptr;
+    unsigned m_sq_mask = 0;
+    unsigned *m_sq_array = nullptr;
+    unsigned *m_cq_head = nullptr;
+    unsigned *m_cq_tail = nullptr;
+    unsigned m_cq_mask = 0;
+    io_uring_cqe *m_cqes = nullptr;
+    unsigned m_to_submit = 0;
+    bool m_broken = false; // io_uring_enter() failed for good
+};
+
+/*================================================================================*/
+
+//
+// A pool of threads each doing one blocking transfer at a time, for when
+// there's no io_uring or the transport isn't a file descriptor.
+//
+class ThreadQueue : public AsyncQueue {
+  public:
+    ThreadQueue(Transport &dev, std::unique_ptr<Transport> owned, unsigned depth,
+                unsigned n_threads)
+        : AsyncQueue(depth), m_dev(dev), m_owned(std::move(owned)) {
+        for (unsigned t = 0; t < std::max(n_threads, 1u); t++) {
+            m_threads.emplace_back([this]() { work(); });
+        }
+    }
+
+    ~ThreadQueue() override {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_job_cv.notify_all();
+        for (std::thread &thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    const char *backend() const override { return "threads"; }
+
+  protected:
+    void start(size_t i) override {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_jobs.push_back(i);
+        }
+        m_job_cv.notify_one();
+    }
+
+    void reap(bool block, std::vector<Completion> *done) override {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (block && in_flight() > 0) {
+            m_done_cv.wait(lock, [this]() { return !m_finished.empty(); });
+        }
+        done->insert(done->end(), m_finished.begin(), m_finished.end());
+        m_finished.clear();
+    }
+
+  private:
+    void work() {
+        while (true) {
+            size_t i;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_job_cv.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+                if (m_jobs.empty()) {
+                    return;
+                }
+                i = m_jobs.front();
+                m_jobs.pop_front();
+            }
+
+            // the slot belongs to this thread until it's handed back
+            OpReq &req = m_slots[i].req;
+            const bool ok = m_slots[i].writing ? m_dev.write(req.data, req.size, req.offset)
+                                               : m_dev.read(req.data, req.size, req.offset);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_finished.push_back({i, ok});
+            }
+            m_done_cv.notify_one();
+        }
+    }
+
+    Transport &m_dev;
+    std::unique_ptr<Transport> m_owned;
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_job_cv;
+    std::condition_variable m_done_cv;
+    std::deque<size_t> m_jobs;
+    std::vector<Completion> m_finished;
+    bool m_stop = false;
+};
+
+/*================================================================================*/
+
+std::unique_ptr<AsyncQueue> AsyncQueue::open(const std::string &path, size_t base,
+                                             unsigned depth, unsigned n_threads,
+                                             std::string *err) {
+    const int fd = ::open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        *err = "open " + path + ": " + strerror(errno);
+        return nullptr;
+    }
+
+    if (auto q = UringQueue::open(fd, base, depth)) {
+        return q;
+    }
+    // the failed ring already closed fd
+
+    std::unique_ptr<Transport> dev = FdTransport::open(path, base, err);
+    if (!dev) {
+        return nullptr;
+    }
+    Transport &ref = *dev;
+    return std::unique_ptr<AsyncQueue>{new ThreadQueue(ref, std::move(dev), depth, n_threads)};
+}
+
+std::unique_ptr<AsyncQueue> AsyncQueue::threads(Transport &dev, unsigned depth,
+                                                unsigned n_threads) {
+    return std::unique_ptr<AsyncQueue>{new ThreadQueue(dev, nullptr, depth, n_threads)};
+}
+
+} // namespace Structs
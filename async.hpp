@@ -0,0 +1,103 @@
+#pragma once
+
+#include "structs.hpp"
+#include "transport.hpp"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace Structs {
+
+// Called once a queued command is finished, after its print or set step
+// ran. req.err is empty if it succeeded.
+using AsyncDone = std::function<void(const OpReq &req)>;
+
+//
+// Runs ci/co commands asynchronously so lots of device accesses can be in
+// flight at once. submit() parses a command and starts its transfers, and
+// poll()/wait() finish whichever commands' transfers have completed: the
+// read is printed or the value is set (a read-modify-write then starts its
+// write), and the command's callback runs. Completions only ever run on the
+// thread calling submit()/poll()/wait(), so printing stays on one thread,
+// but they run in the order the device finishes them, not submission order.
+//
+// A queue isn't thread safe itself, use one per thread.
+//
+class AsyncQueue {
+  public:
+    virtual ~AsyncQueue() = default;
+
+    AsyncQueue(const AsyncQueue &) = delete;
+    AsyncQueue &operator=(const AsyncQueue &) = delete;
+
+    //
+    // A queue over a device file (like FdTransport, device offset 0 is at
+    // byte base of the file) with up to depth commands in flight. Uses
+    // io_uring if the kernel allows it, and a pool of n_threads doing
+    // blocking transfers otherwise. Returns nullptr (with err set) if the
+    // file can't be opened.
+    //
+    static std::unique_ptr<AsyncQueue> open(const std::string &path, size_t base, unsigned depth,
+                                            unsigned n_threads, std::string *err);
+
+    //
+    // A queue with a pool of n_threads doing blocking transfers through any
+    // transport. The transport has to be safe to use from several threads
+    // and outlive the queue.
+    //
+    static std::unique_ptr<AsyncQueue> threads(Transport &dev, unsigned depth, unsigned n_threads);
+
+    //
+    // Parse a command and start it. If the queue is full this first waits
+    // for something to finish. mv/struct_src and invalid commands finish
+    // (and call done) right away. Returns false if the command is invalid.
+    //
+    bool submit(const JStringList &args, AsyncDone done = nullptr);
+
+    // Finish the commands that are done without blocking, returns how many
+    size_t poll();
+
+    // Finish everything that's in flight
+    void wait();
+
+    size_t in_flight() const { return m_slots.size() - m_free.size(); }
+
+    // "io_uring" or "threads"
+    virtual const char *backend() const = 0;
+
+  protected:
+    explicit AsyncQueue(unsigned depth);
+
+    struct Slot {
+        JStringList args;
+        OpReq req;
+        AsyncDone done;
+        bool writing = false; // otherwise reading
+    };
+
+    struct Completion {
+        size_t slot;
+        bool ok;
+    };
+
+    // Start the read or write for a slot
+    virtual void start(size_t slot) = 0;
+
+    // Collect finished transfers, blocking for at least one if block is set
+    // and anything is in flight.
+    virtual void reap(bool block, std::vector<Completion> *done) = 0;
+
+    std::vector<Slot> m_slots;
+
+  private:
+    void finish(size_t slot);
+    void complete(const Completion &c);
+    size_t run_completions(bool block);
+
+    std::vector<size_t> m_free;
+    std::vector<Completion> m_done;
+};
+
+} // namespace Structs
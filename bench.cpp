@@ -0,0 +1,1723 @@
+#include "async.hpp"
+#include "format.hpp"
+#include "server.hpp"
+#include "structs.hpp"
+#include "symtab.hpp"
+#include "watch.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <streambuf>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "utils/jstrings/jstrings.hpp"
+#include "utils/other/stopwatch.hpp"
+
+namespace js = JStrings;
+
+//
+// Benchmarks for the struct registry. Everything here runs against a
+// synthetic registry sized like the generated register maps rather than the
+// handful of structs registered in main.cpp.
+//
+
+static const size_t N_STRUCTS = 256;
+static const size_t N_VARS = 128;
+static const size_t N_LOOKUPS = 1000000;
+
+// keeps the optimizer from dropping the lookups
+static volatile size_t g_sink;
+
+static void report(const char *name, double seconds, size_t iterations) {
+    std::cout << js::fmt("  %-36s %10.1f ns/op\n", name, seconds * 1e9 / iterations);
+}
+
+//
+// Swallows everything written to std::cout while in scope so the print
+// functions still do all their formatting without flooding the terminal.
+//
+class MuteCout {
+  public:
+    MuteCout() : m_old(std::cout.rdbuf(&m_null)) {}
+    ~MuteCout() { std::cout.rdbuf(m_old); }
+
+  private:
+    struct NullBuf : std::streambuf {
+        int overflow(int c) override { return c; }
+    } m_null;
+    std::streambuf *m_old;
+};
+
+// stand-in device for the registered structs
+alignas(64) static uint8_t g_device[4096];
+static void device_read(uint8_t *data, size_t size, size_t offset) {
+    memcpy(data, g_device + offset, size);
+}
+static void device_write(uint8_t *data, size_t size, size_t offset) {
+    memcpy(g_device + offset, data, size);
+}
+
+/*================================================================================*/
+
+//
+// Symbol lookup: the old map-of-maps with js::split against the flat table
+//
+
+namespace MapOfMaps {
+
+struct Var {
+    size_t offset;
+};
+
+struct Struct {
+    std::map<std::string, Var> vars;
+};
+
+std::map<std::string, Struct> g_structs;
+
+// what Structs::get_struct did before the flat table
+std::pair<Struct *, Var *> get_struct(const std::string &svname) {
+    const auto strs = js::split(svname, "->", js::TrimAll);
+    if (strs.size() != 2) {
+        return {};
+    }
+
+    const std::string sname = strs[0];
+    std::string vname = strs[1];
+
+    if (!g_structs.count(sname)) {
+        return {};
+    }
+
+    Struct *s = &g_structs.at(sname);
+    Var *v = nullptr;
+
+    if (js::contains_all(vname, "[]")) {
+        js::slice(&vname, 0, vname.find('['));
+    }
+
+    if (vname.length() > 0 && s->vars.count(vname)) {
+        v = &g_structs.at(sname).vars.at(vname);
+    }
+
+    return {s, v};
+}
+
+} // namespace MapOfMaps
+
+static void bench_lookup() {
+    std::cout << "symbol lookup (" << N_STRUCTS * N_VARS << " members)\n";
+
+    // keep the names alive for the string_views in the flat table
+    std::deque<std::string> snames;
+    std::deque<std::string> vnames;
+    std::vector<Structs::Sym> syms;
+
+    for (size_t i = 0; i < N_STRUCTS; i++) {
+        snames.push_back(js::fmt("blk%03lu", i));
+        syms.push_back({snames.back(), {}, nullptr, nullptr});
+
+        for (size_t j = 0; j < N_VARS; j++) {
+            vnames.push_back(js::fmt("ch%02lu.reg_%03lu", j % 16, j));
+            MapOfMaps::g_structs[snames.back()].vars[vnames.back()] = {j};
+            syms.push_back({snames.back(), vnames.back(), nullptr, nullptr});
+        }
+    }
+
+    const auto table = Structs::SymbolTable::sorted(&syms);
+
+    // a fixed pseudo-random command stream, some with slices
+    std::vector<std::string> paths;
+    uint32_t lcg = 12345;
+    for (size_t i = 0; i < 4096; i++) {
+        lcg = lcg * 1664525 + 1013904223;
+        const size_t s = (lcg >> 8) % N_STRUCTS;
+        const size_t v = (lcg >> 20) % N_VARS;
+        paths.push_back(js::fmt("blk%03lu->ch%02lu.reg_%03lu%s", s, v % 16, v, i % 4 ? "" : "[1:3]"));
+    }
+
+    StopWatch sw;
+    for (size_t i = 0; i < N_LOOKUPS; i++) {
+        g_sink = (size_t)MapOfMaps::get_struct(paths[i % paths.size()]).second;
+    }
+    report("map-of-maps + js::split", sw.seconds(), N_LOOKUPS);
+
+    sw.restart();
+    for (size_t i = 0; i < N_LOOKUPS; i++) {
+        std::string_view sname;
+        std::string_view vname;
+        Structs::split_path(paths[i % paths.size()], &sname, &vname);
+        g_sink = (size_t)table.find(sname, vname);
+    }
+    report("flat table + split_path", sw.seconds(), N_LOOKUPS);
+}
+
+/*================================================================================*/
+
+//
+// Wildcard printing: substring search over every member against the
+// prefix range of the symbol table
+//
+
+static void bench_wildcard() {
+    const size_t n_vars = 8192;
+    const size_t n_iters = 2000;
+    std::cout << "wildcard match (" << n_vars << " members in one struct)\n";
+
+    const std::string sname = "blk";
+    std::deque<std::string> vnames;
+    std::vector<Structs::Sym> syms{{sname, {}, nullptr, nullptr}};
+    std::map<std::string, MapOfMaps::Var> vars;
+
+    for (size_t j = 0; j < n_vars; j++) {
+        vnames.push_back(js::fmt("ch%02lu.reg_%04lu", j % 64, j));
+        vars[vnames.back()] = {j};
+        syms.push_back({sname, vnames.back(), nullptr, nullptr});
+    }
+
+    const auto table = Structs::SymbolTable::sorted(&syms);
+
+    // what the struct print lambda did for "ci blk->ch07.*"
+    StopWatch sw;
+    for (size_t i = 0; i < n_iters; i++) {
+        const std::string partial_name = js::strip("blk->ch07.*", "*");
+        size_t matches = 0;
+        for (const auto &var : vars) {
+            matches += js::contains("blk->" + var.first, partial_name);
+        }
+        g_sink = matches;
+    }
+    report("js::contains over all members", sw.seconds(), n_iters);
+
+    sw.restart();
+    for (size_t i = 0; i < n_iters; i++) {
+        size_t matches = 0;
+        table.for_each_match(sname, "ch07.*", [&matches](const Structs::Sym &) { matches++; });
+        g_sink = matches;
+    }
+    report("prefix range + glob", sw.seconds(), n_iters);
+
+    sw.restart();
+    for (size_t i = 0; i < n_iters; i++) {
+        size_t matches = 0;
+        table.for_each_match(sname, "*.reg_00?[0-4]", [&matches](const Structs::Sym &) { matches++; });
+        g_sink = matches;
+    }
+    report("full scan glob", sw.seconds(), n_iters);
+}
+
+/*================================================================================*/
+
+//
+// Repeated polling: parse_struct_cmd every time against a compiled handle
+//
+
+static void bench_compiled() {
+    const size_t n_iters = 200000;
+    std::cout << "repeated command\n";
+
+    const JStringList cmds[] = {{"ci", "name->d[1:3]"}, {"co", "name->plpl.att", "0x1f"}};
+
+    for (const JStringList &args : cmds) {
+        std::cout << "  " << js::join(args, " ") << "\n";
+
+        StopWatch sw;
+        {
+            MuteCout mute;
+            Structs::OpReq req;
+            for (size_t i = 0; i < n_iters; i++) {
+                Structs::parse_struct_cmd(args, &req);
+                if (req.op == Structs::OpReq::PRINT) {
+                    device_read(req.data, req.size, req.offset);
+                    req.print(req);
+                } else {
+                    device_read(req.data, req.size, req.offset);
+                    req.set_val(req);
+                    device_write(req.data, req.size, req.offset);
+                }
+            }
+        }
+        report("parse_struct_cmd round trip", sw.seconds(), n_iters);
+
+        std::string err;
+        const auto cmd = Structs::compile_struct_cmd(args, &err);
+        sw.restart();
+        {
+            MuteCout mute;
+            for (size_t i = 0; i < n_iters; i++) {
+                Structs::execute_struct_cmd(*cmd, device_read, device_write);
+            }
+        }
+        report("execute compiled handle", sw.seconds(), n_iters);
+    }
+}
+
+/*================================================================================*/
+
+//
+// Batched commands: one transfer per command against coalesced transfers
+//
+
+static size_t g_n_xfers;
+static void counted_read(uint8_t *data, size_t size, size_t offset) {
+    g_n_xfers++;
+    device_read(data, size, offset);
+}
+static void counted_write(uint8_t *data, size_t size, size_t offset) {
+    g_n_xfers++;
+    device_write(data, size, offset);
+}
+
+static void bench_batch() {
+    const size_t n_iters = 20000;
+
+    // read every member of every registered struct, then write them back
+    std::vector<JStringList> cmds;
+    for (const std::string &sname : Structs::struct_names()) {
+        for (const std::string &vname : Structs::member_names(sname + "->")) {
+            cmds.push_back({"ci", sname + "->" + vname});
+        }
+    }
+    cmds.push_back({"co", "name->a", "1"});
+    cmds.push_back({"co", "name->e", "2"});
+    cmds.push_back({"co", "name->d[1]", "3"});
+
+    std::cout << "batch of " << cmds.size() << " commands\n";
+
+    g_n_xfers = 0;
+    StopWatch sw;
+    {
+        MuteCout mute;
+        Structs::OpReq req;
+        for (size_t i = 0; i < n_iters; i++) {
+            for (const JStringList &args : cmds) {
+                Structs::parse_struct_cmd(args, &req);
+                if (req.op == Structs::OpReq::PRINT) {
+                    counted_read(req.data, req.size, req.offset);
+                    req.print(req);
+                } else {
+                    if (req.op == Structs::OpReq::READ_WRITE) {
+                        counted_read(req.data, req.size, req.offset);
+                    }
+                    req.set_val(req);
+                    counted_write(req.data, req.size, req.offset);
+                }
+            }
+        }
+    }
+    report("one command at a time", sw.seconds(), n_iters);
+    std::cout << "    " << g_n_xfers / n_iters << " transfers\n";
+
+    g_n_xfers = 0;
+    Structs::BatchResult result;
+    sw.restart();
+    {
+        MuteCout mute;
+        for (size_t i = 0; i < n_iters; i++) {
+            result = Structs::execute_struct_batch(cmds, counted_read, counted_write);
+        }
+    }
+    report("execute_struct_batch", sw.seconds(), n_iters);
+    std::cout << "    " << result.n_transfers << " transfers, " << result.n_saved << " saved\n";
+}
+
+/*================================================================================*/
+
+//
+// Bitfield writes: read-modify-write of the storage unit against a masked
+// write, counting the bytes that cross the bus
+//
+
+static size_t g_n_bytes;
+static void bytes_read(uint8_t *data, size_t size, size_t offset) {
+    g_n_bytes += size;
+    device_read(data, size, offset);
+}
+static void bytes_write(uint8_t *data, size_t size, size_t offset) {
+    g_n_bytes += size;
+    device_write(data, size, offset);
+}
+static void bytes_masked_write(uint8_t *data, const uint8_t *mask, size_t size, size_t offset) {
+    g_n_bytes += size;
+    for (size_t i = 0; i < size; i++) {
+        g_device[offset + i] = (g_device[offset + i] & ~mask[i]) | (data[i] & mask[i]);
+    }
+}
+
+static void bench_bitfield() {
+    const size_t n_iters = 200000;
+    const JStringList args{"co", "name->plpl.att", "0x1f"};
+
+    // what the whole struct read-modify-write used to move
+    const JStringList whole{"ci", "name->"};
+    Structs::OpReq req;
+    Structs::parse_struct_cmd(whole, &req);
+
+    std::cout << "bitfield write (" << js::join(args, " ") << ", whole struct is "
+              << 2 * req.size << " bytes)\n";
+
+    std::string err;
+    const auto cmd = Structs::compile_struct_cmd(args, &err);
+
+    g_n_bytes = 0;
+    StopWatch sw;
+    for (size_t i = 0; i < n_iters; i++) {
+        Structs::execute_struct_cmd(*cmd, bytes_read, bytes_write);
+    }
+    report("read-modify-write storage unit", sw.seconds(), n_iters);
+    std::cout << "    " << g_n_bytes / n_iters << " bytes moved\n";
+
+    g_n_bytes = 0;
+    sw.restart();
+    for (size_t i = 0; i < n_iters; i++) {
+        Structs::execute_struct_cmd(*cmd, bytes_read, bytes_write, bytes_masked_write);
+    }
+    report("masked write", sw.seconds(), n_iters);
+    std::cout << "    " << g_n_bytes / n_iters << " bytes moved\n";
+}
+
+/*================================================================================*/
+
+//
+// Array slices: the span covering the slice against vectored transfers of
+// just the elements in it
+//
+
+static void bytes_readv(const Structs::XferChunk *chunks, size_t n_chunks) {
+    for (size_t i = 0; i < n_chunks; i++) {
+        g_n_bytes += chunks[i].size;
+        device_read(chunks[i].data, chunks[i].size, chunks[i].offset);
+    }
+}
+static void bytes_writev(const Structs::XferChunk *chunks, size_t n_chunks) {
+    for (size_t i = 0; i < n_chunks; i++) {
+        g_n_bytes += chunks[i].size;
+        device_write(chunks[i].data, chunks[i].size, chunks[i].offset);
+    }
+}
+
+static void bench_slices() {
+    const size_t n_iters = 200000;
+    const JStringList cmds[] = {
+        {"ci", "name->d[1]"}, {"co", "name->d[3]", "1.0"}, {"co", "name->d[::2]", "1.0", "2.0"}};
+
+    // what transferring the whole array used to move
+    const JStringList whole{"ci", "name->d"};
+    Structs::OpReq req;
+    Structs::parse_struct_cmd(whole, &req);
+
+    std::cout << "array slices (whole array is " << req.size << " bytes)\n";
+
+    for (const JStringList &args : cmds) {
+        std::cout << "  " << js::join(args, " ") << "\n";
+
+        std::string err;
+        const auto cmd = Structs::compile_struct_cmd(args, &err);
+
+        g_n_bytes = 0;
+        StopWatch sw;
+        {
+            MuteCout mute;
+            for (size_t i = 0; i < n_iters; i++) {
+                Structs::execute_struct_cmd(*cmd, bytes_read, bytes_write);
+            }
+        }
+        report("span covering the slice", sw.seconds(), n_iters);
+        std::cout << "    " << g_n_bytes / n_iters << " bytes moved\n";
+
+        g_n_bytes = 0;
+        sw.restart();
+        {
+            MuteCout mute;
+            for (size_t i = 0; i < n_iters; i++) {
+                Structs::execute_struct_cmd(*cmd, bytes_read, bytes_write, nullptr, bytes_readv,
+                                            bytes_writev);
+            }
+        }
+        report("vectored", sw.seconds(), n_iters);
+        std::cout << "    " << g_n_bytes / n_iters << " bytes moved\n";
+    }
+}
+
+/*================================================================================*/
+
+//
+// Mapped structs: copying through the request's image against working on
+// the mapped memory in place
+//
+
+static void bench_mapped() {
+    const size_t n_iters = 200000;
+    const JStringList cmds[] = {{"ci", "name->"}, {"co", "name->plpl.att", "0x1f"}};
+
+    std::cout << "mapped struct\n";
+
+    for (const JStringList &args : cmds) {
+        std::cout << "  " << js::join(args, " ") << "\n";
+
+        std::string err;
+        const auto cmd = Structs::compile_struct_cmd(args, &err);
+
+        StopWatch sw;
+        {
+            MuteCout mute;
+            for (size_t i = 0; i < n_iters; i++) {
+                Structs::execute_struct_cmd(*cmd, device_read, device_write);
+            }
+        }
+        report("copy through image", sw.seconds(), n_iters);
+
+        Structs::bind_struct("name", g_device, sizeof(g_device), &err);
+        sw.restart();
+        {
+            MuteCout mute;
+            for (size_t i = 0; i < n_iters; i++) {
+                Structs::execute_struct_cmd(*cmd, device_read, device_write);
+            }
+        }
+        report("bound to mapping", sw.seconds(), n_iters);
+        Structs::bind_struct("name", nullptr, 0, &err);
+    }
+}
+
+/*================================================================================*/
+
+//
+// Transport cost on its own: the same command stream split into parsing,
+// transfers through each transport, and formatting
+//
+
+static void bench_transport() {
+    const size_t n_iters = 20000;
+
+    std::vector<JStringList> cmds;
+    for (const std::string &sname : Structs::struct_names()) {
+        for (const std::string &vname : Structs::member_names(sname + "->")) {
+            cmds.push_back({"ci", sname + "->" + vname});
+        }
+    }
+
+    std::cout << "transport (" << cmds.size() << " commands)\n";
+
+    std::vector<Structs::OpReq> reqs(cmds.size());
+    StopWatch sw;
+    for (size_t i = 0; i < n_iters; i++) {
+        for (size_t c = 0; c < cmds.size(); c++) {
+            Structs::parse_struct_cmd(cmds[c], &reqs[c]);
+        }
+    }
+    report("parse", sw.seconds(), n_iters);
+
+    std::string err;
+    Structs::FuncTransport mem{device_read, device_write};
+    const std::string path = "/tmp/pycstruct_bench.img";
+    const auto file = Structs::FileTransport::open(path, sizeof(g_device), &err);
+    if (!file) {
+        std::cout << "  " << err << "\n";
+        return;
+    }
+
+    const std::pair<const char *, Structs::Transport *> devs[] = {
+        {"transfer: memcpy functions", &mem}, {"transfer: mmap'd file", file.get()}};
+    for (const auto &dev : devs) {
+        sw.restart();
+        for (size_t i = 0; i < n_iters; i++) {
+            for (Structs::OpReq &req : reqs) {
+                dev.second->read(req.data, req.size, req.offset);
+            }
+        }
+        report(dev.first, sw.seconds(), n_iters);
+    }
+    unlink(path.c_str());
+
+    sw.restart();
+    {
+        MuteCout mute;
+        for (size_t i = 0; i < n_iters; i++) {
+            for (const Structs::OpReq &req : reqs) {
+                req.print(req);
+            }
+        }
+    }
+    report("format", sw.seconds(), n_iters);
+}
+
+/*================================================================================*/
+
+//
+// Vectored syscalls: a pread/pwrite per member against one preadv/pwritev
+// for all of them, on a file backed image
+//
+
+static void bench_vectored() {
+    const size_t n_iters = 20000;
+    const size_t n_members = 64;
+    const size_t stride = 16;
+
+    std::cout << "file descriptor transport (" << n_members << " members)\n";
+
+    std::string err;
+    const std::string path = "/tmp/pycstruct_bench.img";
+    const auto file = Structs::FileTransport::open(path, sizeof(g_device), &err);
+    const auto dev = file ? Structs::FdTransport::open(path, 0, &err) : nullptr;
+    if (!dev) {
+        std::cout << "  " << err << "\n";
+        return;
+    }
+
+    // every 4th word, like reading one member out of each of a run of structs
+    std::vector<uint32_t> values(n_members);
+    std::vector<Structs::XferChunk> strided;
+    std::vector<Structs::XferChunk> packed;
+    for (size_t i = 0; i < n_members; i++) {
+        strided.push_back({(uint8_t *)&values[i], sizeof(uint32_t), i * stride});
+        packed.push_back({(uint8_t *)&values[i], sizeof(uint32_t), i * sizeof(uint32_t)});
+    }
+
+    StopWatch sw;
+    for (size_t i = 0; i < n_iters; i++) {
+        for (const Structs::XferChunk &chunk : strided) {
+            dev->read(chunk.data, chunk.size, chunk.offset);
+        }
+    }
+    report("strided reads: pread per member", sw.seconds(), n_iters);
+
+    sw.restart();
+    for (size_t i = 0; i < n_iters; i++) {
+        dev->readv(strided.data(), strided.size());
+    }
+    report("strided reads: preadv per chunk", sw.seconds(), n_iters);
+
+    // a plain file, so the gaps can be read too
+    if (!dev->set_read_gap(stride, &err)) {
+        std::cout << "  " << err << "\n";
+        return;
+    }
+    sw.restart();
+    for (size_t i = 0; i < n_iters; i++) {
+        dev->readv(strided.data(), strided.size());
+    }
+    report("strided reads: one preadv", sw.seconds(), n_iters);
+
+    sw.restart();
+    for (size_t i = 0; i < n_iters; i++) {
+        for (const Structs::XferChunk &chunk : packed) {
+            dev->write(chunk.data, chunk.size, chunk.offset);
+        }
+    }
+    report("packed writes: pwrite per member", sw.seconds(), n_iters);
+
+    sw.restart();
+    for (size_t i = 0; i < n_iters; i++) {
+        dev->writev(packed.data(), packed.size());
+    }
+    report("packed writes: one pwritev", sw.seconds(), n_iters);
+
+    unlink(path.c_str());
+}
+
+/*================================================================================*/
+
+//
+// Async queue: hundreds of reads in flight against running them one after
+// another, on a file backed image and on a device with slow accesses
+//
+
+// pretends every access takes a while, like a register on a slow bus
+class SlowTransport : public Structs::Transport {
+  public:
+    explicit SlowTransport(Structs::Transport &dev) : m_dev(dev) {}
+
+    bool read(uint8_t *data, size_t size, size_t offset) override {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+        return m_dev.read(data, size, offset);
+    }
+    bool write(const uint8_t *data, size_t size, size_t offset) override {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+        return m_dev.write(data, size, offset);
+    }
+
+  private:
+    Structs::Transport &m_dev;
+};
+
+static void bench_async() {
+    const size_t n_cmds = 512;
+
+    std::vector<JStringList> cmds;
+    for (size_t i = 0; cmds.size() < n_cmds; i++) {
+        for (const std::string &vname : Structs::member_names("name->")) {
+            cmds.push_back({"ci", "name->" + vname});
+        }
+    }
+    cmds.resize(n_cmds);
+
+    std::cout << "async queue (" << n_cmds << " reads)\n";
+
+    std::string err;
+    const std::string path = "/tmp/pycstruct_bench.img";
+    const auto file = Structs::FileTransport::open(path, sizeof(g_device), &err);
+    const auto fd = file ? Structs::FdTransport::open(path, 0, &err) : nullptr;
+    if (!fd) {
+        std::cout << "  " << err << "\n";
+        return;
+    }
+
+    // parses and flushes every command too, like submit() and its
+    // completions do
+    const auto run_sync = [&cmds](Structs::Transport &dev) {
+        MuteCout mute;
+        Structs::OpReq req;
+        // don't time writing out whatever earlier benches left in the buffer
+        Structs::flush_struct_out();
+        StopWatch sw;
+        for (const JStringList &args : cmds) {
+            Structs::parse_struct_cmd(args, &req);
+            dev.read(req.data, req.size, req.offset);
+            req.print(req);
+            Structs::flush_struct_out();
+        }
+        return sw.seconds();
+    };
+
+    const auto run_async = [&cmds](Structs::AsyncQueue &q) {
+        MuteCout mute;
+        Structs::flush_struct_out();
+        StopWatch sw;
+        for (const JStringList &args : cmds) {
+            q.submit(args);
+        }
+        q.wait();
+        return sw.seconds();
+    };
+
+    report("file: pread one at a time", run_sync(*fd), n_cmds);
+    {
+        const auto q = Structs::AsyncQueue::open(path, 0, 256, 8, &err);
+        if (!q) {
+            std::cout << "  " << err << "\n";
+            unlink(path.c_str());
+            return;
+        }
+        report(js::fmt("file: async queue (%s)", q->backend()).c_str(), run_async(*q), n_cmds);
+    }
+
+    SlowTransport slow{*fd};
+    report("slow device: one at a time", run_sync(slow), n_cmds);
+    {
+        const auto q = Structs::AsyncQueue::threads(slow, 256, 64);
+        report("slow device: async queue (64 threads)", run_async(*q), n_cmds);
+    }
+
+    unlink(path.c_str());
+}
+
+/*================================================================================*/
+
+//
+// Concurrent parsing: every thread parses and executes commands into its own
+// request and checks that it resolved to the same transfer as a single
+// threaded parse did
+//
+
+static void bench_threads() {
+    const size_t n_iters = 50000;
+    const unsigned max_threads = std::max(4u, std::thread::hardware_concurrency());
+
+    std::vector<JStringList> cmds;
+    for (const std::string &sname : Structs::struct_names()) {
+        for (const std::string &vname : Structs::member_names(sname + "->")) {
+            cmds.push_back({"ci", sname + "->" + vname});
+        }
+    }
+    cmds.push_back({"ci", "name->d[1:3]"});
+    cmds.push_back({"ci", "name->"});
+
+    struct Expected {
+        size_t size;
+        size_t offset;
+        std::vector<int> indices;
+    };
+    std::vector<Expected> expected;
+    {
+        Structs::OpReq req;
+        for (const JStringList &args : cmds) {
+            Structs::parse_struct_cmd(args, &req);
+            expected.push_back({req.size, req.offset, req.indices});
+        }
+    }
+
+    std::cout << "concurrent parse + execute (" << cmds.size() << " commands, up to "
+              << max_threads << " threads)\n";
+
+    for (unsigned n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        std::vector<std::thread> threads;
+        std::vector<size_t> n_bad(n_threads);
+
+        StopWatch sw;
+        {
+            MuteCout mute;
+            for (unsigned t = 0; t < n_threads; t++) {
+                threads.emplace_back([&, t]() {
+                    Structs::OpReq req;
+                    for (size_t i = 0; i < n_iters; i++) {
+                        const size_t c = (i + t) % cmds.size();
+                        if (!Structs::parse_struct_cmd(cmds[c], &req)) {
+                            n_bad[t]++;
+                            continue;
+                        }
+                        device_read(req.data, req.size, req.offset);
+                        req.print(req);
+
+                        n_bad[t] += req.size != expected[c].size ||
+                                    req.offset != expected[c].offset ||
+                                    req.indices != expected[c].indices;
+                    }
+                });
+            }
+            for (std::thread &thread : threads) {
+                thread.join();
+            }
+        }
+        const double seconds = sw.seconds();
+
+        size_t bad = 0;
+        for (size_t n : n_bad) {
+            bad += n;
+        }
+
+        std::cout << js::fmt("  %2u threads %23s %10.2f Mcmd/s", n_threads, "",
+                             n_threads * n_iters / seconds / 1e6);
+        std::cout << (bad ? js::fmt(", %lu mismatches\n", bad) : std::string("\n"));
+    }
+}
+
+/*================================================================================*/
+
+//
+// watch: the sampler only copies the member into the ring and the consumer
+// formats it only when it changed, against a loop that reads and prints
+// every sample
+//
+
+static void bench_watch() {
+    using namespace std::chrono;
+
+    const size_t n_iters = 200000;
+    const JStringList ci = {"ci", "name->a"};
+
+    std::cout << "watch (name->a)\n";
+
+    double seconds;
+    {
+        MuteCout mute;
+        Structs::OpReq req;
+        Structs::parse_struct_cmd(ci, &req);
+        StopWatch sw;
+        for (size_t i = 0; i < n_iters; i++) {
+            device_read(req.data, req.size, req.offset);
+            req.print(req);
+        }
+        seconds = sw.seconds();
+    }
+    report("ci loop: read + print per sample", seconds, n_iters);
+
+    // the sampler's side of it: read into a ring record and publish, with
+    // the consumer draining the ring whenever it fills up
+    {
+        Structs::OpReq req;
+        Structs::parse_struct_cmd(ci, &req);
+        Structs::SampleRing ring(sizeof(int64_t) + req.size, 4096);
+        StopWatch sw;
+        for (size_t i = 0; i < n_iters; i++) {
+            uint8_t *record = ring.reserve();
+            if (!record) {
+                while (const uint8_t *r = ring.front()) {
+                    g_sink = r[sizeof(int64_t)];
+                    ring.pop();
+                }
+                record = ring.reserve();
+            }
+            const int64_t stamp = i;
+            memcpy(record, &stamp, sizeof(stamp));
+            device_read(record + sizeof(stamp), req.size, req.offset);
+            ring.publish();
+        }
+        seconds = sw.seconds();
+    }
+    report("watch: read into ring per sample", seconds, n_iters);
+
+    // the real thing paced at 100us, with the consumer polling every 1ms
+    // like run_watch() does
+    std::string err;
+    Structs::FuncTransport dev{device_read, device_write};
+    const auto w = Structs::Watch::start({"watch", "name->a", "100us"}, dev, &err);
+    StopWatch sw;
+    {
+        MuteCout mute;
+        const auto end = steady_clock::now() + milliseconds(100);
+        while (steady_clock::now() < end) {
+            w->poll();
+            std::this_thread::sleep_for(milliseconds(1));
+        }
+        w->stop();
+        w->poll();
+    }
+    seconds = sw.seconds();
+    std::cout << js::fmt("  %-36s %10lu (%.0f expected, %lu dropped)\n",
+                         "100us period: samples in 100 ms", w->n_samples(), seconds / 100e-6,
+                         w->n_dropped());
+}
+
+/*================================================================================*/
+
+//
+// Snapshot diffing: finding the changed bytes of a big image a byte at a
+// time against diff_images()
+//
+
+static void bench_diff() {
+    const size_t size = 4 << 20;
+    const size_t n_changes = 64;
+    const size_t n_iters = 20;
+
+    std::cout << "snapshot diff (" << (size >> 20) << " MB, " << n_changes << " changes)\n";
+
+    std::vector<uint8_t> a(size);
+    for (size_t i = 0; i < size; i++) {
+        a[i] = i * 2654435761u >> 24;
+    }
+    std::vector<uint8_t> b = a;
+    uint32_t lcg = 12345;
+    for (size_t i = 0; i < n_changes; i++) {
+        lcg = lcg * 1664525 + 1013904223;
+        b[lcg % size] ^= 1 + (lcg >> 28);
+    }
+
+    std::vector<Structs::OpReq::Run> expected;
+    StopWatch sw;
+    for (size_t n = 0; n < n_iters; n++) {
+        expected.clear();
+        for (size_t i = 0; i < size; i++) {
+            if (a[i] == b[i]) {
+                continue;
+            }
+            if (!expected.empty() &&
+                expected.back().struct_offset + expected.back().size == i) {
+                expected.back().size++;
+            } else {
+                expected.push_back({i, 1});
+            }
+        }
+    }
+    report("byte at a time", sw.seconds(), n_iters);
+
+    std::vector<Structs::OpReq::Run> runs;
+    sw.restart();
+    for (size_t n = 0; n < n_iters; n++) {
+        Structs::diff_images(a.data(), b.data(), size, &runs);
+    }
+    report("diff_images", sw.seconds(), n_iters);
+
+    const bool same =
+        runs.size() == expected.size() &&
+        std::equal(runs.begin(), runs.end(), expected.begin(), [](const auto &x, const auto &y) {
+            return x.struct_offset == y.struct_offset && x.size == y.size;
+        });
+    if (!same) {
+        std::cout << "  runs don't match!\n";
+    }
+}
+
+/*================================================================================*/
+
+//
+// Replaying a script: feeding the text commands through the parser again
+// against replaying the binary log recorded the first time
+//
+
+static void bench_replay() {
+    const size_t n_cmds = 200000;
+    const std::string path = "/tmp/pycstruct_bench.log";
+
+    const std::vector<JStringList> script = {
+        {"co", "name->a", "-1"},
+        {"co", "name->plpl.att", "0x1f"},
+        {"co", "name->d[1:3]", "1", "2"},
+        {"co", "name->e", "0xabcd"},
+        {"ci", "name->a"},
+        {"ci", "name->d[::2]"},
+        {"co", "name->u1.f", "-3.1415"},
+        {"ci", "name->plpl.phase"},
+    };
+
+    std::cout << "replay (" << n_cmds << " commands)\n";
+
+    std::string err;
+    Structs::FuncTransport dev{device_read, device_write};
+    if (!Structs::start_recording(path, &err)) {
+        std::cout << "  " << err << "\n";
+        return;
+    }
+
+    double seconds;
+    {
+        MuteCout mute;
+        Structs::OpReq req;
+        StopWatch sw;
+        for (size_t i = 0; i < n_cmds; i++) {
+            Structs::parse_struct_cmd(script[i % script.size()], &req);
+            if (req.op != Structs::OpReq::WRITE) {
+                device_read(req.data, req.size, req.offset);
+            }
+            if (req.op == Structs::OpReq::PRINT) {
+                req.print(req);
+            } else {
+                req.set_val(req);
+                device_write(req.data, req.size, req.offset);
+            }
+            Structs::record_struct_cmd(req);
+        }
+        seconds = sw.seconds();
+    }
+    Structs::stop_recording();
+    report("text script (parse + execute)", seconds, n_cmds);
+
+    Structs::ReplayResult result;
+    StopWatch sw;
+    {
+        MuteCout mute;
+        Structs::replay_struct_log(path, dev, false, true, &result, &err);
+    }
+    report("binary log replay", sw.seconds(), result.n_records);
+
+    sw.restart();
+    result = {};
+    Structs::replay_struct_log(path, dev, false, false, &result, &err);
+    report("binary log replay, no printing", sw.seconds(), result.n_records);
+    if (result.n_records != n_cmds || result.n_failed > 0) {
+        std::cout << js::fmt("  replayed %lu of %lu, %lu failed\n", result.n_records, n_cmds,
+                             result.n_failed);
+    }
+
+    unlink(path.c_str());
+}
+
+/*================================================================================*/
+
+//
+// Register banks: one member of every instance of the bank in main.cpp, as a
+// command per instance against one command over the whole bank
+//
+
+static void bench_bank() {
+    const size_t n_iters = 20000;
+    const size_t n_instances = 8;
+
+    std::cout << "register bank (" << n_instances << " instances)\n";
+
+    std::string err;
+    const std::string path = "/tmp/pycstruct_bench.img";
+    const auto file = Structs::FileTransport::open(path, sizeof(g_device), &err);
+    const auto dev = file ? Structs::FdTransport::open(path, 0, &err) : nullptr;
+    if (!dev || !dev->set_read_gap(Structs::FdTransport::MAX_READ_GAP, &err)) {
+        std::cout << "  " << err << "\n";
+        return;
+    }
+
+    std::vector<std::unique_ptr<Structs::CmdHandle>> singles;
+    std::vector<std::unique_ptr<Structs::CmdHandle>> single_writes;
+    for (size_t i = 0; i < n_instances; i++) {
+        const std::string path = js::fmt("ch[%lu]->a", i);
+        singles.push_back(Structs::compile_struct_cmd({"ci", path}, &err));
+        single_writes.push_back(Structs::compile_struct_cmd({"co", path, "7"}, &err));
+    }
+    const auto bank = Structs::compile_struct_cmd({"ci", "ch[0:8]->a"}, &err);
+    const auto bank_write = Structs::compile_struct_cmd({"co", "ch[0:8]->a", "7"}, &err);
+    if (!bank || !bank_write) {
+        std::cout << "  " << err << "\n";
+        return;
+    }
+
+    double seconds;
+    {
+        MuteCout mute;
+        StopWatch sw;
+        for (size_t i = 0; i < n_iters; i++) {
+            for (const auto &cmd : singles) {
+                Structs::execute_struct_cmd(*cmd, *dev);
+            }
+        }
+        seconds = sw.seconds();
+    }
+    report("reads: a command per instance", seconds, n_iters);
+
+    {
+        MuteCout mute;
+        StopWatch sw;
+        for (size_t i = 0; i < n_iters; i++) {
+            Structs::execute_struct_cmd(*bank, *dev);
+        }
+        seconds = sw.seconds();
+    }
+    report("reads: one command, one preadv", seconds, n_iters);
+
+    StopWatch sw;
+    for (size_t i = 0; i < n_iters; i++) {
+        for (const auto &cmd : single_writes) {
+            Structs::execute_struct_cmd(*cmd, *dev);
+        }
+    }
+    report("writes: a command per instance", sw.seconds(), n_iters);
+
+    sw.restart();
+    for (size_t i = 0; i < n_iters; i++) {
+        Structs::execute_struct_cmd(*bank_write, *dev);
+    }
+    report("writes: one command, one pwritev", sw.seconds(), n_iters);
+
+    unlink(path.c_str());
+}
+
+/*================================================================================*/
+
+//
+// Read cache: repeated reads of a config member that's volatile against the
+// same member marked cacheable, where only the first read goes to the device
+//
+
+static void bench_cache() {
+    const size_t n_iters = 200000;
+
+    std::cout << "read cache\n";
+
+    std::string err;
+    const std::string path = "/tmp/pycstruct_bench.img";
+    const auto file = Structs::FileTransport::open(path, sizeof(g_device), &err);
+    const auto dev = file ? Structs::FdTransport::open(path, 0, &err) : nullptr;
+    const auto cmd = Structs::compile_struct_cmd({"ci", "name->plpl.phase"}, &err);
+    if (!dev || !cmd) {
+        std::cout << "  " << err << "\n";
+        return;
+    }
+
+    const char *modes[] = {"off", "0"};
+    for (const char *ttl : modes) {
+        Structs::run_cache_cmd({"cache", "name->plpl.phase", ttl}, &err);
+
+        double seconds;
+        {
+            MuteCout mute;
+            StopWatch sw;
+            for (size_t i = 0; i < n_iters; i++) {
+                Structs::execute_struct_cmd(*cmd, *dev);
+            }
+            seconds = sw.seconds();
+        }
+        report(ttl == modes[0] ? "volatile: pread every time" : "cacheable: served from cache",
+               seconds, n_iters);
+    }
+
+    Structs::run_cache_cmd({"cache", "name->plpl.phase", "off"}, &err);
+    unlink(path.c_str());
+}
+
+/*================================================================================*/
+
+//
+// Command server: a load generator with a growing number of clients, each
+// pipelining reads of its own struct, against a pool of workers
+//
+
+static void bench_server() {
+    const size_t n_cmds = 4000; // per client
+    const size_t depth = 16;    // commands in flight per client
+    const unsigned n_workers = 4;
+    const JStringList cmds[] = {
+        {"ci", "test->a"}, {"ci", "name->a"}, {"ci", "test2->dd"}, {"ci", "ch->a"}};
+
+    std::cout << "command server (" << n_workers << " workers, " << depth
+              << " commands pipelined per client)\n";
+
+    std::string err;
+    const std::string path = "/tmp/pycstruct_bench.img";
+    const std::string sock = "/tmp/pycstruct_bench.sock";
+    const auto file = Structs::FileTransport::open(path, sizeof(g_device), &err);
+    const auto dev = file ? Structs::FdTransport::open(path, 0, &err) : nullptr;
+    const auto server = dev ? Structs::Server::start(sock, *dev, n_workers, &err) : nullptr;
+    if (!server) {
+        std::cout << "  " << err << "\n";
+        return;
+    }
+
+    for (unsigned n_clients = 1; n_clients <= 8; n_clients *= 2) {
+        std::atomic<size_t> n_failed{0};
+        std::vector<std::thread> clients;
+
+        StopWatch sw;
+        for (unsigned c = 0; c < n_clients; c++) {
+            clients.emplace_back([&, c] {
+                std::string err;
+                const auto client = Structs::ServerClient::connect(sock, &err);
+                if (!client) {
+                    n_failed += n_cmds;
+                    return;
+                }
+
+                const JStringList &cmd = cmds[c % std::size(cmds)];
+                bool ok;
+                std::string body;
+                size_t n_sent = 0;
+                for (size_t n_done = 0; n_done < n_cmds; n_done++) {
+                    while (n_sent < n_cmds && n_sent - n_done < depth) {
+                        client->send(cmd);
+                        n_sent++;
+                    }
+                    if (!client->recv(&ok, &body) || !ok) {
+                        n_failed++;
+                    }
+                }
+            });
+        }
+        for (std::thread &client : clients) {
+            client.join();
+        }
+        const double seconds = sw.seconds();
+
+        std::cout << js::fmt("  %-36s %10.0f cmds/s\n",
+                             js::fmt("%u client%s", n_clients, n_clients > 1 ? "s" : "").c_str(),
+                             n_clients * n_cmds / seconds);
+        if (n_failed > 0) {
+            std::cout << js::fmt("  %lu commands failed\n", n_failed.load());
+        }
+    }
+
+    server->stop();
+    unlink(path.c_str());
+}
+
+/*================================================================================*/
+
+//
+// Transactions: programming a dozen members of a struct one pwrite each
+// against a transaction that only writes the dirty bytes on commit
+//
+
+static void bench_transaction() {
+    const size_t n_iters = 20000;
+    const JStringList writes[] = {
+        {"co", "name->a", "1"},           {"co", "name->b", "2"},
+        {"co", "name->c", "3"},           {"co", "name->d[0]", "1.5"},
+        {"co", "name->d[1]", "2.5"},      {"co", "name->d[2]", "3.5"},
+        {"co", "name->e", "0x1234"},      {"co", "name->plpl.att", "0x1f"},
+        {"co", "name->plpl.phase", "0x3"}, {"co", "name->plpl.val", "7"},
+        {"co", "name->d[3]", "4.5"},      {"co", "name->u1.u", "9"}};
+
+    std::cout << "transactions (" << std::size(writes) << " members)\n";
+
+    std::string err;
+    const std::string path = "/tmp/pycstruct_bench.img";
+    const auto file = Structs::FileTransport::open(path, sizeof(g_device), &err);
+    const auto dev = file ? Structs::FdTransport::open(path, 0, &err) : nullptr;
+    std::vector<std::unique_ptr<Structs::CmdHandle>> cmds;
+    for (const JStringList &write : writes) {
+        cmds.push_back(dev ? Structs::compile_struct_cmd(write, &err) : nullptr);
+        if (!cmds.back()) {
+            std::cout << "  " << err << "\n";
+            return;
+        }
+    }
+
+    {
+        StopWatch sw;
+        for (size_t i = 0; i < n_iters; i++) {
+            for (const auto &cmd : cmds) {
+                Structs::execute_struct_cmd(*cmd, *dev);
+            }
+        }
+        report("one write per co", sw.seconds(), n_iters);
+    }
+
+    double seconds;
+    {
+        MuteCout mute;
+        StopWatch sw;
+        for (size_t i = 0; i < n_iters; i++) {
+            Structs::run_transaction_cmd({"begin", "name->"}, *dev, &err);
+            for (const auto &cmd : cmds) {
+                Structs::execute_struct_cmd(*cmd, *dev);
+            }
+            Structs::run_transaction_cmd({"commit", "name->"}, *dev, &err);
+        }
+        seconds = sw.seconds();
+    }
+    report("begin, co's, commit", seconds, n_iters);
+
+    unlink(path.c_str());
+}
+
+/*================================================================================*/
+
+//
+// Byte order: swapping a big table of each unit size a unit at a time
+// against swap_units(), then reading a whole struct that's in host order
+// against one that's byte swapped
+//
+
+static void bench_endian() {
+    const size_t size = 4 << 20;
+    const size_t n_iters = 20;
+    const size_t n_reads = 200000;
+
+    std::cout << "byte swapping (" << (size >> 20) << " MB table)\n";
+
+    std::vector<uint8_t> table(size);
+    for (size_t i = 0; i < size; i++) {
+        table[i] = i * 2654435761u >> 24;
+    }
+    const std::vector<uint8_t> original = table;
+
+    for (const size_t unit : {2, 4, 8}) {
+        StopWatch sw;
+        for (size_t n = 0; n < n_iters; n++) {
+            for (size_t i = 0; i < size; i += unit) {
+                std::reverse(&table[i], &table[i] + unit);
+            }
+        }
+        report(js::fmt("%lu byte units, unit at a time", unit).c_str(), sw.seconds(), n_iters);
+
+        sw.restart();
+        for (size_t n = 0; n < n_iters; n++) {
+            Structs::swap_units(table.data(), unit, size / unit);
+        }
+        report(js::fmt("%lu byte units, swap_units", unit).c_str(), sw.seconds(), n_iters);
+    }
+    if (table != original) {
+        std::cout << "  table doesn't match!\n";
+    }
+
+    std::string err;
+    const auto cmd = Structs::compile_struct_cmd({"ci", "name->"}, &err);
+    for (const char *endian : {"little", "big"}) {
+        Structs::run_endian_cmd({"endian", "name->", endian}, &err);
+
+        double seconds;
+        {
+            MuteCout mute;
+            StopWatch sw;
+            for (size_t i = 0; i < n_reads; i++) {
+                Structs::execute_struct_cmd(*cmd, device_read, device_write);
+            }
+            seconds = sw.seconds();
+        }
+        report(js::fmt("ci name->, %s endian device", endian).c_str(), seconds, n_reads);
+    }
+    Structs::run_endian_cmd({"endian", "name->", "little"}, &err);
+}
+
+/*================================================================================*/
+
+//
+// Printing a struct: js::fmt and a stream write per member against
+// formatting by type into one buffer written once, with the format parsed
+// at run time or picked by a type tag at compile time, for a big synthetic
+// struct with the registry's formats
+//
+
+namespace PrintBench {
+
+struct Member {
+    std::string prefix; // "blk->reg_0000 = "
+    enum { I32, U32, U16, F32 } type;
+    size_t offset;
+};
+
+const char *const FORMATS[] = {"%11d", "%08X", "%04X", "%11.4e"};
+const Structs::FmtSpec SPECS[] = {Structs::parse_fmt("%11d"), Structs::parse_fmt("%08X"),
+                                  Structs::parse_fmt("%04X"), Structs::parse_fmt("%11.4e")};
+
+// the same formats picked at compile time, like MemberFmt
+struct I32Fmt {
+    static constexpr const char *fmt = "%11d";
+    static constexpr Structs::FmtSpec spec = Structs::parse_fmt(fmt);
+};
+struct U32Fmt {
+    static constexpr const char *fmt = "%08X";
+    static constexpr Structs::FmtSpec spec = Structs::parse_fmt(fmt);
+};
+struct U16Fmt {
+    static constexpr const char *fmt = "%04X";
+    static constexpr Structs::FmtSpec spec = Structs::parse_fmt(fmt);
+};
+struct F32Fmt {
+    static constexpr const char *fmt = "%11.4e";
+    static constexpr Structs::FmtSpec spec = Structs::parse_fmt(fmt);
+};
+
+template <typename T> T load(const uint8_t *image, size_t offset) {
+    T val;
+    memcpy(&val, image + offset, sizeof(val));
+    return val;
+}
+
+} // namespace PrintBench
+
+static void bench_print() {
+    using namespace PrintBench;
+    const size_t n_members = 5000;
+    const size_t n_iters = 200;
+
+    std::cout << "printing a struct (" << n_members << " members)\n";
+
+    std::vector<Member> members;
+    std::vector<uint8_t> image;
+    uint32_t lcg = 12345;
+    for (size_t i = 0; i < n_members; i++) {
+        lcg = lcg * 1664525 + 1013904223;
+        members.push_back({js::fmt("blk->reg_%04lu = ", i), (decltype(Member::type))(lcg >> 30),
+                           image.size()});
+        const float f = (int32_t)lcg / 1024.0f;
+        image.insert(image.end(), (uint8_t *)&lcg, (uint8_t *)&lcg + 4);
+        if (members.back().type == Member::F32) {
+            memcpy(&image[image.size() - 4], &f, 4);
+        }
+    }
+
+    std::ostringstream old_out;
+    StopWatch sw;
+    for (size_t n = 0; n < n_iters; n++) {
+        old_out.str("");
+        for (const Member &m : members) {
+            const std::string fmt = m.prefix + FORMATS[m.type] + "\n";
+            switch (m.type) {
+            case Member::I32:
+                old_out << js::fmt(fmt, load<int32_t>(image.data(), m.offset));
+                break;
+            case Member::U32:
+                old_out << js::fmt(fmt, load<uint32_t>(image.data(), m.offset));
+                break;
+            case Member::U16:
+                old_out << js::fmt(fmt, load<uint16_t>(image.data(), m.offset));
+                break;
+            case Member::F32:
+                old_out << js::fmt(fmt, load<float>(image.data(), m.offset));
+                break;
+            }
+        }
+    }
+    report("js::fmt + stream write per member", sw.seconds(), n_iters);
+
+    std::ostringstream new_out;
+    Structs::OutBuf buf;
+    sw.restart();
+    for (size_t n = 0; n < n_iters; n++) {
+        new_out.str("");
+        buf.clear();
+        for (const Member &m : members) {
+            const Structs::FmtSpec &spec = SPECS[m.type];
+            const char *fmt = FORMATS[m.type];
+            buf.append(m.prefix);
+            switch (m.type) {
+            case Member::I32:
+                buf.value(spec, fmt, load<int32_t>(image.data(), m.offset));
+                break;
+            case Member::U32:
+                buf.value(spec, fmt, load<uint32_t>(image.data(), m.offset));
+                break;
+            case Member::U16:
+                buf.value(spec, fmt, load<uint16_t>(image.data(), m.offset));
+                break;
+            case Member::F32:
+                buf.value(spec, fmt, load<float>(image.data(), m.offset));
+                break;
+            }
+            buf.put('\n');
+        }
+        new_out.write(buf.str().data(), buf.str().size());
+    }
+    report("OutBuf by type, one write", sw.seconds(), n_iters);
+
+    std::ostringstream tag_out;
+    sw.restart();
+    for (size_t n = 0; n < n_iters; n++) {
+        tag_out.str("");
+        buf.clear();
+        for (const Member &m : members) {
+            buf.append(m.prefix);
+            switch (m.type) {
+            case Member::I32:
+                buf.value<I32Fmt>(load<int32_t>(image.data(), m.offset));
+                break;
+            case Member::U32:
+                buf.value<U32Fmt>(load<uint32_t>(image.data(), m.offset));
+                break;
+            case Member::U16:
+                buf.value<U16Fmt>(load<uint16_t>(image.data(), m.offset));
+                break;
+            case Member::F32:
+                buf.value<F32Fmt>(load<float>(image.data(), m.offset));
+                break;
+            }
+            buf.put('\n');
+        }
+        tag_out.write(buf.str().data(), buf.str().size());
+    }
+    report("OutBuf by type tag, one write", sw.seconds(), n_iters);
+
+    if (old_out.str() != new_out.str() || old_out.str() != tag_out.str()) {
+        std::cout << "  output doesn't match!\n";
+    }
+}
+
+/*================================================================================*/
+
+//
+// Getting a struct's values into another program: printed as text and
+// scraped back out of the 'sname->member = value' lines, against the
+// machine readable output modes (JSON and CSV still need a parser, binary
+// records don't)
+//
+
+// what a consumer of the text output has to do: find each value and parse it
+static double scrape_text(const std::string &text) {
+    double sum = 0;
+    size_t pos = 0;
+    while ((pos = text.find(" = ", pos)) != std::string::npos) {
+        pos += 3;
+        sum += strtod(text.c_str() + pos, nullptr);
+    }
+    return sum;
+}
+
+static double scrape_binary(const std::string &bin) {
+    double sum = 0;
+    for (size_t pos = 0; pos < bin.size();) {
+        Structs::OutRecord rec;
+        memcpy(&rec, &bin[pos], sizeof(rec));
+        const size_t end = pos + sizeof(rec) + rec.size;
+        for (pos += sizeof(rec); pos < end;) {
+            Structs::OutValue value;
+            memcpy(&value, &bin[pos], sizeof(value));
+            pos += sizeof(value);
+            if (value.size == sizeof(int32_t)) {
+                int32_t v;
+                memcpy(&v, &bin[pos], sizeof(v));
+                sum += v;
+            }
+            pos += value.size;
+        }
+    }
+    return sum;
+}
+
+static void bench_output() {
+    const size_t n_iters = 100000;
+    std::cout << "output modes (ci name->, " << n_iters << " samples)\n";
+
+    const char *modes[] = {"text", "json", "csv", "binary"};
+    for (const char *mode : modes) {
+        JStringList args = {"ci", "name->"};
+        if (strcmp(mode, "text") != 0) {
+            args.push_back(mode);
+        }
+        // just the printing, the transfer is the same whatever the mode
+        Structs::OpReq req;
+        Structs::parse_struct_cmd(args, &req);
+        device_read(req.data, req.size, req.offset);
+
+        std::ostringstream out;
+        Structs::set_struct_out(&out);
+        StopWatch sw;
+        for (size_t i = 0; i < n_iters; i++) {
+            req.print(req);
+            Structs::flush_struct_out();
+        }
+        Structs::set_struct_out(nullptr);
+        const double produce = sw.seconds();
+        report(js::fmt("%s, printing", mode).c_str(), produce, n_iters);
+
+        const std::string printed = out.str();
+        if (strcmp(mode, "text") == 0) {
+            sw.restart();
+            g_sink = scrape_text(printed);
+            report("text, printing + scraping", produce + sw.seconds(), n_iters);
+        } else if (strcmp(mode, "binary") == 0) {
+            sw.restart();
+            g_sink = scrape_binary(printed);
+            report("binary, printing + reading", produce + sw.seconds(), n_iters);
+        }
+        std::cout << js::fmt("  %-36s %10.1f bytes/sample\n", "", (double)printed.size() / n_iters);
+    }
+}
+
+/*================================================================================*/
+
+//
+// Hex dumping a big image: js::fmt per 32 bit word like main.cpp used to,
+// snprintf per byte for the same lines hexdump prints, and hexdump_line()
+//
+
+// a hexdump line the straightforward way
+static void hex_line_snprintf(const uint8_t *data, size_t offset, std::string *out) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%08lx ", offset);
+    *out += buf;
+    for (size_t i = 0; i < 16; i++) {
+        snprintf(buf, sizeof(buf), i == 8 ? "  %02x" : " %02x", data[i]);
+        *out += buf;
+    }
+    *out += "  |";
+    for (size_t i = 0; i < 16; i++) {
+        *out += data[i] >= 0x20 && data[i] < 0x7f ? (char)data[i] : '.';
+    }
+    *out += "|\n";
+}
+
+static void bench_hexdump() {
+    const size_t size = 4 << 20;
+    const size_t n_iters = 5;
+
+    std::cout << "hex dump (" << (size >> 20) << " MB image)\n";
+
+    std::vector<uint8_t> image(size);
+    for (size_t i = 0; i < size; i++) {
+        image[i] = i * 2654435761u >> 24;
+    }
+
+    std::string words;
+    StopWatch sw;
+    for (size_t n = 0; n < n_iters; n++) {
+        words.clear();
+        for (size_t i = 0; i < size; i += 4) {
+            words += js::fmt("%d, %8X\n", i, *(uint32_t *)&image[i]);
+        }
+    }
+    report("js::fmt per word", sw.seconds(), n_iters);
+
+    std::string old_dump;
+    sw.restart();
+    for (size_t n = 0; n < n_iters; n++) {
+        old_dump.clear();
+        for (size_t i = 0; i < size; i += 16) {
+            hex_line_snprintf(&image[i], i, &old_dump);
+        }
+    }
+    report("snprintf per byte", sw.seconds(), n_iters);
+
+    std::string new_dump;
+    sw.restart();
+    for (size_t n = 0; n < n_iters; n++) {
+        new_dump.clear();
+        char line[Structs::HEXDUMP_LINE_MAX];
+        for (size_t i = 0; i < size; i += 16) {
+            new_dump.append(line, Structs::hexdump_line(&image[i], 16, i, line));
+            new_dump += '\n';
+        }
+    }
+    report("hexdump_line", sw.seconds(), n_iters);
+
+    if (old_dump != new_dump) {
+        std::cout << "  dumps don't match!\n";
+    }
+}
+
+/*================================================================================*/
+
+//
+// A big coefficient table: printing every element the way ci does, against
+// a summary's reduction, scalar and with reduce_array()
+//
+
+static void bench_summary() {
+    using namespace PrintBench;
+    const size_t n_elements = 16384;
+    const size_t n_iters = 1000;
+
+    std::cout << "summarizing an array (" << n_elements << " floats)\n";
+
+    std::vector<float> table(n_elements);
+    uint32_t lcg = 12345;
+    for (float &f : table) {
+        lcg = lcg * 1664525 + 1013904223;
+        f = (int32_t)lcg / 65536.0f;
+    }
+
+    Structs::OutBuf buf;
+    StopWatch sw;
+    for (size_t n = 0; n < 20; n++) {
+        buf.clear();
+        for (size_t i = 0; i < n_elements; i++) {
+            buf.append("tbl->coeffs[");
+            buf.value<I32Fmt>((int)i);
+            buf.append("] = ");
+            buf.value<F32Fmt>(table[i]);
+            buf.put('\n');
+        }
+    }
+    report("printing every element", sw.seconds(), 20);
+
+    float min = 0;
+    float max = 0;
+    double sum = 0;
+    sw.restart();
+    for (size_t n = 0; n < n_iters; n++) {
+        min = max = table[0];
+        sum = 0;
+        for (const float f : table) {
+            min = std::min(min, f);
+            max = std::max(max, f);
+            sum += f;
+        }
+        g_sink = sum;
+    }
+    report("scalar min/max/sum", sw.seconds(), n_iters);
+
+    float simd_min = 0;
+    float simd_max = 0;
+    double simd_sum = 0;
+    sw.restart();
+    for (size_t n = 0; n < n_iters; n++) {
+        Structs::reduce_array(table.data(), n_elements, &simd_min, &simd_max, &simd_sum);
+        g_sink = simd_sum;
+    }
+    report("reduce_array", sw.seconds(), n_iters);
+
+    if (min != simd_min || max != simd_max || std::abs(sum - simd_sum) > 1e-6 * std::abs(sum)) {
+        std::cout << "  reductions don't match!\n";
+    }
+}
+
+int main() {
+    Structs::init_structs();
+
+    bench_lookup();
+    bench_wildcard();
+    bench_compiled();
+    bench_batch();
+    bench_bitfield();
+    bench_slices();
+    bench_mapped();
+    bench_transport();
+    bench_vectored();
+    bench_async();
+    bench_threads();
+    bench_watch();
+    bench_diff();
+    bench_replay();
+    bench_bank();
+    bench_cache();
+    bench_server();
+    bench_transaction();
+    bench_endian();
+    bench_print();
+    bench_output();
+    bench_hexdump();
+    bench_summary();
+}
@@ -0,0 +1,431 @@
+#pragma once
+
+#include <charconv>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+namespace Structs {
+
+//
+// A printf format with (at most) one conversion, parsed at compile time so
+// the registry's print functions can format their member's value by its
+// type instead of going through vsnprintf. Formats the hand-written
+// formatters don't handle (several conversions, '%%', '*' widths, '#')
+// are left to printf.
+//
+struct FmtSpec {
+    enum Kind { Text, Signed, Unsigned, Hex, Float, Printf } kind = Text;
+    bool left = false; // '-'
+    bool zero = false; // '0'
+    char sign = 0;     // '+' or ' ' for positive signed values
+    int width = 0;
+    int precision = -1;
+    int length = 0; // -2 hh, -1 h, 0 none, 1 l, 2 ll/j/z/t
+    char conv = 0;
+
+    // the conversion's place in the format, the text around it is printed as is
+    size_t begin = 0;
+    size_t end = 0;
+};
+
+constexpr FmtSpec parse_fmt(const char *fmt) {
+    FmtSpec spec;
+    size_t i = 0;
+    while (fmt[i] && fmt[i] != '%') {
+        i++;
+    }
+    if (!fmt[i]) {
+        spec.begin = spec.end = i;
+        return spec;
+    }
+    spec.begin = i++;
+
+    for (;; i++) {
+        if (fmt[i] == '-') {
+            spec.left = true;
+        } else if (fmt[i] == '0') {
+            spec.zero = true;
+        } else if (fmt[i] == '+') {
+            spec.sign = '+';
+        } else if (fmt[i] == ' ') {
+            spec.sign = spec.sign ? spec.sign : ' ';
+        } else {
+            break;
+        }
+    }
+    for (; fmt[i] >= '0' && fmt[i] <= '9'; i++) {
+        spec.width = spec.width * 10 + (fmt[i] - '0');
+    }
+    if (fmt[i] == '.') {
+        spec.precision = 0;
+        for (i++; fmt[i] >= '0' && fmt[i] <= '9'; i++) {
+            spec.precision = spec.precision * 10 + (fmt[i] - '0');
+        }
+    }
+    for (; fmt[i] == 'h'; i++) {
+        spec.length--;
+    }
+    for (; fmt[i] == 'l' || fmt[i] == 'j' || fmt[i] == 'z' || fmt[i] == 't'; i++) {
+        spec.length = fmt[i] == 'l' ? spec.length + 1 : 2;
+    }
+
+    spec.conv = fmt[i];
+    switch (spec.conv) {
+    case 'd':
+    case 'i':
+        spec.kind = FmtSpec::Signed;
+        break;
+    case 'u':
+        spec.kind = FmtSpec::Unsigned;
+        break;
+    case 'x':
+    case 'X':
+        spec.kind = FmtSpec::Hex;
+        break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+        spec.kind = FmtSpec::Float;
+        break;
+    default:
+        spec.kind = FmtSpec::Printf;
+        return spec;
+    }
+    spec.end = ++i;
+
+    for (; fmt[i]; i++) {
+        if (fmt[i] == '%') {
+            spec.kind = FmtSpec::Printf;
+        }
+    }
+    return spec;
+}
+
+//
+// Member formats, by the type tag the generator gives each member (one per
+// cli type, see pycstruct3.py) instead of a printf format. The format and
+// its spec are then constants and the print functions are specialized for
+// them at compile time.
+//
+// Bitfields are printed without the zero padding, which doesn't say how
+// many bits they have: 'unsigned long u1 : 5, :3, u2 : 5, :51;' shouldn't
+// print 'u1 = 000000000000001f'.
+//
+namespace Fmt {
+struct I8 {
+    static constexpr const char *member = "4d", *bitfield = "4d";
+};
+struct U8 {
+    static constexpr const char *member = "02X", *bitfield = "2X";
+};
+struct I16 {
+    static constexpr const char *member = "6d", *bitfield = "6d";
+};
+struct U16 {
+    static constexpr const char *member = "04X", *bitfield = "4X";
+};
+struct I32 {
+    static constexpr const char *member = "11d", *bitfield = "11d";
+};
+struct U32 {
+    static constexpr const char *member = "08X", *bitfield = "8X";
+};
+struct I64 {
+    static constexpr const char *member = "20ld", *bitfield = "20ld";
+};
+struct LI64 {
+    static constexpr const char *member = "20lld", *bitfield = "20lld";
+};
+struct U64 {
+    static constexpr const char *member = "016lX", *bitfield = "16lX";
+};
+struct LU64 {
+    static constexpr const char *member = "016llX", *bitfield = "16llX";
+};
+struct F32 {
+    static constexpr const char *member = "11.4e", *bitfield = "11.4e";
+};
+struct F64 {
+    static constexpr const char *member = "11.4e", *bitfield = "11.4e";
+};
+struct Bool {
+    static constexpr const char *member = "%1X", *bitfield = "%1X";
+};
+} // namespace Fmt
+
+// The format a member with type tag Tag is printed with, and its spec
+template <typename Tag, bool Bitfield = false> struct MemberFmt {
+    static constexpr const char *fmt = Bitfield ? Tag::bitfield : Tag::member;
+    static constexpr FmtSpec spec = parse_fmt(fmt);
+};
+
+//
+// A growing output buffer with formatters for single values. Reused from
+// one command to the next so printing a struct costs no allocations once
+// it's warmed up.
+//
+class OutBuf {
+  public:
+    void put(char c) { m_buf += c; }
+    void append(std::string_view s) { m_buf.append(s.data(), s.size()); }
+    void append(const char *s, size_t n) { m_buf.append(s, n); }
+
+    bool empty() const { return m_buf.empty(); }
+    size_t size() const { return m_buf.size(); }
+    const std::string &str() const { return m_buf; }
+    void clear() { m_buf.clear(); }
+
+    // Overwrite n bytes at pos, e.g. a header whose size wasn't known yet
+    void patch(size_t pos, const void *data, size_t n) {
+        m_buf.replace(pos, n, (const char *)data, n);
+    }
+
+    // Format val the way printf(fmt, val) would, spec being parse_fmt(fmt)
+    template <typename T> void value(const FmtSpec &spec, const char *fmt, T val) {
+        using Promoted = decltype(+val);
+        if (spec.kind == FmtSpec::Text) {
+            append(fmt, spec.begin);
+        } else if (spec.kind == FmtSpec::Printf || !converts<Promoted>(spec.kind)) {
+            printf(fmt, val);
+        } else {
+            convert(spec, fmt, (Promoted)val);
+        }
+    }
+
+    // Same thing with the format picked at compile time, F being a MemberFmt.
+    // Only the code for F's conversion is generated, and the common integer
+    // formats get one of their own: zero padded hex at least as wide as the
+    // type is always exactly that many digits, and plain decimal is just
+    // std::to_chars and padding.
+    template <typename F, typename T> void value(T val) {
+        using Promoted = decltype(+val);
+        constexpr FmtSpec spec = F::spec;
+        constexpr bool plain = !spec.left && !spec.sign && spec.precision < 0 && spec.length >= 0;
+
+        if constexpr (spec.kind == FmtSpec::Text) {
+            append(F::fmt, spec.begin);
+        } else if constexpr (spec.kind == FmtSpec::Printf || !converts<Promoted>(spec.kind)) {
+            printf(F::fmt, val);
+        } else if constexpr (spec.kind == FmtSpec::Hex && plain && spec.zero &&
+                             std::is_unsigned<T>::value && spec.width >= 2 * sizeof(T)) {
+            append(F::fmt, spec.begin);
+            put_fixed_hex<spec.width, spec.conv == 'X'>(val);
+            append(F::fmt + spec.end);
+        } else if constexpr (spec.kind != FmtSpec::Hex && spec.kind != FmtSpec::Float && plain &&
+                             !spec.zero) {
+            using Conv = std::conditional_t<spec.kind == FmtSpec::Signed,
+                                            std::make_signed_t<Promoted>,
+                                            std::make_unsigned_t<Promoted>>;
+            append(F::fmt, spec.begin);
+            char digits[24];
+            const std::to_chars_result r =
+                std::to_chars(digits, digits + sizeof(digits), (Conv)val);
+            const size_t n = r.ptr - digits;
+            if (n < (size_t)spec.width) {
+                m_buf.append(spec.width - n, ' ');
+            }
+            append(digits, n);
+            append(F::fmt + spec.end);
+        } else {
+            convert(spec, F::fmt, (Promoted)val);
+        }
+    }
+
+    // val as a plain decimal number, floats as the shortest text that reads
+    // back as the same value
+    template <typename T> void number(T val) {
+        using Promoted = decltype(+val);
+        char digits[64];
+        const std::to_chars_result r =
+            std::to_chars(digits, digits + sizeof(digits), (Promoted)val);
+        append(digits, r.ptr - digits);
+    }
+
+    // s as a JSON string, quotes included
+    void json_string(std::string_view s) {
+        static const char hex[] = "0123456789abcdef";
+        put('"');
+        for (const char c : s) {
+            if (c == '"' || c == '\\') {
+                put('\\');
+                put(c);
+            } else if ((unsigned char)c < 0x20) {
+                append("\\u00");
+                put(hex[c >> 4]);
+                put(hex[c & 0xf]);
+            } else {
+                put(c);
+            }
+        }
+        put('"');
+    }
+
+    // s as a quoted CSV field
+    void csv_string(std::string_view s) {
+        put('"');
+        for (const char c : s) {
+            if (c == '"') {
+                put('"');
+            }
+            put(c);
+        }
+        put('"');
+    }
+
+    // Anything else, formatted straight into the buffer
+    void printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+        va_list args;
+        va_start(args, fmt);
+        va_list retry;
+        va_copy(retry, args);
+
+        const size_t used = m_buf.size();
+        m_buf.resize(m_buf.capacity() > used + 64 ? m_buf.capacity() : used + 64);
+        size_t n = vsnprintf(&m_buf[used], m_buf.size() - used, fmt, args);
+        if (used + n >= m_buf.size()) {
+            m_buf.resize(used + n + 1);
+            vsnprintf(&m_buf[used], n + 1, fmt, retry);
+        }
+        m_buf.resize(used + n);
+
+        va_end(retry);
+        va_end(args);
+    }
+
+  private:
+    // Whether a value of type T is formatted here for a conversion of kind
+    template <typename T> static constexpr bool converts(FmtSpec::Kind kind) {
+        constexpr bool integral = std::is_integral<T>::value;
+        constexpr bool floating = std::is_same<T, float>::value || std::is_same<T, double>::value;
+        return kind == FmtSpec::Float ? floating : integral;
+    }
+
+    template <typename T> void convert(const FmtSpec &spec, const char *fmt, T val) {
+        const size_t start = m_buf.size();
+        append(fmt, spec.begin);
+        if constexpr (std::is_integral<T>::value) {
+            if (spec.kind == FmtSpec::Signed) {
+                const int64_t v = narrow<int64_t>(spec, (std::make_signed_t<T>)val);
+                put_integer(spec, v < 0, v < 0 ? 0 - (uint64_t)v : v, 10, false);
+            } else {
+                const uint64_t v = narrow<uint64_t>(spec, (std::make_unsigned_t<T>)val);
+                put_integer(spec, false, v, spec.kind == FmtSpec::Hex ? 16 : 10, spec.conv == 'X');
+            }
+        } else if constexpr (std::is_floating_point<T>::value) {
+            if (!put_float(spec, val)) {
+                // hundreds of digits for a huge %f, printf knows what to do
+                m_buf.resize(start);
+                printf(fmt, val);
+                return;
+            }
+        }
+        append(fmt + spec.end);
+    }
+
+    template <int Width, bool Upper> void put_fixed_hex(uint64_t v) {
+        const char *set = Upper ? "0123456789ABCDEF" : "0123456789abcdef";
+        char digits[Width];
+        for (int i = Width - 1; i >= 0; i--) {
+            digits[i] = set[v & 0xf];
+            v >>= 4;
+        }
+        append(digits, Width);
+    }
+
+    // hh and h conversions print the value cut down to a char or short
+    template <typename R, typename T> static R narrow(const FmtSpec &spec, T v) {
+        using Char = std::conditional_t<std::is_signed<T>::value, signed char, unsigned char>;
+        using Short = std::conditional_t<std::is_signed<T>::value, short, unsigned short>;
+        return spec.length <= -2 ? (Char)v : spec.length == -1 ? (Short)v : v;
+    }
+
+    void pad_to(const FmtSpec &spec, size_t size, size_t start) {
+        if (size >= (size_t)spec.width) {
+            return;
+        }
+        if (spec.left) {
+            m_buf.append(spec.width - size, ' ');
+        } else {
+            m_buf.insert(start, spec.width - size, ' ');
+        }
+    }
+
+    void put_integer(const FmtSpec &spec, bool negative, uint64_t magnitude, unsigned base,
+                     bool upper) {
+        const char *set = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+        char digits[24];
+        size_t n = 0;
+        // an explicit precision of 0 prints nothing for 0
+        if (magnitude != 0 || spec.precision != 0) {
+            do {
+                digits[n++] = set[magnitude % base];
+                magnitude /= base;
+            } while (magnitude);
+        }
+
+        const char sign = negative ? '-' : spec.kind == FmtSpec::Signed ? spec.sign : 0;
+        size_t zeros = spec.precision > (int)n ? spec.precision - n : 0;
+        const size_t size = (sign != 0) + zeros + n;
+        if (spec.zero && !spec.left && spec.precision < 0 && size < (size_t)spec.width) {
+            zeros += spec.width - size;
+        }
+
+        const size_t start = m_buf.size();
+        if (sign) {
+            m_buf += sign;
+        }
+        m_buf.append(zeros, '0');
+        while (n > 0) {
+            m_buf += digits[--n];
+        }
+        pad_to(spec, m_buf.size() - start, start);
+    }
+
+    bool put_float(const FmtSpec &spec, double val) {
+        const int precision = spec.precision < 0 ? 6 : spec.precision;
+        const char conv = spec.conv | 0x20; // lower case
+        const std::chars_format format = conv == 'e'   ? std::chars_format::scientific
+                                         : conv == 'f' ? std::chars_format::fixed
+                                                       : std::chars_format::general;
+
+        // %.0g is %.1g
+        const int digits_precision = conv == 'g' && precision == 0 ? 1 : precision;
+        char digits[64];
+        const std::to_chars_result r =
+            std::to_chars(digits, digits + sizeof(digits), val, format, digits_precision);
+        if (r.ec != std::errc()) {
+            return false;
+        }
+
+        const size_t n = r.ptr - digits;
+        const bool finite = digits[n - 1] >= '0' && digits[n - 1] <= '9';
+        const bool negative = digits[0] == '-';
+        const char sign = negative ? '-' : spec.sign;
+        const size_t size = (sign != 0) + n - negative;
+        const size_t zeros =
+            spec.zero && !spec.left && finite && size < (size_t)spec.width ? spec.width - size : 0;
+
+        const size_t start = m_buf.size();
+        if (sign) {
+            m_buf += sign;
+        }
+        m_buf.append(zeros, '0');
+        for (size_t i = negative; i < n; i++) {
+            const char c = digits[i];
+            m_buf += spec.conv <= 'Z' && c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+        }
+        pad_to(spec, m_buf.size() - start, start);
+        return true;
+    }
+
+    std::string m_buf;
+};
+
+} // namespace Structs
@@ -1,4 +1,6 @@
+#include "server.hpp"
 #include "structs.hpp"
+#include "watch.hpp"
 
 #include <iostream>
 #include <vector>
@@ -24,14 +26,21 @@ struct Test2 {
 REGISTER_PYCSTRUCT(Test, test);
 REGISTER_PYCSTRUCT(Test2, test2);
 REGISTER_PYCSTRUCT_PACK(Name2, name, 4);
+REGISTER_PYCSTRUCT_BANK(Test, ch, 8, 0x40);
+
+// configuration that doesn't change behind our back
+PYCSTRUCT_CACHEABLE(name, "d", 0);
+PYCSTRUCT_CACHEABLE(test2, "*", 500);
 
 namespace js = JStrings;
 
 volatile uint8_t g_data[1024];
 
 void print_buf() {
-    for (size_t i = 0; i < 20; i++) {
-        std::cout << js::fmt("%d, %8X\n", i * 4, *(uint32_t *)&g_data[4 * i]);
+    char line[Structs::HEXDUMP_LINE_MAX];
+    for (size_t i = 0; i < 80; i += 16) {
+        std::cout.write(line, Structs::hexdump_line((const uint8_t *)g_data + i, 16, i, line));
+        std::cout << "\n";
     }
 }
 
@@ -44,11 +53,24 @@ void read(uint8_t *data, size_t size, size_t offset) {
     memcpy(data, (void *)(g_data + offset), size);
 }
 
-int main() {
+int main(int argc, char **argv) {
     using namespace Structs;
 
     init_structs();
 
+    // run against a file image of the device if one is given
+    FuncTransport mem{read, write};
+    std::unique_ptr<Transport> file;
+    if (argc > 1) {
+        std::string err;
+        file = FileTransport::open(argv[1], sizeof(g_data), &err);
+        if (!file) {
+            std::cout << err << "\n";
+            return 1;
+        }
+    }
+    Transport &dev = file ? *file : mem;
+
     std::vector<JStringList> arg_sets = {
         // {"mv", "name->", "4"},
         // {"co", "name->plpl.att", "0xfff"},
@@ -63,33 +85,127 @@ int main() {
         {"co", "name->u1.f", "-3.1415"},
         // {"ci", "name->"},
         // {"ci", "name->plpl*"},
+        // {"ci", "name->u1.?"},
+        // {"ci", "name->*[ab]"},
         // {"mv", "name->", "100"},
         // {"ci", "name->"},
         // {"mv", "name->", "00"},
         // {"co", "name->d[1]", "-3.1415"},
         // {"co", "name->str", "some",  "text"},
         {"ci", "name->"},
+        // steps bigger than the array only take the start
+        {"ci", "name->d[1::2147483647]"},
+        {"ci", "name->d[::4294967297]"},
         // {"struct_src", "name->"},
+        // {"watch", "name->a", "100us", "2s"},
+        // {"serve", "/tmp/pycstruct.sock", "4", "60s"},
+        // {"cache", "name->plpl.*", "1000"},
+        // {"invalidate", "name->"},
+        // {"begin", "name->"},
+        // {"co", "name->plpl.att", "0x1f"},
+        // {"co", "name->plpl.phase", "0x10"},
+        // {"commit"},
+        // {"endian", "name->", "big"},
+        // {"output", "json"},
+        // {"ci", "ch[2:4]->d", "csv"},
+        // {"hexdump", "name->"},
+        // {"summary", "name->d", "2"},
+        // {"page", "name->d", "1", "2"},
+        // {"co", "name->e", "0x1234"},
+        // {"record", "/tmp/cmds.log"},
+        // {"replay", "/tmp/cmds.log", "timed"},
+        // {"snap", "before", "name->"},
+        // {"diff", "before", "name->"},
+        // {"mv", "ch->", "0x100"},
+        // {"co", "ch[0:8]->a", "7"},
+        // {"ci", "ch[2:6]->"},
+        // {"ci", "ch[::2]->d[1:3]"},
     };
 
+    OpReq cmd;
+    std::vector<XferChunk> chunks;
     for (const JStringList &args : arg_sets) {
 
-        if (is_struct_cmd(args)) {
+        if (args.size() > 0 && args[0] == "watch") {
+            std::string err;
+            if (!run_watch(args, dev, &err)) {
+                std::cout << err << "\n";
+            }
+            std::cout << "\n";
 
-            const auto &cmd = parse_struct_cmd(args);
+        } else if (args.size() > 0 && args[0] == "serve") {
+            std::string err;
+            if (!run_server(args, dev, &err)) {
+                std::cout << err << "\n";
+            }
+            std::cout << "\n";
+
+        } else if (args.size() == 2 && args[0] == "record") {
+            std::string err;
+            if (args[1] == "off") {
+                stop_recording();
+            } else if (!start_recording(args[1], &err)) {
+                std::cout << err << "\n";
+            }
+
+        } else if (args.size() >= 2 && args[0] == "replay") {
+            // 'replay <log> [timed]'
+            std::string err;
+            ReplayResult result;
+            const bool timed = args.size() > 2 && args[2] == "timed";
+            if (!replay_struct_log(args[1], dev, timed, true, &result, &err)) {
+                std::cout << err << "\n";
+            } else {
+                std::cout << js::fmt("replayed %lu commands, %lu failed\n", result.n_records,
+                                     result.n_failed)
+                          << js::join(result.errors, "\n");
+            }
+            std::cout << "\n";
+
+        } else if (is_transaction_cmd(args)) {
+            std::string err;
+            if (!run_transaction_cmd(args, dev, &err)) {
+                std::cout << err << "\n";
+            }
+
+        } else if (is_endian_cmd(args)) {
+            std::string err;
+            if (!run_endian_cmd(args, &err)) {
+                std::cout << err << "\n";
+            }
+
+        } else if (is_output_cmd(args)) {
+            std::string err;
+            if (!run_output_cmd(args, &err)) {
+                std::cout << err << "\n";
+            }
+
+        } else if (is_cache_cmd(args)) {
+            std::string err;
+            if (!run_cache_cmd(args, &err)) {
+                std::cout << err << "\n";
+            }
+
+        } else if (is_snapshot_cmd(args)) {
+            std::string err;
+            if (!run_snapshot_cmd(args, dev, &err)) {
+                std::cout << err << "\n";
+            }
+            std::cout << "\n";
+
+        } else if (is_struct_cmd(args)) {
+
+            parse_struct_cmd(args, &cmd);
 
             switch (cmd.op) {
+            // Reads can be served from the cache, writes go through it, and
+            // several instances of a bank are moved with one vectored transfer
             case Structs::OpReq::PRINT:
-                read(cmd.data, cmd.size, cmd.offset);
-                cmd.print(args);
-                break;
-
             case Structs::OpReq::READ_WRITE:
-                read(cmd.data, cmd.size, cmd.offset);
-                // fall through
             case Structs::OpReq::WRITE:
-                cmd.set_val(args);
-                write(cmd.data, cmd.size, cmd.offset);
+                if (!execute_struct_req(cmd, &chunks, dev)) {
+                    std::cout << "Failed " << cmd.err << "\n";
+                }
                 break;
 
             case Structs::OpReq::PASS:
@@ -97,6 +213,7 @@ int main() {
                 break;
 
             case Structs::OpReq::ERROR:
+                std::cout << cmd.err << "\n";
                 std::cout << "error\n";
                 return 0;
             }
@@ -104,4 +221,6 @@ int main() {
             std::cout << "\n";
         }
     }
+
+    dev.flush();
 }
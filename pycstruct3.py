@@ -8,6 +8,7 @@ from dataclasses import dataclass
 DIR = os.path.dirname(os.path.abspath(__file__))
 INSTANCE_FILE = DIR + "/pycstruct_instances.txt"
 MACRO_FILE = DIR + "/pycstruct_macros.txt"
+REGISTRY_FILE = DIR + "/pycstruct_registry.txt"
 
 OVERWRITE_WARNING = """
 /*******************************************************************************
@@ -93,22 +94,24 @@ def reformat_struct(struct_def: str) -> str:
     return "\\n".join(lines)
 
 
+# The format tag (see Fmt in format.hpp, which has the printf format for each)
+# and string to number conversion for each cli type
 cli_types: dict[str, tuple[str, str]] = {
-    "i8": ("4d", "stol"),
-    "u8": ("02X", "stoul_0x"),
-    "i16": ("6d", "stol"),
-    "u16": ("04X", "stoul_0x"),
-    "i32": ("11d", "stol"),
-    "u32": ("08X", "stoul_0x"),
-    "i64": ("20ld", "stol"),
-    "li64": ("20lld", "stol"),
-    "u64": ("016lX", "stoul_0x"),
-    "lu64": ("016llX", "stoul_0x"),
-    "f32": ("11.4e", "stod"),
-    "f64": ("11.4e", "stod"),
+    "i8": ("Fmt::I8", "stol"),
+    "u8": ("Fmt::U8", "stoul_0x"),
+    "i16": ("Fmt::I16", "stol"),
+    "u16": ("Fmt::U16", "stoul_0x"),
+    "i32": ("Fmt::I32", "stol"),
+    "u32": ("Fmt::U32", "stoul_0x"),
+    "i64": ("Fmt::I64", "stol"),
+    "li64": ("Fmt::LI64", "stol"),
+    "u64": ("Fmt::U64", "stoul_0x"),
+    "lu64": ("Fmt::LU64", "stoul_0x"),
+    "f32": ("Fmt::F32", "stod"),
+    "f64": ("Fmt::F64", "stod"),
 }
 ctype_fmts: dict[str, tuple[str, str]] = {
-    "bool": ("%1X", "stoul_0x"),
+    "bool": ("Fmt::Bool", "stoul_0x"),
     "int8_t": cli_types["i8"],
     "char": cli_types["i8"],
     "signed char": cli_types["i8"],
@@ -149,6 +152,24 @@ ctype_fmts: dict[str, tuple[str, str]] = {
 }
 
 
+@dataclass(frozen=True)
+class MemberMacro:
+    """One member of a registered struct. 'kind' picks the REGISTER_*/PYCSTRUCT_*
+    macro pair that describes it in structs.cpp."""
+
+    name: str
+    kind: str
+    args: str
+
+    def register(self) -> str:
+        """Statement that registers the member at startup."""
+        return f"REGISTER_{self.kind}({self.args});"
+
+    def descriptor(self) -> str:
+        """Constant expression for the member's descriptor."""
+        return f"PYCSTRUCT_{self.kind}({self.args})"
+
+
 #
 # Regular variables and arrays
 #
@@ -186,21 +207,28 @@ class CStdVar:
         self.name: str = def_split.pop()
         self.ctype = " ".join(def_split)
 
-    def macro(self, parent: str, name_base: str) -> str:
+    def macro(self, parent: str, name_base: str) -> "MemberMacro | None":
         """Generate the pycstruct macro call for this variable."""
 
         if self.ctype not in ctype_fmts or self.name[:2] == "__":
-            return ""
+            return None
 
-        printf, stonum = ctype_fmts[self.ctype]
+        name = name_base + self.name
+        fmt_tag, stonum = ctype_fmts[self.ctype]
         if self.size == 0:
-            return f'REGISTER_VAR({parent}, {name_base}{self.name}, {self.ctype}, "{printf}", {stonum});'
+            return MemberMacro(
+                name, "VAR", f"{parent}, {name}, {self.ctype}, {fmt_tag}, {stonum}"
+            )
 
         elif self.ctype == "char":
-            return f"REGISTER_CHAR_ARR({parent}, {name_base}{self.name})"
+            return MemberMacro(name, "CHAR_ARR", f"{parent}, {name}")
 
         else:
-            return f'REGISTER_ARR({parent}, {name_base}{self.name}, {self.size}, {self.ctype}, "{printf}", {stonum});'
+            return MemberMacro(
+                name,
+                "ARR",
+                f"{parent}, {name}, {self.size}, {self.ctype}, {fmt_tag}, {stonum}",
+            )
 
 
 #
@@ -230,29 +258,25 @@ class CBitfield:
 
         self.ctype = self.ctype.strip()
 
-    def macros(self, parent: str, name_base: str) -> list[str]:
+    def macros(self, parent: str, name_base: str) -> list["MemberMacro"]:
         """Generate the pycstruct macro call for this bitfield."""
 
         if self.ctype not in ctype_fmts:
             return []
 
-        macros: list[str] = []
-        printf, stonum = ctype_fmts[self.ctype]
-
-        # The unsigned prints have leading zeros that don't accurately
-        # represent a bitfield size, e.g.
-        #    unsigned long u1 : 5, :3, u2 : 5, :51;
-        # probably shouldn't print
-        #   u1 = 000000000000001f,
-        #   u2 = 000000000000001f,
-        # although this is just my opinion.
-        if printf[0] == "0":
-            printf = printf[1:]
+        macros: list[MemberMacro] = []
+        # bitfields are printed without the zero padding, see Fmt
+        fmt_tag, stonum = ctype_fmts[self.ctype]
 
         for field_name, _ in self.fields:
             if field_name[:2] != "__":
+                name = name_base + field_name
                 macros.append(
-                    f'REGISTER_BITFIELD({parent}, {name_base}{field_name}, {self.ctype}, "{printf}", {stonum});'
+                    MemberMacro(
+                        name,
+                        "BITFIELD",
+                        f"{parent}, {name}, {self.ctype}, {fmt_tag}, {stonum}",
+                    )
                 )
 
         return macros
@@ -320,10 +344,10 @@ class ObjectFrame:
         if DEBUG_PRINT:
             self.print()
 
-    def reg_macros(self, base_name) -> list[str]:
+    def reg_macros(self, base_name) -> list[MemberMacro]:
         """Generate all the c++ macro calls to register all the members of
         this struct. This call is recursive as well."""
-        macros: list[str] = []
+        macros: list[MemberMacro] = []
 
         for frame in self.frames:
             macros += frame.reg_macros(base_name)
@@ -462,6 +486,8 @@ class StructRegisterRequest:
     typename: str
     instance_name: str
     pragma_pack: str = ""
+    count: str = ""  # banks only
+    stride: str = ""
 
 
 def find_requests(text: str, filename: str) -> set[StructRegisterRequest]:
@@ -483,13 +509,37 @@ def find_requests(text: str, filename: str) -> set[StructRegisterRequest]:
             ValueError(f"Invalid struct registration request: {macro_args}")
 
         args = [s.strip() for s in macro_args.split(",") if s.strip()]
-        registers.add(StructRegisterRequest(filename, *args))
+        if text.startswith("REGISTER_PYCSTRUCT_BANK", i):
+            typename, instance_name, count, stride = args
+            registers.add(
+                StructRegisterRequest(filename, typename, instance_name, "", count, stride)
+            )
+        else:
+            registers.add(StructRegisterRequest(filename, *args))
 
         i = text.find("REGISTER_PYCSTRUCT", i + 1)
 
     return registers
 
 
+def find_cache_rules(text: str) -> list[tuple[str, str, str]]:
+    """
+    Find the PYCSTRUCT_CACHEABLE(instance_name, "member_glob", ttl_ms)
+    annotations marking struct members as cacheable
+    """
+    text = text.replace("#define PYCSTRUCT_CACHEABLE", "")  # ignore the macro definition
+    return re.findall(r'PYCSTRUCT_CACHEABLE\(\s*(\w+)\s*,\s*"([^"]*)"\s*,\s*(\d+)\s*\)', text)
+
+
+def find_endian_rules(text: str) -> list[tuple[str, str]]:
+    """
+    Find the PYCSTRUCT_ENDIAN(instance_name, big|little) annotations giving
+    a struct's byte order on the device
+    """
+    text = text.replace("#define PYCSTRUCT_ENDIAN", "")  # ignore the macro definition
+    return re.findall(r"PYCSTRUCT_ENDIAN\(\s*(\w+)\s*,\s*(big|little)\s*\)", text)
+
+
 def find_top_struct_defs(text: str, filename: str) -> dict[str, ObjectFrame]:
     """Find all the top level struct definitions in the file."""
 
@@ -552,9 +602,55 @@ def get_filename_list(includes: list[str]) -> set[str]:
     return source_files
 
 
-def main(make_includes: list[str]) -> None:
+def constexpr_registry(
+    registered: list[tuple[StructRegisterRequest, ObjectFrame, list[MemberMacro]]],
+) -> list[str]:
+    """Generate the registry as constexpr arrays instead of startup macro calls.
+
+    Structs, members and the symbol table are all emitted sorted by name since
+    structs.cpp binary searches them directly.
+    """
+
+    lines: list[str] = ["#define PYCSTRUCT_CONSTEXPR_REGISTRY", ""]
+    struct_descs: list[str] = []
+    symbols: list[str] = []
+
+    registered = sorted(registered, key=lambda r: r[0].instance_name)
+
+    for i, (request, frame, members) in enumerate(registered):
+        name = request.instance_name
+        members = sorted(members, key=lambda m: m.name)
+        vars_array = f"pycstruct_vars_{name}" if members else "nullptr"
+        count = request.count or "1"
+        stride = request.stride or f"sizeof({name})"
+
+        lines.append(f"static StructState pycstruct_state_{name};")
+        if members:
+            lines.append(f"static constexpr Var {vars_array}[] = {{")
+            lines += [f"    {m.descriptor()}," for m in members]
+            lines.append("};")
+        lines.append("")
+
+        struct_descs.append(
+            f'    PYCSTRUCT_STRUCT({request.typename}, {name}, "{frame.src_file}", "{reformat_struct(frame.raw_full)}", {vars_array}, {len(members)}, &pycstruct_state_{name}, {count}, {stride}),'
+        )
+
+        symbols.append(f'    {{"{name}", "", &pycstruct_structs[{i}], nullptr}},')
+        symbols += [
+            f'    {{"{name}", "{m.name}", &pycstruct_structs[{i}], &{vars_array}[{j}]}},'
+            for j, m in enumerate(members)
+        ]
+
+    lines += ["static constexpr Struct pycstruct_structs[] = {"] + struct_descs + ["};", ""]
+    lines += ["static constexpr Sym pycstruct_symbols[] = {"] + symbols + ["};"]
+    return lines
+
+
+def main(make_includes: list[str], constexpr: bool = False) -> None:
     defined_structs: dict[str, ObjectFrame] = {}
     requests: set[StructRegisterRequest] = set()
+    cache_rules: list[tuple[str, str, str]] = []
+    endian_rules: list[tuple[str, str]] = []
 
     source_files = get_filename_list(make_includes)
 
@@ -564,6 +660,8 @@ def main(make_includes: list[str]) -> None:
                 filetext = f.read()
 
             requests.update(find_requests(filetext, filename))
+            cache_rules += find_cache_rules(filetext)
+            endian_rules += find_endian_rules(filetext)
             defined_structs.update(find_top_struct_defs(filetext, filename))
 
         except Exception as e:
@@ -571,7 +669,9 @@ def main(make_includes: list[str]) -> None:
             exit(1)
 
     instances: list[str] = []
+    defined_types: set[str] = set()
     macros: list[str] = []
+    registered: list[tuple[StructRegisterRequest, ObjectFrame, list[MemberMacro]]] = []
 
     # Generate a static instance and the required macros for everything the
     # user has asked for.
@@ -587,29 +687,73 @@ def main(make_includes: list[str]) -> None:
             f'Pycstruct: Generating macros for: {request.typename} "{request.instance_name}"'
         )
 
-        if request.pragma_pack:
-            instances.append(f"#pragma pack(push, {request.pragma_pack})")
+        # a type registered more than once is only defined the first time
+        if request.typename in defined_types:
+            instances.append(f"static struct _{request.typename} {request.instance_name};")
+        else:
+            if request.pragma_pack:
+                instances.append(f"#pragma pack(push, {request.pragma_pack})")
 
-        instances.append(
-            f"static struct _{request.typename} {{{requested_struct.raw_body}}} {request.instance_name};"
-        )
+            instances.append(
+                f"static struct _{request.typename} {{{requested_struct.raw_body}}} {request.instance_name};"
+            )
 
-        if request.pragma_pack:
-            instances.append(f"#pragma pack(pop)")
+            if request.pragma_pack:
+                instances.append(f"#pragma pack(pop)")
+            defined_types.add(request.typename)
 
-        macros.append(
-            f'REGISTER_INTERNAL_STRUCT({request.typename}, {request.instance_name}, "{requested_struct.src_file}", "{reformat_struct(requested_struct.raw_full)}");'
-        )
-        macros += defined_structs[request.typename].reg_macros(request.instance_name)
+        members = requested_struct.reg_macros(request.instance_name)
+        registered.append((request, requested_struct, members))
+
+        if request.count:
+            macros.append(
+                f'REGISTER_INTERNAL_BANK({request.typename}, {request.instance_name}, "{requested_struct.src_file}", "{reformat_struct(requested_struct.raw_full)}", {request.count}, {request.stride});'
+            )
+        else:
+            macros.append(
+                f'REGISTER_INTERNAL_STRUCT({request.typename}, {request.instance_name}, "{requested_struct.src_file}", "{reformat_struct(requested_struct.raw_full)}");'
+            )
+        macros += [m.register() for m in members]
         macros.append("")
 
+    # the cache and byte order annotations are applied by init_structs() in
+    # either mode
+    names = {request.instance_name for request in requests}
+    for name, endian in endian_rules:
+        if name not in names:
+            print(f'Pycstruct: PYCSTRUCT_ENDIAN for unregistered struct "{name}"')
+            exit(1)
+    if endian_rules:
+        instances.append("")
+        instances.append("#define PYCSTRUCT_ENDIAN_RULES")
+        instances.append("static constexpr EndianRule pycstruct_endian_rules[] = {")
+        instances += [f'    {{"{n}", "{e}"}},' for n, e in endian_rules]
+        instances.append("};")
+    for name, pattern, ttl_ms in cache_rules:
+        if name not in names:
+            print(f'Pycstruct: PYCSTRUCT_CACHEABLE for unregistered struct "{name}"')
+            exit(1)
+    if cache_rules:
+        instances.append("")
+        instances.append("#define PYCSTRUCT_CACHE_RULES")
+        instances.append("static constexpr CacheRule pycstruct_cache_rules[] = {")
+        instances += [f'    {{"{n}", "{p}", {t}}},' for n, p, t in cache_rules]
+        instances.append("};")
+
     with open(INSTANCE_FILE, "w") as f:
         f.write(OVERWRITE_WARNING)
         f.write("\n".join(instances) + "\n")
 
-    with open(MACRO_FILE, "w") as f:
-        f.write(OVERWRITE_WARNING)
-        f.write("\n".join(macros))
+    # Only one of the two registry files gets filled in, structs.cpp checks
+    # for PYCSTRUCT_CONSTEXPR_REGISTRY to decide which one to use.
+    if constexpr and registered:
+        with open(REGISTRY_FILE, "w") as f:
+            f.write(OVERWRITE_WARNING)
+            f.write("\n".join(constexpr_registry(registered)) + "\n")
+    else:
+        with open(MACRO_FILE, "w") as f:
+            f.write(OVERWRITE_WARNING)
+            f.write("\n".join(macros))
 
 
 def clean() -> None:
@@ -619,8 +763,12 @@ def clean() -> None:
     with open(MACRO_FILE, "w") as f:
         f.write(OVERWRITE_WARNING)
 
+    with open(REGISTRY_FILE, "w") as f:
+        f.write(OVERWRITE_WARNING)
+
 
 if __name__ == "__main__":
     clean()
     if "clean" not in sys.argv:
-        main(sys.argv[1:])
+        args = [arg for arg in sys.argv[1:] if arg != "--constexpr"]
+        main(args, constexpr="--constexpr" in sys.argv)
@@ -0,0 +1,439 @@
+#include "server.hpp"
+#include "watch.hpp"
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "utils/jstrings/jstrings.hpp"
+
+namespace js = JStrings;
+
+namespace Structs {
+
+// A connection sending a line longer than this is dropped
+static const size_t MAX_LINE = 64 * 1024;
+
+static bool socket_addr(const std::string &path, sockaddr_un *addr, std::string *err) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr->sun_path)) {
+        *err = "Invalid socket path: " + path;
+        return false;
+    }
+    memcpy(addr->sun_path, path.c_str(), path.size());
+    return true;
+}
+
+static bool send_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        const ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+static JStringList split_words(const std::string &line) {
+    JStringList args;
+    std::istringstream words(line);
+    std::string word;
+    while (words >> word) {
+        args.push_back(std::move(word));
+    }
+    return args;
+}
+
+/*================================================================================*/
+
+std::unique_ptr<Server> Server::start(const std::string &path, Transport &dev,
+                                      unsigned n_workers, std::string *err) {
+    sockaddr_un addr;
+    if (!socket_addr(path, &addr, err)) {
+        return nullptr;
+    }
+
+    // only ever replace a socket, never some other file that's in the way
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path.c_str());
+    }
+
+    std::unique_ptr<Server> server{new Server(dev)};
+    server->m_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->m_listen_fd < 0 || bind(server->m_listen_fd, (sockaddr *)&addr, sizeof(addr)) ||
+        listen(server->m_listen_fd, SOMAXCONN) || pipe2(server->m_wake_fds, O_CLOEXEC)) {
+        *err = js::fmt("Couldn't listen on %s: %s", path.c_str(), strerror(errno));
+        return nullptr;
+    }
+    server->m_path = path;
+
+    for (unsigned i = 0; i < std::max(n_workers, 1u); i++) {
+        server->m_workers.emplace_back(&Server::work, server.get());
+    }
+    server->m_io = std::thread(&Server::io_loop, server.get());
+    return server;
+}
+
+Server::~Server() {
+    stop();
+    if (m_listen_fd >= 0) {
+        close(m_listen_fd);
+    }
+    for (int fd : m_wake_fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+void Server::stop() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stop) {
+            return;
+        }
+        m_stop = true;
+    }
+    m_cv.notify_all();
+
+    if (m_wake_fds[1] >= 0) {
+        const char c = 0;
+        (void)!write(m_wake_fds[1], &c, 1);
+    }
+    if (m_io.joinable()) {
+        m_io.join();
+    }
+    for (std::thread &worker : m_workers) {
+        worker.join();
+    }
+    m_workers.clear();
+
+    // connections the I/O thread was done with but a worker never got to
+    for (const auto &conn : m_ready) {
+        if (conn->closed) {
+            close(conn->fd);
+        }
+    }
+    m_ready.clear();
+    for (const auto &conn : m_conns) {
+        close(conn.second->fd);
+    }
+    m_conns.clear();
+
+    if (!m_path.empty()) {
+        unlink(m_path.c_str());
+    }
+}
+
+/*================================================================================*/
+
+void Server::io_loop() {
+    std::vector<pollfd> fds;
+
+    while (true) {
+        fds.clear();
+        fds.push_back({m_wake_fds[0], POLLIN, 0});
+        fds.push_back({m_listen_fd, POLLIN, 0});
+        for (const auto &conn : m_conns) {
+            fds.push_back({conn.first, POLLIN, 0});
+        }
+
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if (fds[0].revents) {
+            return;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            const int fd = accept4(m_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                m_conns[fd] = std::make_shared<Conn>(fd);
+                m_n_clients++;
+            }
+        }
+
+        for (size_t i = 2; i < fds.size(); i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            const std::shared_ptr<Conn> conn = m_conns.at(fds[i].fd);
+            if (!read_conn(conn)) {
+                m_conns.erase(conn->fd);
+                close_conn(conn);
+            }
+        }
+    }
+}
+
+//
+// Read whatever the connection has sent and hand its whole lines to the
+// workers. Returns false once the connection is closed or misbehaving.
+//
+bool Server::read_conn(const std::shared_ptr<Conn> &conn) {
+    char buf[16 * 1024];
+    const ssize_t n = recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    if (n == 0) {
+        return false;
+    }
+    conn->in.append(buf, n);
+
+    size_t begin = 0;
+    std::vector<std::string> lines;
+    for (size_t end; (end = conn->in.find('\n', begin)) != std::string::npos; begin = end + 1) {
+        const size_t len = end > begin && conn->in[end - 1] == '\r' ? end - begin - 1 : end - begin;
+        lines.push_back(conn->in.substr(begin, len));
+    }
+    conn->in.erase(0, begin);
+    if (conn->in.size() > MAX_LINE) {
+        return false;
+    }
+    if (lines.empty()) {
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (std::string &line : lines) {
+            conn->lines.push_back(std::move(line));
+        }
+        if (conn->queued) {
+            return true;
+        }
+        conn->queued = true;
+        m_ready.push_back(conn);
+    }
+    m_cv.notify_one();
+    return true;
+}
+
+// The I/O thread is done with conn, close it unless a worker still has it
+void Server::close_conn(const std::shared_ptr<Conn> &conn) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    conn->closed = true;
+    if (!conn->queued) {
+        close(conn->fd);
+    }
+}
+
+/*================================================================================*/
+
+void Server::work() {
+    // every worker has its own output and request to run commands with
+    std::ostringstream out;
+    set_struct_out(&out);
+    OpReq req;
+    std::vector<XferChunk> chunks;
+    std::deque<std::string> lines;
+    std::string reply;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_cv.wait(lock, [this] { return m_stop || !m_ready.empty(); });
+        if (m_stop) {
+            break;
+        }
+
+        const std::shared_ptr<Conn> conn = std::move(m_ready.front());
+        m_ready.pop_front();
+        lines.swap(conn->lines);
+        lock.unlock();
+
+        // a whole batch of pipelined commands gets one send
+        reply.clear();
+        set_output_mode(conn->output);
+        for (const std::string &line : lines) {
+            out.str("");
+            const size_t header = reply.size();
+            run_line(line, &req, &chunks, &reply);
+            if (reply.size() == header) {
+                const std::string body = out.str();
+                reply += js::fmt("ok %lu\n", body.size()) + body;
+            }
+        }
+        lines.clear();
+        conn->output = output_mode();
+        send_all(conn->fd, reply.data(), reply.size());
+
+        // more may have come in meanwhile, go to the back of the queue so
+        // one busy client can't hog a worker
+        lock.lock();
+        if (!conn->lines.empty() && !conn->closed) {
+            m_ready.push_back(conn);
+            m_cv.notify_one();
+        } else {
+            conn->queued = false;
+            if (conn->closed) {
+                close(conn->fd);
+            }
+        }
+    }
+
+    set_struct_out(nullptr);
+}
+
+void Server::run_line(const std::string &line, OpReq *req, std::vector<XferChunk> *chunks,
+                      std::string *reply) {
+    m_n_cmds++;
+
+    std::string err;
+    const JStringList args = split_words(line);
+
+    // like ci/co, anything else on a struct doesn't interleave with commands
+    // on it from other connections
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (const Struct *s : cmd_structs(args)) {
+        locks.emplace_back(struct_mutex(s));
+    }
+
+    if (is_snapshot_cmd(args)) {
+        run_snapshot_cmd(args, m_dev, &err);
+    } else if (is_cache_cmd(args)) {
+        run_cache_cmd(args, &err);
+    } else if (is_transaction_cmd(args)) {
+        run_transaction_cmd(args, m_dev, &err);
+    } else if (is_endian_cmd(args)) {
+        run_endian_cmd(args, &err);
+    } else if (is_output_cmd(args)) {
+        run_output_cmd(args, &err);
+    } else if (is_struct_cmd(args)) {
+        if (!parse_struct_cmd(args, req)) {
+            err = req->err;
+        } else if (req->op != OpReq::PASS) {
+            std::lock_guard<std::mutex> lock(struct_mutex(req->s));
+            if (!execute_struct_req(*req, chunks, m_dev)) {
+                err = req->err;
+            }
+        }
+    } else {
+        err = "Unknown command: " + line;
+    }
+
+    if (!err.empty()) {
+        m_n_failed++;
+        *reply += js::fmt("err %lu\n", err.size()) + err;
+    }
+}
+
+/*================================================================================*/
+
+std::unique_ptr<ServerClient> ServerClient::connect(const std::string &path, std::string *err) {
+    sockaddr_un addr;
+    if (!socket_addr(path, &addr, err)) {
+        return nullptr;
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || ::connect(fd, (sockaddr *)&addr, sizeof(addr))) {
+        *err = js::fmt("Couldn't connect to %s: %s", path.c_str(), strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return nullptr;
+    }
+    return std::unique_ptr<ServerClient>(new ServerClient(fd));
+}
+
+ServerClient::~ServerClient() { close(m_fd); }
+
+bool ServerClient::send(const JStringList &args) {
+    m_out = js::join(args, " ") + "\n";
+    return send_all(m_fd, m_out.data(), m_out.size());
+}
+
+bool ServerClient::recv(bool *ok, std::string *body) {
+    char buf[16 * 1024];
+
+    // the header, then its body
+    size_t eol;
+    while ((eol = m_in.find('\n')) == std::string::npos) {
+        const ssize_t n = ::recv(m_fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            return false;
+        }
+        m_in.append(buf, n);
+    }
+
+    const std::string header = m_in.substr(0, eol);
+    const size_t space = header.find(' ');
+    if (space == std::string::npos) {
+        return false;
+    }
+    *ok = header.compare(0, space, "ok") == 0;
+    const size_t size = strtoul(header.c_str() + space + 1, nullptr, 10);
+
+    while (m_in.size() < eol + 1 + size) {
+        const ssize_t n = ::recv(m_fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            return false;
+        }
+        m_in.append(buf, n);
+    }
+    body->assign(m_in, eol + 1, size);
+    m_in.erase(0, eol + 1 + size);
+    return true;
+}
+
+/*================================================================================*/
+
+bool run_server(const JStringList &args, Transport &dev, std::string *err) {
+    using namespace std::chrono;
+
+    if (args.size() < 2 || args.size() > 4 || args[0] != "serve") {
+        *err = "Invalid args for serve, expected serve <socket> [workers] [duration]";
+        return false;
+    }
+
+    size_t n_workers = 4;
+    if (args.size() > 2 &&
+        (!parse_count(args[2], &n_workers) || n_workers == 0 || n_workers > UINT_MAX)) {
+        *err = "Invalid number of workers: " + args[2];
+        return false;
+    }
+
+    nanoseconds duration{0};
+    if (args.size() > 3 && !parse_duration(args[3], &duration)) {
+        *err = "Invalid serve duration: " + args[3];
+        return false;
+    }
+
+    std::unique_ptr<Server> server = Server::start(args[1], dev, n_workers, err);
+    if (!server) {
+        return false;
+    }
+    std::cout << js::fmt("serving on %s with %lu workers\n", args[1].c_str(), n_workers);
+
+    const auto end = steady_clock::now() + duration;
+    while (duration.count() == 0 || steady_clock::now() < end) {
+        std::this_thread::sleep_for(milliseconds(10));
+    }
+    server->stop();
+
+    std::cout << js::fmt("%lu clients, %lu commands, %lu failed\n", server->n_clients(),
+                         server->n_cmds(), server->n_failed());
+    return true;
+}
+
+} // namespace Structs
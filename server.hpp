@@ -0,0 +1,137 @@
+#pragma once
+
+#include "structs.hpp"
+#include "transport.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Structs {
+
+//
+// Serves the command interface over a UNIX domain socket, so several tools
+// on the same box can share one registry (and one device) instead of each
+// linking their own.
+//
+// Clients send commands one per line, arguments separated by whitespace like
+// on the command line, and can send as many as they like without waiting
+// for replies. Every command gets a reply, in the order they were sent: a
+// header line 'ok <n>' or 'err <n>' followed by n bytes, the command's
+// output or why it failed.
+//
+// An I/O thread reads the connections and a pool of workers runs the
+// commands. A connection's commands run one after the other on whichever
+// worker picks it up, so they see each other's effects, while different
+// connections run in parallel. Commands on the same struct take the
+// struct's mutex so they don't interleave, commands on different structs
+// don't wait for each other. ci/co/mv/struct_src/hexdump/summary/page,
+// snap/diff, cache/invalidate, begin/commit/abort, endian and output are
+// served, a connection's output mode lasting until it changes it.
+//
+// The transport is used from every worker, so it has to be safe to use
+// from several threads for different structs.
+//
+class Server {
+  public:
+    // Listen on path (replacing a stale socket there) with n_workers
+    // threads. Returns nullptr (with err set) if the socket can't be set up.
+    static std::unique_ptr<Server> start(const std::string &path, Transport &dev,
+                                         unsigned n_workers, std::string *err);
+    ~Server();
+
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+
+    // Close every connection and remove the socket
+    void stop();
+
+    size_t n_clients() const { return m_n_clients; }
+    size_t n_cmds() const { return m_n_cmds; }
+    size_t n_failed() const { return m_n_failed; }
+
+  private:
+    struct Conn {
+        explicit Conn(int fd) : fd(fd) {}
+
+        int fd;
+        std::string in;                // read but not yet a whole line, I/O thread only
+        std::deque<std::string> lines; // whole commands waiting for a worker
+        bool queued = false;           // waiting for or being run by a worker
+        bool closed = false;           // the I/O thread is done with it
+
+        // set by its output commands, workers only
+        OutputMode output = OutputMode::Text;
+    };
+
+    Server(Transport &dev) : m_dev(dev) {}
+
+    void io_loop();
+    void work();
+    bool read_conn(const std::shared_ptr<Conn> &conn);
+    void close_conn(const std::shared_ptr<Conn> &conn);
+
+    // Run one command line, its reply is appended to reply
+    void run_line(const std::string &line, OpReq *req, std::vector<XferChunk> *chunks,
+                  std::string *reply);
+
+    Transport &m_dev;
+    std::string m_path;
+    int m_listen_fd = -1;
+    int m_wake_fds[2] = {-1, -1}; // a pipe to wake the I/O thread up for stop()
+
+    std::thread m_io;
+    std::vector<std::thread> m_workers;
+    std::map<int, std::shared_ptr<Conn>> m_conns; // I/O thread only
+
+    std::mutex m_mutex; // connections' lines and flags, and m_ready
+    std::condition_variable m_cv;
+    std::deque<std::shared_ptr<Conn>> m_ready;
+    bool m_stop = false;
+
+    std::atomic<size_t> m_n_clients{0};
+    std::atomic<size_t> m_n_cmds{0};
+    std::atomic<size_t> m_n_failed{0};
+};
+
+//
+// A blocking client for a Server. send() can be called any number of times
+// before reading the replies back with recv(), in the same order.
+//
+class ServerClient {
+  public:
+    static std::unique_ptr<ServerClient> connect(const std::string &path, std::string *err);
+    ~ServerClient();
+
+    ServerClient(const ServerClient &) = delete;
+    ServerClient &operator=(const ServerClient &) = delete;
+
+    bool send(const JStringList &args);
+
+    // The next reply, ok is false if the command failed and body is why.
+    // Returns false if the connection is gone.
+    bool recv(bool *ok, std::string *body);
+
+  private:
+    explicit ServerClient(int fd) : m_fd(fd) {}
+
+    int m_fd;
+    std::string m_in;
+    std::string m_out;
+};
+
+//
+// 'serve <socket> [workers] [duration]'
+//
+// Run a server until the duration (a number with an optional ns/us/ms/s
+// suffix) is up, or forever if there isn't one. Four workers by default.
+//
+bool run_server(const JStringList &args, Transport &dev, std::string *err);
+
+} // namespace Structs
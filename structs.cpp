@@ -1,227 +1,323 @@
 /******************************************************************************
  *
- * The way this thing is supposed to work is the python script (pycstruct2.py)
+ * The way this thing is supposed to work is the python script (pycstruct3.py)
  * will parse all the source files to find instances where someone has asked
  * to register a struct. The python is then responsible for finding and parsing
- * the source code and generates the init function at the end of this file which
- * contains all the macros that create the wrappers around the structs and their
- * variables allowing their data to be accessed by name.
+ * the source code and generates the registry for this file which contains all
+ * the macros that create the wrappers around the structs and their variables
+ * allowing their data to be accessed by name.
  *
  *
  * The python script will add new static instances of all the registered
  * structs. These static instances are the memory that the struct write/read
  * functions use as the source/destination of data.
  *
- * The g_structs map is a mapping of the name of the struct, i.e. the token
- * with which the user will access this memory from the cli prompt, to a struct
- * wrapper type which contains metadata for the struct. Every registered struct
- * gets an entry into this map.
+ * Every registered struct is described by a 'Struct' descriptor containing
+ * its metadata, a pointer to the static instance memory for that struct type,
+ * its name, and a sorted array of 'Var' descriptors for its members. Anything
+ * that changes at runtime (e.g. the working address) lives in a separate
+ * 'StructState' so the descriptors themselves are constant.
  *
- * The REGISTER_INTERNAL_STRUCT macro will create a 'Struct' object and
- * initialize its members including metadata, a pointer to the static
- * instance memory for that struct type, its name, and a variable container.
+ * All the structs and members are indexed by a flat, sorted symbol table
+ * (symtab.hpp) keyed on the full "sname->vname" path. Command lookups go
+ * through that table on string_views so they never allocate, and wildcard
+ * prints only visit the range of members sharing the pattern's prefix.
  *
- * The variable registration macros add a 'Var' object to the parent structs
- * variable container and initialize the metadata and data pointers as well
- * as the getters/setters (so to speak). Because the lambdas are declared
- * in macros, all the set and print functions use '=' instead of needing
- * to copy data around through pointers. This is how the program deals with
- * bitfields. Since bitfields don't have an address, they cannot have data
- * copied to/from them via pointer and must be set by value.
+ * The registry can be generated two ways:
+ *
+ *  - By default pycstruct_macros.txt contains REGISTER_* statements which
+ *    init_structs() runs at startup to fill in the descriptors and build
+ *    the symbol table.
+ *
+ *  - With 'pycstruct3.py --constexpr', pycstruct_registry.txt contains the
+ *    descriptors and the already sorted symbol table as constexpr arrays.
+ *    They end up in .rodata, so startup does no work and the pages are
+ *    shared between every process running the program.
+ *
+ * Either way each member is described by one of the PYCSTRUCT_* descriptor
+ * macros, which initialize the metadata as well as the getters/setters (so
+ * to speak). Because the lambdas are declared in macros, all the set and
+ * print functions use '=' instead of needing to copy data around through
+ * pointers. This is how the program deals with bitfields. Since bitfields
+ * don't have an address, they cannot have data copied to/from them via
+ * pointer and must be set by value.
  *
  * The 'set' and 'print' functions have no interaction with memory outside
- * this file. They only operate on the memory in the local struct instances.
+ * the request they're given. They only operate on the request's image of the
+ * struct, which is laid out exactly like the local struct instance.
+ *
+ * For read/write operations, the image is essentially a translator for the
+ * data, the data transfer is done somewhere else (a Transport, see
+ * transport.hpp). For 'reading' from a struct that is appears to be at some
+ * offset, what is really happening is the data at that address is being
+ * copied into the request's image and the print function displays what is
+ * in the image. Same with writing, the value input from the user is parsed
+ * and put into the image and then copied out from there. Since every
+ * request has its own image and error, several threads can parse and
+ * execute commands at once, each with its own requests.
  *
- * For read/write operations, the local instances are essentially a translator
- * for the data, the data transfer is done somewhere else. For 'reading' from
- * a struct that is appears to be at some offset, what is really happening is
- * the data at that address is being copied into the local struct instance
- * and the print function displays what is in the local instance memory. Same
- * with writing, the value input from the user is parsed and put into local
- * memory and then copied out from the local instance.
+ * If the device memory is already mapped into this process, bind_struct()
+ * points a struct at it. Requests for a bound struct use the mapped memory
+ * as their image, so set/print work on it in place and nothing is copied.
  *
- * Since bitfields don't have an address the data pointer returned by the
- * read/write request is the base address of the whole struct. Arrays will
- * also read/write the full size regardless of which values are being messed
- * with.
+ * Since bitfields don't have an address, where each one lives is found by
+ * setting all its bits in a zeroed image. The read/write request for a
+ * bitfield only covers the storage unit(s) of its type holding those bits,
+ * and says where in them the bits are so a device that supports masked
+ * writes can skip the read. Likewise array requests only cover the span of
+ * elements in their slice, and list the runs of elements when the slice
+ * has gaps so a device that supports vectored transfers can skip the gaps.
+ *
+ * Snapshots are whole struct images kept by name. Diffing two of them finds
+ * the changed byte runs and maps them back to the members (and bitfield
+ * bits, and array elements) they belong to, so only those get printed.
+ *
+ * Executed commands can be recorded into a binary log of resolved requests
+ * (symbol index, offsets, raw value bytes), which replays without going
+ * through the string parsing at all.
  *
  ******************************************************************************/
 
 #include "structs.hpp"
+#include "format.hpp"
+#include "symtab.hpp"
 
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <climits>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <deque>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <mutex>
 #include <stdexcept>
 #include <sys/stat.h>
+#include <thread>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "utils/datetime/datetime.hpp"
 #include "utils/jstrings/jstrings.hpp"
 
-static std::string s_err;
-
 namespace js = JStrings;
 
-// The print here allows for printing all partial variable name matches. Makes things
-// like name->plpl* possible.
-#define REGISTER_INTERNAL_STRUCT(structtype, sname, src_path, raw_src)                             \
-    g_structs.emplace(#sname, Struct());                                                           \
-    g_structs.at(#sname).data = (uint8_t *)&sname;                                                 \
-    g_structs.at(#sname).size = sizeof(sname);                                                     \
-    g_structs.at(#sname).name = #sname;                                                            \
-    g_structs.at(#sname).type = #structtype;                                                       \
-    g_structs.at(#sname).src_filepath = src_path;                                                  \
-    g_structs.at(#sname).src_definition = raw_src;                                                 \
-    g_structs.at(#sname).print = [](const JStringList &args) {                                     \
-        const std::string partial_name = js::strip(args[1], "*");                                  \
-        for (const auto &var : g_structs.at(#sname).vars) {                                        \
-            if (js::contains(#sname "->" + var.first, partial_name)) {                             \
-                var.second.print(args);                                                            \
-            }                                                                                      \
-        }                                                                                          \
-        std::cout << "\n";                                                                         \
-    };
-
-#define REGISTER_VAR(sname, vname, ctype, printf_fmt, stonum)                                      \
-    assert(g_structs.count(#sname) && "Trying to register var with unregistered struct: " #sname); \
-    g_structs.at(#sname).vars.emplace(#vname, Var());                                              \
-    g_structs.at(#sname).vars.at(#vname).type = Var::VarType::Std;                                 \
-    g_structs.at(#sname).vars.at(#vname).data = (uint8_t *)&sname.vname;                           \
-    g_structs.at(#sname).vars.at(#vname).size = sizeof(sname.vname);                               \
-    g_structs.at(#sname).vars.at(#vname).sizeof_ctype = sizeof(sname.vname);                       \
-    g_structs.at(#sname).vars.at(#vname).offset = (size_t)&sname.vname - (size_t)&sname;           \
-    g_structs.at(#sname).vars.at(#vname).name = #vname;                                            \
-    g_structs.at(#sname).vars.at(#vname).set = [](const JStringList &args) {                       \
-        ctype val = cout_##stonum(args[2]);                                                        \
-        if (s_err.length() == 0) {                                                                 \
-            sname.vname = val;                                                                     \
-        }                                                                                          \
-    };                                                                                             \
-    g_structs.at(#sname).vars.at(#vname).print = [](const JStringList &args) {                     \
-        (void)args;                                                                                \
-        std::cout << js::fmt(#sname "->" #vname " = " printf_fmt "\n", sname.vname);               \
-    };
+//
+// Descriptor macros. Each one expands to a constant expression so the same
+// macro can fill in a constexpr array or be registered at startup.
+//
+#define PYCSTRUCT_STRUCT(structtype, sname, src_path, raw_src, vars, n_vars, state, count, stride) \
+    Struct {                                                                                       \
+        &sname, sizeof(sname), alignof(decltype(sname)), #sname, #structtype, src_path, raw_src,   \
+            vars, n_vars, state, count, stride                                                     \
+    }
 
-#define REGISTER_CHAR_ARR(sname, vname)                                                            \
-    assert(g_structs.count(#sname) && "Trying to register var with unregistered struct: " #sname); \
-    g_structs.at(#sname).vars.emplace(#vname, Var());                                              \
-    g_structs.at(#sname).vars.at(#vname).type = Var::VarType::Std;                                 \
-    g_structs.at(#sname).vars.at(#vname).data = (uint8_t *)&sname.vname;                           \
-    g_structs.at(#sname).vars.at(#vname).size = sizeof(sname.vname);                               \
-    g_structs.at(#sname).vars.at(#vname).sizeof_ctype = sizeof(char);                              \
-    g_structs.at(#sname).vars.at(#vname).offset = (size_t)&sname.vname - (size_t)&sname;           \
-    g_structs.at(#sname).vars.at(#vname).name = #vname;                                            \
-    g_structs.at(#sname).vars.at(#vname).set = [](const JStringList &args) {                       \
-        std::string s = args[2];                                                                   \
-        for (size_t i = 3; i < args.size(); i++) {                                                 \
-            s += " " + args[i];                                                                    \
-        }                                                                                          \
-        strncpy(sname.vname, s.c_str(), sizeof(sname.vname) - 1);                                  \
-        sname.vname[sizeof(sname.vname) - 1] = '\0';                                               \
-    };                                                                                             \
-    g_structs.at(#sname).vars.at(#vname).print = [](const JStringList &args) {                     \
-        (void)args;                                                                                \
-        sname.vname[sizeof(sname.vname) - 1] = '\0';                                               \
-        std::cout << js::fmt(#sname "->" #vname " = \"%s\"", sname.vname);                         \
-    };
+// The struct image a request's set/print functions work on, typed as the
+// struct so members (including bitfields) can be accessed by name.
+#define PYCSTRUCT_IMAGE(sname, req) ((decltype(&sname))(req).base)
+
+#define PYCSTRUCT_VAR(sname, vname, ctype, fmt_tag, stonum)                                        \
+    Var {                                                                                          \
+        Var::VarType::Std, #vname, sizeof(sname.vname), sizeof(sname.vname),                       \
+            offsetof(decltype(sname), vname),                                                      \
+            [](OpReq &req) {                                                                       \
+                ctype val = js::stonum((*req.args)[2], &req.err);                                  \
+                if (req.err.length() == 0) {                                                       \
+                    PYCSTRUCT_IMAGE(sname, req)->vname = val;                                      \
+                }                                                                                  \
+            },                                                                                     \
+            [](const OpReq &req) {                                                                 \
+                OutBuf &out = out_buf();                                                           \
+                out.append(#sname "->" #vname " = ");                                              \
+                out.value<MemberFmt<fmt_tag>>(PYCSTRUCT_IMAGE(sname, req)->vname);                 \
+                out.put('\n');                                                                     \
+            },                                                                                     \
+            [](const OpReq &req) {                                                                 \
+                OutBuf out;                                                                        \
+                out.value<MemberFmt<fmt_tag>>(PYCSTRUCT_IMAGE(sname, req)->vname);                 \
+                return out.str();                                                                  \
+            },                                                                                     \
+            [](const uint8_t *base, size_t, OutputMode mode, OutBuf &out) {                        \
+                put_value(mode, out, (ctype)((decltype(&sname))base)->vname);                      \
+            },                                                                                     \
+            nullptr,                                                                               \
+            nullptr                                                                                \
+    }
 
-#define REGISTER_BITFIELD(sname, vname, ctype, printf_fmt, stonum)                                 \
-    assert(g_structs.count(#sname) && "Trying to register var with unregistered struct: " #sname); \
-    g_structs.at(#sname).vars.emplace(#vname, Var());                                              \
-    g_structs.at(#sname).vars.at(#vname).type = Var::VarType::BField;                              \
-    g_structs.at(#sname).vars.at(#vname).data = (uint8_t *)&sname;                                 \
-    g_structs.at(#sname).vars.at(#vname).size = sizeof(sname);                                     \
-    g_structs.at(#sname).vars.at(#vname).sizeof_ctype = sizeof(ctype);                             \
-    g_structs.at(#sname).vars.at(#vname).offset = 0;                                               \
-    g_structs.at(#sname).vars.at(#vname).name = #vname;                                            \
-    g_structs.at(#sname).vars.at(#vname).set = [](const JStringList &args) {                       \
-        ctype val = cout_##stonum(args[2]);                                                        \
-        if (s_err.length() == 0) {                                                                 \
-            sname.vname = val;                                                                     \
-        }                                                                                          \
-    };                                                                                             \
-    g_structs.at(#sname).vars.at(#vname).print = [](const JStringList &args) {                     \
-        (void)args;                                                                                \
-        std::cout << js::fmt(#sname "->" #vname " = " printf_fmt "\n", sname.vname);               \
-    };
+#define PYCSTRUCT_CHAR_ARR(sname, vname)                                                           \
+    Var {                                                                                          \
+        Var::VarType::Std, #vname, sizeof(sname.vname), sizeof(char),                              \
+            offsetof(decltype(sname), vname),                                                      \
+            [](OpReq &req) {                                                                       \
+                std::string s = (*req.args)[2];                                                    \
+                for (size_t i = 3; i < req.args->size(); i++) {                                    \
+                    s += " " + (*req.args)[i];                                                     \
+                }                                                                                  \
+                char *str = PYCSTRUCT_IMAGE(sname, req)->vname;                                    \
+                strncpy(str, s.c_str(), sizeof(sname.vname) - 1);                                  \
+                str[sizeof(sname.vname) - 1] = '\0';                                               \
+            },                                                                                     \
+            [](const OpReq &req) {                                                                 \
+                /* the image may be mapped memory, so don't terminate it in place */               \
+                const char *str = PYCSTRUCT_IMAGE(sname, req)->vname;                              \
+                OutBuf &out = out_buf();                                                           \
+                out.append(#sname "->" #vname " = \"");                                            \
+                out.append(str, strnlen(str, sizeof(sname.vname) - 1));                            \
+                out.put('"');                                                                      \
+            },                                                                                     \
+            [](const OpReq &req) {                                                                 \
+                const char *str = PYCSTRUCT_IMAGE(sname, req)->vname;                              \
+                return js::fmt("\"%.*s\"", (int)strnlen(str, sizeof(sname.vname) - 1), str);       \
+            },                                                                                     \
+            [](const uint8_t *base, size_t, OutputMode mode, OutBuf &out) {                        \
+                const char *str = ((decltype(&sname))base)->vname;                                 \
+                put_string(mode, out, {str, strnlen(str, sizeof(sname.vname) - 1)});               \
+            },                                                                                     \
+            nullptr,                                                                               \
+            nullptr                                                                                \
+    }
 
-#define REGISTER_ARR(sname, vname, length, ctype, printf_fmt, stonum)                              \
-    assert(g_structs.count(#sname) && "Trying to register var with unregistered struct: " #sname); \
-    g_structs.at(#sname).vars.emplace(#vname, Var());                                              \
-    g_structs.at(#sname).vars.at(#vname).type = Var::VarType::Array;                               \
-    g_structs.at(#sname).vars.at(#vname).data = (uint8_t *)&sname.vname;                           \
-    g_structs.at(#sname).vars.at(#vname).size = sizeof(sname.vname);                               \
-    g_structs.at(#sname).vars.at(#vname).sizeof_ctype = sizeof(ctype);                             \
-    g_structs.at(#sname).vars.at(#vname).offset = (size_t)&sname.vname[0] - (size_t)&sname;        \
-    g_structs.at(#sname).vars.at(#vname).name = #vname;                                            \
-    g_structs.at(#sname).vars.at(#vname).set = [](const JStringList &args) {                       \
-        std::vector<int> indices = get_array_slice_indices(args[1], length);                       \
-        for (size_t i = 0; i < indices.size() && i < args.size() - 2; i++) {                       \
-            ctype val = cout_##stonum(args[i + 2]);                                                \
-            if (s_err.size() == 0) {                                                               \
-                sname.vname[indices[i]] = val;                                                     \
-            } else {                                                                               \
-                return;                                                                            \
+// Bitfields have no address or offsetof(), so where one lives is found by
+// setting all of its bits in a zeroed image.
+#define PYCSTRUCT_BITFIELD(sname, vname, ctype, fmt_tag, stonum)                                   \
+    Var {                                                                                          \
+        Var::VarType::BField, #vname, sizeof(sname), sizeof(ctype), 0,                             \
+            [](OpReq &req) {                                                                       \
+                ctype val = js::stonum((*req.args)[2], &req.err);                                  \
+                if (req.err.length() == 0) {                                                       \
+                    PYCSTRUCT_IMAGE(sname, req)->vname = val;                                      \
+                }                                                                                  \
+            },                                                                                     \
+            [](const OpReq &req) {                                                                 \
+                OutBuf &out = out_buf();                                                           \
+                out.append(#sname "->" #vname " = ");                                              \
+                out.value<MemberFmt<fmt_tag, true>>(PYCSTRUCT_IMAGE(sname, req)->vname);           \
+                out.put('\n');                                                                     \
+            },                                                                                     \
+            [](const OpReq &req) {                                                                 \
+                OutBuf out;                                                                        \
+                out.value<MemberFmt<fmt_tag, true>>(PYCSTRUCT_IMAGE(sname, req)->vname);           \
+                return out.str();                                                                  \
+            },                                                                                     \
+            [](const uint8_t *base, size_t, OutputMode mode, OutBuf &out) {                        \
+                put_value(mode, out, (ctype)((decltype(&sname))base)->vname);                      \
+            },                                                                                     \
+            nullptr,                                                                               \
+            []() {                                                                                 \
+                alignas(decltype(sname)) uint8_t image[sizeof(sname)] = {};                        \
+                auto probe = (decltype(&sname))image;                                              \
+                probe->vname = ~probe->vname;                                                      \
+                return find_set_bits(image, sizeof(sname));                                        \
             }                                                                                      \
-        }                                                                                          \
-    };                                                                                             \
-    g_structs.at(#sname).vars.at(#vname).print = [](const JStringList &args) {                     \
-        auto indices = get_array_slice_indices(args[1], length);                                   \
-        for (int i : indices) {                                                                    \
-            std::cout << js::fmt(#sname "->" #vname "[%3d] = " printf_fmt "\n", i,                 \
-                                 sname.vname[i]);                                                  \
-        }                                                                                          \
-    };
+    }
 
-/*================================================================================*/
+#define PYCSTRUCT_ARR(sname, vname, length, ctype, fmt_tag, stonum)                                \
+    Var {                                                                                          \
+        Var::VarType::Array, #vname, sizeof(sname.vname), sizeof(ctype),                           \
+            offsetof(decltype(sname), vname),                                                      \
+            [](OpReq &req) {                                                                       \
+                for (size_t i = 0; i < req.indices.size() && i + 2 < req.args->size(); i++) {      \
+                    ctype val = js::stonum((*req.args)[i + 2], &req.err);                          \
+                    if (req.err.size() == 0) {                                                     \
+                        PYCSTRUCT_IMAGE(sname, req)->vname[req.indices[i]] = val;                  \
+                    } else {                                                                       \
+                        return;                                                                    \
+                    }                                                                              \
+                }                                                                                  \
+            },                                                                                     \
+            [](const OpReq &req) {                                                                 \
+                OutBuf &out = out_buf();                                                           \
+                /* the whole array when printed as part of the struct */                           \
+                const size_t n = req.v ? req.indices.size() : length;                              \
+                for (size_t j = 0; j < n; j++) {                                                   \
+                    const int i = req.v ? req.indices[j] : (int)j;                                 \
+                    out.append(#sname "->" #vname "[");                                            \
+                    out.value<IndexFmt>(i);                                                        \
+                    out.append("] = ");                                                            \
+                    out.value<MemberFmt<fmt_tag>>(PYCSTRUCT_IMAGE(sname, req)->vname[i]);          \
+                    out.put('\n');                                                                 \
+                }                                                                                  \
+            },                                                                                     \
+            [](const OpReq &req) {                                                                 \
+                OutBuf out;                                                                        \
+                const size_t n = req.v ? req.indices.size() : length;                              \
+                for (size_t j = 0; j < n; j++) {                                                   \
+                    const int i = req.v ? req.indices[j] : (int)j;                                 \
+                    if (j) {                                                                       \
+                        out.put(' ');                                                              \
+                    }                                                                              \
+                    out.value<MemberFmt<fmt_tag>>(PYCSTRUCT_IMAGE(sname, req)->vname[i]);          \
+                }                                                                                  \
+                return out.str();                                                                  \
+            },                                                                                     \
+            [](const uint8_t *base, size_t i, OutputMode mode, OutBuf &out) {                      \
+                put_value(mode, out, ((decltype(&sname))base)->vname[i]);                          \
+            },                                                                                     \
+            [](const OpReq &req, const uint8_t *base, OutBuf &out) {                               \
+                summarize_array<MemberFmt<fmt_tag>>(#sname "->" #vname,                            \
+                                                    ((decltype(&sname))base)->vname, req, out);    \
+            },                                                                                     \
+            nullptr                                                                                \
+    }
 
 //
-// make the macros a little smaller
+// Startup registration, used when the registry isn't generated as constexpr.
+// The python emits the member macros right after the struct they belong to.
 //
+#define REGISTER_INTERNAL_STRUCT(structtype, sname, src_path, raw_src)                             \
+    REGISTER_INTERNAL_BANK(structtype, sname, src_path, raw_src, 1, sizeof(sname))
 
-static unsigned long cout_stoul_0x(const std::string &str) {
-    unsigned long val = js::stoul_0x(str, &s_err);
-    if (s_err.length() > 0) {
-        std::cout << "Failed " << s_err << "\n";
-    }
-    return val;
-}
-static long cout_stol(const std::string &str) {
-    long val = js::stol(str, &s_err);
-    if (s_err.length() > 0) {
-        std::cout << "Failed " << s_err << "\n";
-    }
-    return val;
-}
-static double cout_stod(const std::string &str) {
-    double val = js::stod(str, &s_err);
-    if (s_err.length() > 0) {
-        std::cout << "Failed " << s_err << "\n";
-    }
-    return val;
-}
+#define REGISTER_INTERNAL_BANK(structtype, sname, src_path, raw_src, count, stride)                \
+    g_rt_states.emplace_back();                                                                    \
+    g_rt_vars.emplace_back();                                                                      \
+    g_rt_structs.push_back(PYCSTRUCT_STRUCT(structtype, sname, src_path, raw_src, nullptr, 0,      \
+                                            &g_rt_states.back(), count, stride));
+
+#define REGISTER_MEMBER(sname, var)                                                                \
+    assert(!g_rt_structs.empty() && !strcmp(g_rt_structs.back().name, #sname) &&                   \
+           "Trying to register var with unregistered struct: " #sname);                            \
+    g_rt_vars.back().push_back(var);
+
+#define REGISTER_VAR(sname, vname, ctype, fmt_tag, stonum)                                         \
+    REGISTER_MEMBER(sname, PYCSTRUCT_VAR(sname, vname, ctype, fmt_tag, stonum))
+
+#define REGISTER_CHAR_ARR(sname, vname) REGISTER_MEMBER(sname, PYCSTRUCT_CHAR_ARR(sname, vname))
+
+#define REGISTER_BITFIELD(sname, vname, ctype, fmt_tag, stonum)                                    \
+    REGISTER_MEMBER(sname, PYCSTRUCT_BITFIELD(sname, vname, ctype, fmt_tag, stonum))
+
+#define REGISTER_ARR(sname, vname, length, ctype, fmt_tag, stonum)                                 \
+    REGISTER_MEMBER(sname, PYCSTRUCT_ARR(sname, vname, length, ctype, fmt_tag, stonum))
 
 /*================================================================================*/
 
 //
 // When setting/printing values from a struct member that is an array,
-// this function will return a vector of the indices into the array
+// this function will fill in a vector of the indices into the array
 // that correspond to the cli input. The input can be single value,
 // a comma separated list, or python style slice.
 // - [2]
 // - [2,3,6]
 // - [2:6] --> [2,3,4,5]
 // - [:] --> [0,1,...]
+// - [1:8:3] --> [1,4,7]
 //
-static std::vector<int> get_array_slice_indices(const std::string &arg, int index_limit) {
+static bool get_array_slice_indices(const std::string &arg, int index_limit,
+                                    std::vector<int> *indices, std::string *err) {
 
     const std::string brace_contents =
         js::contains_all(arg, "[]") ? js::slice(arg, arg.find('[') + 1, arg.find(']')) : ":";
 
-    std::vector<int> indices;
+    indices->clear();
 
     try {
 
@@ -230,122 +326,421 @@ static std::vector<int> get_array_slice_indices(const std::string &arg, int inde
 
             const auto brace_split = js::split(brace_contents, ":", js::TrimAll);
 
-            int start = 0;
+            // parsed as long and range checked before they're narrowed, so
+            // nothing out of range wraps around or overflows the loop
+            long start = 0;
             if (brace_split.at(0).length() > 0) {
                 start = std::stol(brace_split.at(0));
 
                 if (start < 0) {
-                    start = index_limit - start;
-                } else if (start >= index_limit) {
-                    throw std::runtime_error{nullptr};
+                    start = index_limit + start;
+                }
+                if (start < 0 || start >= index_limit) {
+                    throw std::out_of_range{"slice"};
                 }
             }
 
-            int stop = index_limit;
+            long stop = index_limit;
             if (brace_split.at(1).length() > 0) {
                 stop = std::stol(brace_split.at(1));
 
                 if (stop < 0) {
-                    stop = index_limit - stop;
-                } else if (stop >= index_limit) {
-                    throw std::runtime_error{nullptr};
+                    stop = index_limit + stop;
+                }
+                if (stop < 0 || stop > index_limit) {
+                    throw std::out_of_range{"slice"};
+                }
+            }
+
+            long step = 1;
+            if (brace_split.size() > 2 && brace_split.at(2).length() > 0) {
+                step = std::stol(brace_split.at(2));
+
+                if (step <= 0) {
+                    throw std::out_of_range{"slice"};
                 }
+                // any bigger step only takes the start
+                step = std::min(step, (long)index_limit);
+            }
+            if (brace_split.size() > 3) {
+                throw std::out_of_range{"slice"};
             }
 
-            for (int i = start; i < stop; i++) {
-                indices.push_back(i);
+            for (long i = start; i < stop; i += step) {
+                indices->push_back((int)i);
             }
 
         } else {
             // csv
             const auto brace_split = js::split(brace_contents, ",", js::TrimAll | js::SkipEmpty);
             for (const std::string &s : brace_split) {
-                int i = std::stol(s);
+                long i = std::stol(s);
 
                 if (i < 0) {
-                    i = index_limit - i;
-                } else if (i >= index_limit) {
-                    throw std::runtime_error{nullptr};
+                    i = index_limit + i;
+                }
+                if (i < 0 || i >= index_limit) {
+                    throw std::out_of_range{"slice"};
                 }
 
-                indices.push_back(i);
+                indices->push_back((int)i);
             }
         }
 
     } catch (const std::exception & /*e*/) {
-        std::cout << "Invalid array indexing: " << brace_contents << "\n";
-        return {};
+        *err = "Invalid array indexing: " + brace_contents;
+        indices->clear();
+        return false;
     }
 
-    return indices;
+    return true;
 }
 
 /*================================================================================*/
 
 namespace Structs {
 
+//
+// The bits a bitfield member occupies within its struct, numbering bit 0 as
+// the low bit of byte 0.
+//
+struct BitRange {
+    size_t first;
+    size_t count;
+};
+
+//
+// Find the bits that were set in a zeroed struct image after setting every
+// bit of one member.
+//
+static BitRange find_set_bits(const uint8_t *image, size_t size) {
+    BitRange bits{0, 0};
+    size_t last = 0;
+    for (size_t i = 0; i < size * CHAR_BIT; i++) {
+        if (image[i / CHAR_BIT] & (1u << (i % CHAR_BIT))) {
+            if (bits.count == 0) {
+                bits.first = i;
+            }
+            bits.count = 1;
+            last = i;
+        }
+    }
+    if (bits.count) {
+        bits.count = last - bits.first + 1;
+    }
+    return bits;
+}
+
 struct Var {
     enum class VarType { Std, BField, Array } type;
-    uint8_t *data;
+    const char *name;
     size_t size;
     size_t sizeof_ctype;
     size_t offset;
-    std::string name;
-    void (*set)(const JStringList &);
-    void (*print)(const JStringList &);
+    void (*set)(OpReq &);
+    void (*print)(const OpReq &);
+    std::string (*format)(const OpReq &); // just the value(s) print shows
+    // the value (element i of an array) of the struct at base in a machine
+    // readable mode
+    void (*emit)(const uint8_t *base, size_t i, OutputMode mode, OutBuf &out);
+    // arrays only, a summary command's output for the struct at base
+    void (*summarize)(const OpReq &req, const uint8_t *base, OutBuf &out);
+    BitRange (*bits)(); // bitfields only, scans a struct image so see var_bits()
+};
+
+//
+// A struct's read cache. Members are volatile unless they've been marked
+// cacheable with a TTL (0 meaning until invalidated). The image holds the
+// struct at addr as it was last read or written, and a member is served
+// from it while it's fresh: loaded since the last invalidation and not
+// older than its TTL.
+//
+struct StructCache {
+    std::atomic<bool> enabled{false}; // any member is cacheable
+    std::mutex mutex;
+    size_t addr = 0;
+    std::vector<uint8_t> image;
+    std::vector<int64_t> ttl_ns;    // per member, -1 for volatile
+    std::vector<int64_t> loaded_ns; // per member, -1 if it isn't in the image
+};
+
+//
+// An open transaction on a struct. Writes go to the struct's static instance
+// instead of the device, and dirty has every bit they set, so a commit only
+// writes those.
+//
+struct StructTransaction {
+    std::mutex mutex;
+    bool open = false;
+    size_t addr = 0;
+    std::vector<uint8_t> dirty;
+
+    // while recording, the log records of its writes, only written to the
+    // log if it's committed
+    std::vector<uint8_t> log;
+};
+
+//
+// A run of count units of the same size in a struct's image, each of which
+// has its bytes the other way round on a device of the other byte order
+//
+struct SwapRun {
+    size_t struct_offset;
+    size_t unit; // 2, 4 or 8
+    size_t count;
+};
+
+struct StructState {
+    std::atomic<size_t> working_addr{0};
+    std::mutex mutex; // see struct_mutex()
+
+    // set by bind_struct()
+    uint8_t *mapped = nullptr;
+    size_t mapped_length = 0;
+
+    // set by set_endian(): the device has the struct in the other byte order
+    bool swapped = false;
+    std::vector<SwapRun> swaps; // sorted, not overlapping
+
+    StructCache cache;
+    StructTransaction txn;
+
+    // per member, where each bitfield's bits are, found once by init_structs()
+    std::vector<BitRange> bits;
 };
 
 struct Struct {
-    uint8_t *data = nullptr;
-    size_t size = 0;
-    std::string name;
-    std::string type;
-    std::string src_filepath;
-    std::string src_definition;
-    void (*print)(const JStringList &);
-    std::map<std::string, Var> vars;
-    size_t working_addr = 0;
+    void *data;
+    size_t size;
+    size_t align;
+    const char *name;
+    const char *type;
+    const char *src_filepath;
+    const char *src_definition;
+    const Var *vars; // sorted by name
+    size_t n_vars;
+    StructState *state;
+
+    // banks of identical structs, 1 and sizeof the struct otherwise
+    size_t count;  // instances, more than 1 for a bank
+    size_t stride; // bytes from one instance to the next
+};
+
+// Where a bitfield member of s is, without scanning an image of s
+static const BitRange &var_bits(const Struct *s, const Var *v) {
+    return s->state->bits[v - s->vars];
+}
+
+// A PYCSTRUCT_CACHEABLE() annotation, ttl_ms < 0 marks members volatile
+struct CacheRule {
+    const char *sname;
+    const char *pattern;
+    long ttl_ms;
+};
+
+// A PYCSTRUCT_ENDIAN() annotation
+struct EndianRule {
+    const char *sname;
+    const char *endian;
+};
+
+// What the print functions write, until it's flushed to struct_out() in one
+// go at the end of the command
+static thread_local OutBuf t_buf;
+
+static OutBuf &out_buf() { return t_buf; }
+
+// How print functions number array elements
+struct IndexFmt {
+    static constexpr const char *fmt = "%3d";
+    static constexpr FmtSpec spec = parse_fmt(fmt);
 };
 
-std::map<std::string, Struct> g_structs;
+// A value written by a member's emit function
+template <typename T> static void put_value(OutputMode mode, OutBuf &out, T val) {
+    if (mode == OutputMode::Binary) {
+        out.append((const char *)&val, sizeof(val));
+        return;
+    }
+    if constexpr (std::is_floating_point<T>::value) {
+        if (mode == OutputMode::Json && !std::isfinite(val)) {
+            out.append("null");
+            return;
+        }
+    }
+    out.number(val);
+}
+
+// Same for char arrays, which a registry might not have any of
+[[maybe_unused]] static void put_string(OutputMode mode, OutBuf &out, std::string_view s) {
+    if (mode == OutputMode::Json) {
+        out.json_string(s);
+    } else if (mode == OutputMode::Csv) {
+        out.csv_string(s);
+    } else {
+        out.append(s);
+    }
+}
+
+//
+// The min, max and sum of the n (> 0) elements at a, for any other type
+// than float and double
+//
+template <typename T> static void reduce_array(const T *a, size_t n, T *min, T *max, double *sum) {
+    using Sum = std::conditional_t<std::is_integral<T>::value,
+                                   std::conditional_t<std::is_signed<T>::value, int64_t, uint64_t>,
+                                   double>;
+    T lo = a[0];
+    T hi = a[0];
+    Sum total = 0;
+    for (size_t i = 0; i < n; i++) {
+        lo = std::min(lo, a[i]);
+        hi = std::max(hi, a[i]);
+        total += a[i];
+    }
+    *min = lo;
+    *max = hi;
+    *sum = total;
+}
+
+//
+// A summary command's output for the elements of array the request covers,
+// F being the array's MemberFmt. A slice without gaps is reduced in one go.
+//
+template <typename F, typename T, size_t N>
+static void summarize_array(const char *path, const T (&array)[N], const OpReq &req, OutBuf &out) {
+    const std::vector<int> &indices = req.indices;
+    const size_t count = indices.size();
+
+    out.append(path);
+    out.append(": ");
+    out.number(count);
+    out.append(" elements");
+    if (count > 0) {
+        T min;
+        T max;
+        double sum;
+        // csv lists can repeat or reorder elements, so the ends alone don't
+        // say it's a run
+        const bool run = std::adjacent_find(indices.begin(), indices.end(), [](int a, int b) {
+                             return b != a + 1;
+                         }) == indices.end();
+        if (run) {
+            reduce_array(&array[indices.front()], count, &min, &max, &sum);
+        } else {
+            min = max = array[indices[0]];
+            sum = 0;
+            for (const int i : indices) {
+                min = std::min(min, array[i]);
+                max = std::max(max, array[i]);
+                sum += array[i];
+            }
+        }
+        out.append(", min ");
+        out.number(min);
+        out.append(", max ");
+        out.number(max);
+        out.append(", sum ");
+        out.number(sum);
+        out.append(", mean ");
+        out.number(sum / count);
+    }
+    out.put('\n');
+
+    // the first and last n_edge elements, the way ci prints them
+    const auto print = [&](size_t begin, size_t end) {
+        for (size_t j = begin; j < end; j++) {
+            out.append(path);
+            out.put('[');
+            out.value<IndexFmt>(indices[j]);
+            out.append("] = ");
+            out.value<F>(array[indices[j]]);
+            out.put('\n');
+        }
+    };
+    const size_t head = std::min(count, req.n_edge);
+    const size_t tail = count > 2 * req.n_edge ? count - req.n_edge : head;
+    print(0, head);
+    if (tail > head) {
+        out.append("...\n");
+    }
+    print(tail, count);
+}
+
+/*================================================================================*/
+
+// include the static struct instances generated by the python
+#include "pycstruct_instances.txt"
+
+// include the constexpr registry generated by 'pycstruct3.py --constexpr'
+#include "pycstruct_registry.txt"
+
+#ifdef PYCSTRUCT_CONSTEXPR_REGISTRY
+static constexpr SymbolTable g_symbols{std::begin(pycstruct_symbols), std::end(pycstruct_symbols)};
+#else
+// Storage for the registry when it's built by init_structs()
+static std::deque<Struct> g_rt_structs;
+static std::deque<StructState> g_rt_states;
+static std::deque<std::vector<Var>> g_rt_vars;
+static std::vector<Sym> g_rt_syms;
+static SymbolTable g_symbols;
+
+static void index_structs() {
+    for (size_t i = 0; i < g_rt_structs.size(); i++) {
+        Struct &s = g_rt_structs[i];
+        std::vector<Var> &vars = g_rt_vars[i];
+
+        std::sort(vars.begin(), vars.end(),
+                  [](const Var &a, const Var &b) { return strcmp(a.name, b.name) < 0; });
+        s.vars = vars.data();
+        s.n_vars = vars.size();
+
+        g_rt_syms.push_back({s.name, {}, &s, nullptr});
+        for (const Var &v : vars) {
+            g_rt_syms.push_back({s.name, v.name, &s, &v});
+        }
+    }
+
+    g_symbols = SymbolTable::sorted(&g_rt_syms);
+}
+#endif
+
+/*================================================================================*/
 
 //
 // Try to find a registered struct matchintg the provided name+member name.
 //
 // A struct name is required, but a member name is not. If no member name is
 // provided it will return a pointer to the struct but no var. If a member name
-// is provided (without a '*' wildcard) and the member isn't found, returns an error.
+// is provided (without a '*' or '?' wildcard) and the member isn't found, returns
+// an error.
+//
+// Lookups go through the flat symbol table and don't allocate.
 //
-std::pair<Struct *, Var *> get_struct(const std::string &svname) {
+std::pair<const Struct *, const Var *> get_struct(std::string_view svname) {
 
-    const auto strs = js::split(svname, "->", js::TrimAll);
+    std::string_view sname;
+    std::string_view vname;
 
-    if (strs.size() != 2) {
-        std::cout << "Invalid struct name\n";
+    if (!split_path(svname, &sname, &vname)) {
         return {};
     }
 
-    const std::string sname = strs[0];
-    std::string vname = strs[1];
-
-    if (!g_structs.count(sname)) {
+    const Sym *struct_sym = g_symbols.find(sname, {});
+    if (!struct_sym) {
         return {};
     }
 
-    Struct *s = &g_structs.at(sname);
-    Var *v = nullptr;
-
-    if (js::contains_all(vname, "[]")) {
-        js::slice(&vname, 0, vname.find('['));
-    }
+    const Struct *s = struct_sym->s;
+    const Var *v = nullptr;
 
     if (vname.length() > 0) {
 
-        if (s->vars.count(vname)) {
+        if (const Sym *var_sym = g_symbols.find(sname, vname)) {
             // retrieve the sruct member
-            v = &g_structs.at(sname).vars.at(vname);
-        } else if (vname.back() == '*') {
-            // allow wildcard passing through
+            v = var_sym->v;
+        } else if (is_glob(vname)) {
+            // allow wildcards passing through
         } else {
             // if a name was provided but not found, error
             return {};
@@ -355,8 +750,90 @@ std::pair<Struct *, Var *> get_struct(const std::string &svname) {
     return {s, v};
 }
 
+static thread_local std::ostream *t_out = nullptr;
+
+std::ostream &struct_out() {
+    std::ostream &out = t_out ? *t_out : std::cout;
+    if (!t_buf.empty()) {
+        out.write(t_buf.str().data(), t_buf.str().size());
+        t_buf.clear();
+    }
+    return out;
+}
+
+void set_struct_out(std::ostream *out) {
+    struct_out();
+    t_out = out;
+}
+
+void flush_struct_out() { struct_out(); }
+
+std::mutex &struct_mutex(const Struct *s) { return s->state->mutex; }
+
+static thread_local OutputMode t_output = OutputMode::Text;
+
+static const char *const OUTPUT_MODES[] = {"text", "json", "csv", "binary"};
+
+static bool parse_output_mode(std::string_view name, OutputMode *mode) {
+    for (size_t i = 0; i < std::size(OUTPUT_MODES); i++) {
+        if (name == OUTPUT_MODES[i]) {
+            *mode = (OutputMode)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool is_output_cmd(const JStringList &args) { return args.size() > 0 && args[0] == "output"; }
+
+bool run_output_cmd(const JStringList &args, std::string *err) {
+    if (!is_output_cmd(args) || args.size() > 2 ||
+        (args.size() == 2 && !parse_output_mode(args[1], &t_output))) {
+        *err = "Invalid args for output, expected output [text|json|csv|binary]";
+        return false;
+    }
+    if (args.size() == 1) {
+        struct_out() << OUTPUT_MODES[(int)t_output] << "\n";
+    }
+    return true;
+}
+
+OutputMode output_mode() { return t_output; }
+
+void set_output_mode(OutputMode mode) { t_output = mode; }
+
+// Run a request's print function and write out what it printed in one go
+static void print_req(const OpReq &req) {
+    req.print(req);
+    flush_struct_out();
+}
+
+//
+// Print all the members of a struct. Also allows for printing all members
+// matching a glob. Makes things like name->plpl* or name->*.att possible.
+//
+static void print_struct(const OpReq &req) {
+    std::string_view sname;
+    std::string_view vname;
+    split_path((*req.args)[1], &sname, &vname);
+
+    g_symbols.for_each_match(sname, vname.empty() ? "*" : vname,
+                             [&req](const Sym &sym) { sym.v->print(req); });
+    out_buf().put('\n');
+}
+
 /*================================================================================*/
 
+bool parse_count(const std::string &str, size_t *n) {
+    // from_chars takes a leading '-' for signed types only, but be explicit
+    if (str.empty() || str[0] < '0' || str[0] > '9') {
+        return false;
+    }
+    const char *end = str.data() + str.size();
+    const std::from_chars_result r = std::from_chars(str.data(), end, *n, 10);
+    return r.ec == std::errc() && r.ptr == end;
+}
+
 bool is_struct_cmd(const JStringList &args) {
     for (const auto& s : args){
         if (js::contains(s, "->")) {
@@ -369,142 +846,2698 @@ bool is_struct_cmd(const JStringList &args) {
 /*================================================================================*/
 
 //
-// Based on the provided inputs from user, decide what to do with any of
-// the structs/struct members we have registered.
+// Array transfers only cover the elements in the slice. data/size is the
+// smallest span holding all of them, and if there are gaps in the slice the
+// contiguous runs of elements are listed in req->runs so they can be moved
+// on their own.
 //
-static OpReq op_req{};
-const OpReq &parse_struct_cmd(const JStringList &args) {
-    op_req = {};
+static void locate_elements(const Var *v, OpReq *req) {
+    const size_t elem = v->sizeof_ctype;
+
+    req->runs.clear();
+    if (req->indices.empty()) {
+        req->struct_offset = v->offset;
+        req->size = 0;
+        return;
+    }
 
-    if (args.size() < 2) {
-        std::cout << "Invalid args for struct operation\n";
-        return op_req;
+    // slices are already in order, only a csv list might not be
+    std::vector<int> sorted;
+    const std::vector<int> *indices = &req->indices;
+    if (!std::is_sorted(indices->begin(), indices->end())) {
+        sorted = req->indices;
+        std::sort(sorted.begin(), sorted.end());
+        indices = &sorted;
     }
 
-    const auto sv = get_struct(args[1]);
-    const auto s = sv.first;
-    const auto v = sv.second;
+    size_t first = indices->front();
+    size_t last = first;
+    for (const int i : *indices) {
+        if ((size_t)i > last + 1) {
+            req->runs.push_back({v->offset + first * elem, (last - first + 1) * elem});
+            first = i;
+        }
+        last = i;
+    }
 
-    // If the base struct name doesn't exist, none of the functionality is
-    // available.
-    if (!s) {
-        std::cout << "Coulnd't find struct \"" << args[1] << "\"\n";
-        return op_req;
+    if (!req->runs.empty()) {
+        req->runs.push_back({v->offset + first * elem, (last - first + 1) * elem});
     }
 
-    const bool addr_cmd = (args[0] == "mv");
-    const bool read_cmd = (args[0] == "ci" && args.size() == 2);
-    const bool write_cmd = (args[0] == "co" && args.size() >= 3);
-    const bool src_def_cmd = (args[0] == "struct_src");
+    req->struct_offset = v->offset + indices->front() * elem;
+    req->size = (last + 1) * elem - indices->front() * elem;
+}
 
-    if (addr_cmd && !v && args.size() == 3) {
-        size_t new_addr = js::stoul_0x(args[2], &s_err);
-        if (s_err.length() > 0) {
-            std::cout << "set struct addr: " << s_err << "\n";
-        } else {
-            s->working_addr = new_addr;
-            op_req.op = OpReq::PASS;
-        }
-    } else if (read_cmd) {
+//
+// The storage unit(s) of a bitfield's type holding its bits
+//
+static OpReq::Run bitfield_unit(const Struct *s, const Var *v, const BitRange &bits) {
+    const size_t unit = v->sizeof_ctype;
+    const size_t begin = bits.first / CHAR_BIT / unit * unit;
+    const size_t end = ((bits.first + bits.count - 1) / CHAR_BIT / unit + 1) * unit;
+    return {begin, std::min(end, s->size) - begin};
+}
 
-        op_req.op = OpReq::PRINT;
-        if (v) {
-            op_req.data = v->data;
-            op_req.size = v->size;
-            op_req.offset = v->offset + s->working_addr;
-            op_req.print = v->print;
-        } else {
-            op_req.data = s->data;
-            op_req.size = s->size;
-            op_req.offset = s->working_addr;
-            op_req.print = s->print;
-        }
-    } else if (v && write_cmd) {
-        op_req.data = v->data;
-        op_req.size = v->size;
-        op_req.offset = v->offset + s->working_addr;
-        op_req.set_val = v->set;
+//
+// Fill in which bytes of the struct a member's transfers have to cover. For
+// bitfields that's only the storage unit(s) of the bitfield's type holding
+// its bits, rather than the whole struct, along with where the bits sit
+// inside it.
+//
+static void locate_member(const Struct *s, const Var *v, OpReq *req) {
+    if (v->type == Var::VarType::Array) {
+        locate_elements(v, req);
+        return;
+    }
+    if (v->type != Var::VarType::BField) {
+        req->struct_offset = v->offset;
+        req->size = v->size;
+        return;
+    }
 
-        switch (v->type) {
-        case Var::VarType::Std:
-            op_req.op = OpReq::WRITE;
-            break;
-        case Var::VarType::Array:
-        case Var::VarType::BField:
-            op_req.op = OpReq::READ_WRITE;
-            break;
-        }
-    } else if (src_def_cmd) {
-        std::cout << " -> struct " << s->type << " \"" << s->name << "\" definition from "
-                  << s->src_filepath << ":\n\n"
-                  << s->src_definition << "\n\n";
+    const BitRange &bits = var_bits(s, v);
+    const OpReq::Run unit = bitfield_unit(s, v, bits);
+
+    req->struct_offset = unit.struct_offset;
+    req->size = unit.size;
+    req->shift = bits.first - unit.struct_offset * CHAR_BIT;
+    req->width = bits.count;
+}
 
-        op_req.op = OpReq::PASS;
+//
+// Printing every member matching a glob only needs those members, so list
+// the runs of bytes they cover instead of transferring the whole struct.
+//
+static void locate_matches(const Struct *s, std::string_view pattern, OpReq *req) {
+    req->runs.clear();
+    g_symbols.for_each_match(s->name, pattern, [s, req](const Sym &sym) {
+        const Var *v = sym.v;
+        req->runs.push_back(v->type == Var::VarType::BField ? bitfield_unit(s, v, var_bits(s, v))
+                                                            : OpReq::Run{v->offset, v->size});
+    });
+
+    if (req->runs.empty()) {
+        req->struct_offset = 0;
+        req->size = 0;
+        return;
     }
 
-    if (op_req.op == OpReq::ERROR) {
-        std::cout << "Invalid args for struct operation\n";
+    std::sort(req->runs.begin(), req->runs.end(), [](const OpReq::Run &a, const OpReq::Run &b) {
+        return a.struct_offset < b.struct_offset;
+    });
+
+    // merge the runs that overlap or touch
+    size_t n = 1;
+    for (size_t i = 1; i < req->runs.size(); i++) {
+        OpReq::Run &last = req->runs[n - 1];
+        const OpReq::Run &run = req->runs[i];
+        if (run.struct_offset <= last.struct_offset + last.size) {
+            last.size = std::max(last.size, run.struct_offset + run.size - last.struct_offset);
+        } else {
+            req->runs[n++] = run;
+        }
     }
+    req->runs.resize(n);
 
-    return op_req;
+    req->struct_offset = req->runs.front().struct_offset;
+    req->size = req->runs.back().struct_offset + req->runs.back().size - req->struct_offset;
+    if (n == 1) {
+        req->runs.clear();
+    }
 }
 
 /*================================================================================*/
 
-// include the static struct instances generated by the python
-#include "pycstruct_instances.txt"
-
-#ifndef COMPILE_EPOCH
-#define COMPILE_EPOCH LONG_MAX
-#endif
+//
+// Point a request at the struct memory its set/print functions work on for
+// the struct at addr: the request's own image, or if the struct is bound to
+// mapped memory, the struct in there. A request for several instances of a
+// bank gets an image per instance, or has to fit all of them in the mapping.
+//
+static bool point_at_struct(OpReq *req, size_t addr) {
+    const Struct *s = req->s;
+    const StructState *state = s->state;
+
+    size_t n_images = 1;
+    size_t extent = s->size;
+    if (req->instances.size() > 1) {
+        n_images = req->instances.size();
+        extent += *std::max_element(req->instances.begin(), req->instances.end()) * s->stride;
+    }
 
-void init_structs() {
+    req->offset = addr + req->struct_offset;
+    req->mapped = state->mapped != nullptr;
+
+    if (!req->mapped) {
+        req->image.resize(n_images * s->size);
+        req->base = req->image.data();
+    } else if (addr > state->mapped_length || extent > state->mapped_length - addr) {
+        req->err = js::fmt("struct \"%s\" at 0x%lx is outside its %lu byte mapping", s->name,
+                           addr, state->mapped_length);
+        return false;
+    } else if ((uintptr_t)(state->mapped + addr) % s->align != 0 || s->stride % s->align != 0) {
+        req->err = js::fmt("struct \"%s\" at 0x%lx isn't aligned to %lu bytes", s->name, addr,
+                           s->align);
+        return false;
+    } else {
+        req->base = state->mapped + addr;
+    }
 
-// include the macro calls generated by the python
-#include "pycstruct_macros.txt"
+    req->data = req->base + req->struct_offset;
+    return true;
+}
 
-    JStringList mod_time_warnings;
-    struct stat struct_stat;
+//
+// The address of the struct a request is for, taking a single instance of a
+// bank into account
+//
+static size_t struct_addr(const OpReq &req) {
+    const size_t addr = req.s->state->working_addr;
+    return req.instances.size() == 1 ? addr + req.instances[0] * req.s->stride : addr;
+}
 
-    // Go through all the structs that have been registered and see if any of
-    // their source files have modification times after the struct macros were
-    // generated and compiled.
-    for (const auto &_s : g_structs) {
-        const auto &s = _s.second;
+//
+// Where instance k of a request for several instances of a bank is: its
+// image (or its place in the mapping) and its device address
+//
+static uint8_t *instance_base(const OpReq &req, size_t k) {
+    return req.mapped ? req.base + req.instances[k] * req.s->stride : req.base + k * req.s->size;
+}
 
-        if (::stat(s.src_filepath.c_str(), &struct_stat) < 0) {
-            std::cout << "Cannot stat source for " << s.type << " \"" << s.name << "\" ("
-                      << s.src_filepath << "): " << strerror(errno) << "\n";
-            continue;
-        }
+static size_t instance_addr(const OpReq &req, size_t k) {
+    return req.offset - req.struct_offset + req.instances[k] * req.s->stride;
+}
 
-        if (struct_stat.st_mtim.tv_sec > COMPILE_EPOCH) {
-            mod_time_warnings.push_back("struct " + s.type + " \"" + s.name +
-                                        "\": " + s.src_filepath + " last modified " +
-                                        DateTime::date_str(struct_stat.st_mtim.tv_sec) + " " +
-                                        DateTime::time_str(struct_stat.st_mtim.tv_sec));
-        }
+//
+// The instances of a bank picked by 'sname[...]->' in path, empty if there's
+// no instance slice
+//
+static bool bank_instances(const Struct *s, const std::string &path, std::vector<int> *instances,
+                           std::string *err) {
+    instances->clear();
+
+    const size_t arrow = path.find("->");
+    const size_t brace = path.find('[');
+    if (brace == std::string::npos || brace > arrow) {
+        return true;
     }
-
-    if (mod_time_warnings.size()) {
-        std::cout
-            << "Source files of structs have been modified since this program was compiled on "
-            << DateTime::date_str(COMPILE_EPOCH) + " " + DateTime::time_str(COMPILE_EPOCH) << "\n"
-            << js::join(mod_time_warnings, "\n", " -> ") << "\n";
+    if (s->count <= 1) {
+        *err = js::fmt("struct \"%s\" isn't a bank", s->name);
+        return false;
     }
+    return get_array_slice_indices(path.substr(0, arrow), s->count, instances, err);
 }
 
-JStringList struct_names() {
-    JStringList ret;
-    for (const auto &s : g_structs) {
-        ret.push_back(s.first);
+// Same thing for commands that only work on one instance, returns its address
+static bool single_instance_addr(const Struct *s, const std::string &path, size_t *addr,
+                                 std::string *err) {
+    std::vector<int> instances;
+    if (!bank_instances(s, path, &instances, err)) {
+        return false;
     }
-
-    return ret;
+    if (instances.size() > 1) {
+        *err = js::fmt("can only use one instance of bank \"%s\" here", s->name);
+        return false;
+    }
+    *addr = s->state->working_addr;
+    if (!instances.empty()) {
+        *addr += instances[0] * s->stride;
+    }
+    return true;
 }
 
-JStringList member_names(const std::string &arg) {
-    JStringList ret;
+//
+// Print a command over several instances of a bank as a table with a row
+// per instance and a column per member.
+//
+static void print_bank(const OpReq &req) {
+    std::string_view sname;
+    std::string_view vname;
+    split_path((*req.args)[1], &sname, &vname);
+
+    std::vector<const Var *> vars;
+    if (req.v) {
+        vars.push_back(req.v);
+    } else {
+        g_symbols.for_each_match(sname, vname.empty() ? "*" : vname,
+                                 [&vars](const Sym &sym) { vars.push_back(sym.v); });
+    }
+
+    // formats one instance's values at a time
+    OpReq cell;
+    cell.s = req.s;
+    cell.v = req.v;
+    cell.indices = req.indices;
+
+    const size_t n_cols = vars.size() + 1;
+    std::vector<std::string> cells{std::string(sname)};
+    for (const Var *v : vars) {
+        cells.push_back(v->name);
+    }
+    for (size_t k = 0; k < req.instances.size(); k++) {
+        cell.base = instance_base(req, k);
+        cells.push_back("[" + std::to_string(req.instances[k]) + "]");
+        for (const Var *v : vars) {
+            cells.push_back(v->format(cell));
+        }
+    }
+
+    std::vector<size_t> widths(n_cols);
+    for (size_t i = 0; i < cells.size(); i++) {
+        widths[i % n_cols] = std::max(widths[i % n_cols], cells[i].length());
+    }
+
+    // instances left aligned, values right aligned
+    std::string out;
+    for (size_t i = 0; i < cells.size(); i++) {
+        const size_t col = i % n_cols;
+        const size_t pad = widths[col] - cells[i].length();
+        if (col == 0) {
+            out += cells[i];
+            out.append(pad, ' ');
+        } else {
+            out.append(pad + 2, ' ');
+            out += cells[i];
+        }
+        if (col == n_cols - 1) {
+            out += '\n';
+        }
+    }
+    out_buf().append(out);
+}
+
+//
+// The members a print request covers, req.v or everything matching the glob
+// of a struct print
+//
+template <typename Func> static void for_each_print_var(const OpReq &req, Func func) {
+    if (req.v) {
+        func(req.v);
+        return;
+    }
+    std::string_view sname;
+    std::string_view vname;
+    split_path((*req.args)[1], &sname, &vname);
+    g_symbols.for_each_match(req.s->name, vname.empty() ? "*" : vname,
+                             [&func](const Sym &sym) { func(sym.v); });
+}
+
+// A member's index into the symbol table, given its struct's: each struct's
+// members follow it in the same order as its vars
+static uint32_t var_sym(uint32_t struct_sym, const Struct *s, const Var *v) {
+    return struct_sym + 1 + (v - s->vars);
+}
+
+//
+// Print a request in a machine readable mode, see run_output_cmd(). Every
+// instance of a bank the command covers is a record of its own.
+//
+static void print_records(const OpReq &req) {
+    OutBuf &out = out_buf();
+    const OutputMode mode = req.output;
+    const uint32_t struct_sym = g_symbols.find(req.s->name, {}) - g_symbols.begin();
+    const bool bank = req.instances.size() > 1;
+
+    for (size_t k = 0; k < (bank ? req.instances.size() : 1); k++) {
+        const uint8_t *const base = bank ? instance_base(req, k) : req.base;
+        const int instance = req.instances.empty() ? 0 : req.instances[k];
+
+        const size_t record = out.size();
+        if (mode == OutputMode::Binary) {
+            const OutRecord header{0, struct_sym, (uint32_t)instance, 0, req.stamp_ns};
+            out.append((const char *)&header, sizeof(header));
+        } else if (mode == OutputMode::Json) {
+            out.append("{\"struct\":");
+            out.json_string(req.s->name);
+            out.append(",\"instance\":");
+            out.number(instance);
+            if (req.stamp_ns >= 0) {
+                out.append(",\"time\":");
+                out.number(req.stamp_ns / 1e9);
+            }
+            out.append(",\"members\":{");
+        }
+
+        bool first = true;
+        for_each_print_var(req, [&](const Var *v) {
+            const bool array = v->type == Var::VarType::Array;
+            const size_t n = !array ? 1 : req.v ? req.indices.size() : v->size / v->sizeof_ctype;
+
+            const size_t value = out.size();
+            if (mode == OutputMode::Binary) {
+                const OutValue header{var_sym(struct_sym, req.s, v), 0};
+                out.append((const char *)&header, sizeof(header));
+            } else if (mode == OutputMode::Json) {
+                out.append(first ? "" : ",");
+                out.json_string(v->name);
+                out.append(array ? ":[" : ":");
+            }
+            first = false;
+
+            for (size_t j = 0; j < n; j++) {
+                const size_t i = req.v && array ? req.indices[j] : j;
+                if (mode == OutputMode::Csv) {
+                    if (req.stamp_ns >= 0) {
+                        out.number(req.stamp_ns / 1e9);
+                    }
+                    out.put(',');
+                    out.append(req.s->name);
+                    out.put(',');
+                    out.number(instance);
+                    out.put(',');
+                    out.append(v->name);
+                    if (array) {
+                        out.put('[');
+                        out.number(i);
+                        out.put(']');
+                    }
+                    out.put(',');
+                } else if (mode == OutputMode::Json && j > 0) {
+                    out.put(',');
+                }
+                v->emit(base, i, mode, out);
+                if (mode == OutputMode::Csv) {
+                    out.put('\n');
+                }
+            }
+
+            if (mode == OutputMode::Binary) {
+                const uint32_t size = out.size() - value - sizeof(OutValue);
+                out.patch(value + offsetof(OutValue, size), &size, sizeof(size));
+            } else if (mode == OutputMode::Json && array) {
+                out.put(']');
+            }
+        });
+
+        if (mode == OutputMode::Binary) {
+            const uint32_t size = out.size() - record - sizeof(OutRecord);
+            out.patch(record + offsetof(OutRecord, size), &size, sizeof(size));
+        } else if (mode == OutputMode::Json) {
+            out.append("}}\n");
+        }
+    }
+}
+
+//
+// Print a hexdump command, see hexdump_line(). Lines are numbered with
+// struct offsets and end with the members starting on them.
+//
+static void print_hexdump(const OpReq &req) {
+    const Struct *s = req.s;
+
+    std::vector<std::pair<size_t, const char *>> starts;
+    for (size_t i = 0; i < s->n_vars; i++) {
+        const Var *v = &s->vars[i];
+        const size_t start = v->type == Var::VarType::BField
+                                 ? bitfield_unit(s, v, var_bits(s, v)).struct_offset
+                                 : v->offset;
+        starts.push_back({start, v->name});
+    }
+    std::sort(starts.begin(), starts.end());
+
+    OutBuf &out = out_buf();
+    const bool bank = req.instances.size() > 1;
+    for (size_t k = 0; k < (bank ? req.instances.size() : 1); k++) {
+        const uint8_t *const base = bank ? instance_base(req, k) : req.base;
+        if (bank) {
+            out.append(js::fmt("%s[%d]->\n", s->name, req.instances[k]));
+        }
+
+        auto next = std::lower_bound(starts.begin(), starts.end(),
+                                     std::make_pair(req.struct_offset, (const char *)nullptr));
+        const size_t end = req.struct_offset + req.size;
+        for (size_t offset = req.struct_offset; offset < end; offset += 16) {
+            char line[HEXDUMP_LINE_MAX];
+            const size_t n = std::min<size_t>(16, end - offset);
+            out.append(line, hexdump_line(base + offset, n, offset, line));
+
+            for (const char *sep = "  "; next != starts.end() && next->first < offset + n;
+                 next++, sep = " ") {
+                out.append(sep);
+                out.append(next->second);
+            }
+            out.put('\n');
+        }
+    }
+}
+
+// Print a summary command, see summarize_array()
+static void print_summary(const OpReq &req) {
+    const bool bank = req.instances.size() > 1;
+    for (size_t k = 0; k < (bank ? req.instances.size() : 1); k++) {
+        if (bank) {
+            out_buf().append(js::fmt("%s[%d]->\n", req.s->name, req.instances[k]));
+        }
+        req.v->summarize(req, bank ? instance_base(req, k) : req.base, out_buf());
+    }
+}
+
+// Print a page command's elements, then which they were
+static void print_page(const OpReq &req) {
+    req.v->print(req);
+    out_buf().append(js::fmt("(elements %d to %d of %lu)\n", req.indices.front(),
+                             req.indices.back(), req.v->size / req.v->sizeof_ctype));
+}
+
+// Set the member in every instance of a bank the command covers
+static void set_bank(OpReq &req) {
+    uint8_t *const base = req.base;
+    for (size_t k = 0; k < req.instances.size() && req.err.empty(); k++) {
+        uint8_t *const instance = instance_base(req, k);
+        req.base = instance;
+        req.v->set(req);
+        req.base = base;
+    }
+}
+
+/*================================================================================*/
+
+//
+// Based on the provided inputs from user, decide what to do with any of
+// the structs/struct members we have registered.
+//
+bool parse_struct_cmd(const JStringList &args, OpReq *req) {
+
+    // start over but keep the buffers
+    req->data = nullptr;
+    req->size = 0;
+    req->offset = 0;
+    req->set_val = nullptr;
+    req->print = nullptr;
+    req->op = OpReq::ERROR;
+    req->s = nullptr;
+    req->v = nullptr;
+    req->struct_offset = 0;
+    req->shift = 0;
+    req->width = 0;
+    req->indices.clear();
+    req->runs.clear();
+    req->instances.clear();
+    req->args = &args;
+    req->base = nullptr;
+    req->mapped = false;
+    req->output = t_output;
+    req->stamp_ns = -1;
+    req->n_edge = 0;
+    req->err.clear();
+
+    if (args.size() < 2) {
+        req->err = "Invalid args for struct operation";
+        return false;
+    }
+
+    const auto sv = get_struct(args[1]);
+    const auto s = sv.first;
+    const auto v = sv.second;
+
+    // If the base struct name doesn't exist, none of the functionality is
+    // available.
+    if (!s) {
+        req->err = "Coulnd't find struct \"" + args[1] + "\"";
+        return false;
+    }
+
+    req->s = s;
+    req->v = v;
+
+    // a single instance of a bank is just the struct at another address
+    if (!bank_instances(s, args[1], &req->instances, &req->err)) {
+        return false;
+    }
+
+    const bool addr_cmd = (args[0] == "mv");
+    const bool dump_cmd = (args[0] == "hexdump" && args.size() == 2);
+    const bool summary_cmd = (args[0] == "summary" && (args.size() == 2 || args.size() == 3));
+    const bool page_cmd = (args[0] == "page" && (args.size() == 3 || args.size() == 4));
+    bool read_cmd = (args[0] == "ci" && args.size() == 2) || dump_cmd || summary_cmd || page_cmd;
+    if (args[0] == "ci" && args.size() == 3) {
+        // 'ci <path> <mode>' prints in an output mode of its own
+        read_cmd = parse_output_mode(args[2], &req->output);
+    }
+    const bool write_cmd = (args[0] == "co" && args.size() >= 3);
+    const bool src_def_cmd = (args[0] == "struct_src");
+
+    // Slice once here so the set/print functions don't have to
+    if (v && v->type == Var::VarType::Array && (read_cmd || write_cmd)) {
+        if (!get_array_slice_indices(args[1].substr(args[1].find("->")),
+                                     v->size / v->sizeof_ctype, &req->indices, &req->err)) {
+            return false;
+        }
+
+        // only as many elements as there are values get set
+        if (write_cmd && req->indices.size() > args.size() - 2) {
+            req->indices.resize(args.size() - 2);
+        }
+    }
+
+    if ((summary_cmd || page_cmd) && (!v || v->type != Var::VarType::Array)) {
+        req->err = args[0] + " only works on array members";
+        return false;
+    }
+
+    // a page is a slice of the slice, and only that is read
+    if (page_cmd) {
+        size_t first;
+        size_t limit = 32;
+        if (!parse_count(args[2], &first) || (args.size() == 4 && !parse_count(args[3], &limit))) {
+            req->err = "page: expected a decimal offset and limit";
+            return false;
+        }
+        if (first >= req->indices.size() || limit == 0) {
+            req->err = js::fmt("page: no elements from %lu of %lu", first, req->indices.size());
+            return false;
+        }
+        req->indices.erase(req->indices.begin(), req->indices.begin() + first);
+        req->indices.resize(std::min(limit, req->indices.size()));
+    }
+
+    if (summary_cmd) {
+        req->n_edge = 4;
+        if (args.size() == 3 && !parse_count(args[2], &req->n_edge)) {
+            req->err = "summary: expected a decimal number of elements";
+            return false;
+        }
+    }
+
+    if (addr_cmd && !v && args.size() == 3) {
+        size_t new_addr = js::stoul_0x(args[2], &req->err);
+        if (req->err.length() > 0) {
+            req->err = "set struct addr: " + req->err;
+            return false;
+        }
+        s->state->working_addr = new_addr;
+        req->op = OpReq::PASS;
+    } else if (read_cmd) {
+
+        req->op = OpReq::PRINT;
+        if (v) {
+            locate_member(s, v, req);
+            req->print = v->print;
+        } else {
+            std::string_view sname;
+            std::string_view vname;
+            split_path(args[1], &sname, &vname);
+
+            if (is_glob(vname)) {
+                locate_matches(s, vname, req);
+            } else {
+                req->struct_offset = 0;
+                req->size = s->size;
+            }
+            req->print = print_struct;
+        }
+    } else if (v && write_cmd) {
+        locate_member(s, v, req);
+        req->set_val = v->set;
+
+        switch (v->type) {
+        case Var::VarType::Std:
+            req->op = OpReq::WRITE;
+            break;
+        case Var::VarType::Array:
+            // every element in a contiguous slice gets overwritten
+            req->op = req->runs.empty() ? OpReq::WRITE : OpReq::READ_WRITE;
+            break;
+        case Var::VarType::BField:
+            req->op = OpReq::READ_WRITE;
+            break;
+        }
+    } else if (src_def_cmd) {
+        struct_out() << " -> struct " << s->type << " \"" << s->name << "\" definition from "
+                     << s->src_filepath << ":\n\n"
+                     << s->src_definition << "\n\n";
+
+        req->op = OpReq::PASS;
+    }
+
+    if (req->op == OpReq::ERROR) {
+        req->err = "Invalid args for struct operation";
+        return false;
+    }
+
+    if (req->op == OpReq::PASS) {
+        return true;
+    }
+
+    if (req->instances.size() > 1) {
+        req->print = req->print ? print_bank : nullptr;
+        req->set_val = req->set_val ? set_bank : nullptr;
+    }
+    if (req->print && req->output != OutputMode::Text) {
+        req->print = print_records;
+    }
+    if (page_cmd && req->print == v->print) {
+        req->print = print_page;
+    }
+
+    // whatever the output mode, and for every instance of a bank
+    if (dump_cmd) {
+        req->print = print_hexdump;
+    } else if (summary_cmd) {
+        req->print = print_summary;
+    }
+
+    if (!point_at_struct(req, struct_addr(*req))) {
+        req->op = OpReq::ERROR;
+        return false;
+    }
+    return true;
+}
+
+/*================================================================================*/
+
+static constexpr bool HOST_BIG_ENDIAN = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+
+//
+// Where a struct's scalars, array elements and bitfield storage units are.
+// Union members share their bytes, so where runs overlap only the first
+// one at the lowest offset is kept.
+//
+static std::vector<SwapRun> swap_runs(const Struct *s) {
+    std::vector<SwapRun> runs;
+    for (size_t i = 0; i < s->n_vars; i++) {
+        const Var *v = &s->vars[i];
+        const size_t unit = v->sizeof_ctype;
+        if (unit != 2 && unit != 4 && unit != 8) {
+            continue;
+        }
+        if (v->type == Var::VarType::BField) {
+            const OpReq::Run storage = bitfield_unit(s, v, var_bits(s, v));
+            runs.push_back({storage.struct_offset, unit, storage.size / unit});
+        } else {
+            runs.push_back({v->offset, unit, v->size / unit});
+        }
+    }
+    std::stable_sort(runs.begin(), runs.end(), [](const SwapRun &a, const SwapRun &b) {
+        return a.struct_offset < b.struct_offset;
+    });
+
+    size_t n = 0;
+    size_t end = 0;
+    for (const SwapRun &run : runs) {
+        if (n == 0 || run.struct_offset >= end) {
+            runs[n++] = run;
+            end = run.struct_offset + run.unit * run.count;
+        }
+    }
+    runs.resize(n);
+    return runs;
+}
+
+//
+// With SSE2, 16 bytes go at a time: the 16 bit words of each unit are
+// reversed with a shuffle, then the bytes of each word with shifts.
+//
+void swap_units(uint8_t *data, size_t unit, size_t n) {
+    const size_t size = unit * n;
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(data + i));
+        if (unit == 4) {
+            x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+            x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(2, 3, 0, 1));
+        } else if (unit == 8) {
+            x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+            x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+        }
+        x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+        _mm_storeu_si128((__m128i *)(data + i), x);
+    }
+#endif
+    for (; i < size; i += unit) {
+        std::reverse(data + i, data + i + unit);
+    }
+}
+
+//
+// With SSE2, floats are reduced 4 at a time, and summed as doubles 2 at a
+// time so big tables don't lose precision.
+//
+void reduce_array(const float *a, size_t n, float *min, float *max, double *sum) {
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128 lo = _mm_set1_ps(a[0]);
+    __m128 hi = lo;
+    __m128d total_lo = _mm_setzero_pd();
+    __m128d total_hi = _mm_setzero_pd();
+    for (; i + 4 <= n; i += 4) {
+        const __m128 x = _mm_loadu_ps(a + i);
+        lo = _mm_min_ps(lo, x);
+        hi = _mm_max_ps(hi, x);
+        total_lo = _mm_add_pd(total_lo, _mm_cvtps_pd(x));
+        total_hi = _mm_add_pd(total_hi, _mm_cvtps_pd(_mm_movehl_ps(x, x)));
+    }
+
+    float los[4];
+    float his[4];
+    double totals[2];
+    _mm_storeu_ps(los, lo);
+    _mm_storeu_ps(his, hi);
+    _mm_storeu_pd(totals, _mm_add_pd(total_lo, total_hi));
+    *min = std::min(std::min(los[0], los[1]), std::min(los[2], los[3]));
+    *max = std::max(std::max(his[0], his[1]), std::max(his[2], his[3]));
+    *sum = totals[0] + totals[1];
+#else
+    *min = *max = a[0];
+    *sum = 0;
+#endif
+    for (; i < n; i++) {
+        *min = std::min(*min, a[i]);
+        *max = std::max(*max, a[i]);
+        *sum += a[i];
+    }
+}
+
+void reduce_array(const double *a, size_t n, double *min, double *max, double *sum) {
+    size_t i = 0;
+#ifdef __SSE2__
+    __m128d lo = _mm_set1_pd(a[0]);
+    __m128d hi = lo;
+    __m128d total = _mm_setzero_pd();
+    for (; i + 2 <= n; i += 2) {
+        const __m128d x = _mm_loadu_pd(a + i);
+        lo = _mm_min_pd(lo, x);
+        hi = _mm_max_pd(hi, x);
+        total = _mm_add_pd(total, x);
+    }
+
+    double los[2];
+    double his[2];
+    double totals[2];
+    _mm_storeu_pd(los, lo);
+    _mm_storeu_pd(his, hi);
+    _mm_storeu_pd(totals, total);
+    *min = std::min(los[0], los[1]);
+    *max = std::max(his[0], his[1]);
+    *sum = totals[0] + totals[1];
+#else
+    *min = *max = a[0];
+    *sum = 0;
+#endif
+    for (; i < n; i++) {
+        *min = std::min(*min, a[i]);
+        *max = std::max(*max, a[i]);
+        *sum += a[i];
+    }
+}
+
+//
+// With SSE2 a line's 16 bytes are split into nibbles, turned into digits
+// with a compare and add, and interleaved back into pairs. The ASCII column
+// is a compare and blend too.
+//
+size_t hexdump_line(const uint8_t *data, size_t n, size_t offset, char *line) {
+    static const char digits[] = "0123456789abcdef";
+    n = std::min<size_t>(n, 16);
+
+    char hex[32];
+    char ascii[16];
+    size_t i = 0;
+#ifdef __SSE2__
+    if (n == 16) {
+        const __m128i bytes = _mm_loadu_si128((const __m128i *)data);
+        const __m128i nibble = _mm_set1_epi8(0x0f);
+        const __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble);
+        const __m128i low = _mm_and_si128(bytes, nibble);
+
+        // '0' + n, plus the gap up to 'a' for n > 9
+        const auto to_digits = [](__m128i n) {
+            const __m128i letter = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+            return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')),
+                                _mm_and_si128(letter, _mm_set1_epi8('a' - '0' - 10)));
+        };
+        const __m128i high_digits = to_digits(high);
+        const __m128i low_digits = to_digits(low);
+        _mm_storeu_si128((__m128i *)hex, _mm_unpacklo_epi8(high_digits, low_digits));
+        _mm_storeu_si128((__m128i *)(hex + 16), _mm_unpackhi_epi8(high_digits, low_digits));
+
+        // bytes from 0x80 up are negative, so one signed range check does
+        const __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8(0x1f)),
+                                                _mm_cmplt_epi8(bytes, _mm_set1_epi8(0x7f)));
+        _mm_storeu_si128((__m128i *)ascii,
+                         _mm_or_si128(_mm_and_si128(printable, bytes),
+                                      _mm_andnot_si128(printable, _mm_set1_epi8('.'))));
+        i = 16;
+    }
+#endif
+    for (; i < n; i++) {
+        hex[2 * i] = digits[data[i] >> 4];
+        hex[2 * i + 1] = digits[data[i] & 0xf];
+        ascii[i] = data[i] >= 0x20 && data[i] < 0x7f ? data[i] : '.';
+    }
+
+    char *p = line;
+    for (int shift = offset >> 32 ? 60 : 28; shift >= 0; shift -= 4) {
+        *p++ = digits[(offset >> shift) & 0xf];
+    }
+    *p++ = ' ';
+
+    // short lines are padded so the ASCII column lines up
+    for (i = 0; i < 16; i++) {
+        *p++ = ' ';
+        if (i == 8) {
+            *p++ = ' ';
+        }
+        p[0] = i < n ? hex[2 * i] : ' ';
+        p[1] = i < n ? hex[2 * i + 1] : ' ';
+        p += 2;
+    }
+    *p++ = ' ';
+    *p++ = ' ';
+    *p++ = '|';
+    memcpy(p, ascii, n);
+    p += n;
+    *p++ = '|';
+    return p - line;
+}
+
+//
+// Swap the size bytes at data, which are at struct_offset in s's image,
+// between host and device order if s is in the other byte order on the
+// device. Only units wholly inside the bytes are swapped, and swapping
+// twice puts them back.
+//
+static void swap_bytes(const Struct *s, uint8_t *data, size_t struct_offset, size_t size) {
+    const StructState *state = s->state;
+    if (!state->swapped) {
+        return;
+    }
+
+    const size_t end = struct_offset + size;
+    for (const SwapRun &run : state->swaps) {
+        if (run.struct_offset >= end) {
+            break;
+        }
+        size_t first = 0;
+        if (run.struct_offset < struct_offset) {
+            first = (struct_offset - run.struct_offset + run.unit - 1) / run.unit;
+        }
+        const size_t last = std::min(run.count, (end - run.struct_offset) / run.unit);
+        if (first < last) {
+            swap_units(data + run.struct_offset + first * run.unit - struct_offset, run.unit,
+                       last - first);
+        }
+    }
+}
+
+void swap_struct_req(const OpReq &req) {
+    const Struct *s = req.s;
+    if (!s->state->swapped || req.mapped) {
+        return;
+    }
+    for (size_t k = 0; k < std::max<size_t>(req.instances.size(), 1); k++) {
+        swap_bytes(s, req.base + k * s->size + req.struct_offset, req.struct_offset, req.size);
+    }
+}
+
+/*================================================================================*/
+
+static std::string xfer_err(const char *what, size_t size, size_t offset) {
+    return js::fmt("%s of %lu bytes at 0x%lx failed", what, size, offset);
+}
+
+//
+// The bytes a write request set in its image: whole bytes, or for bitfields
+// single bytes of which only the bits in mask were set
+//
+template <typename Func> static void for_each_written(const OpReq &req, Func func) {
+    const Var *v = req.v;
+    if (v->type == Var::VarType::BField) {
+        // the request already located the bits
+        const size_t first = req.struct_offset * CHAR_BIT + req.shift;
+        const size_t end = first + req.width;
+        for (size_t bit = first; bit < end;) {
+            const size_t byte = bit / CHAR_BIT;
+            uint8_t mask = 0;
+            for (; bit < end && bit / CHAR_BIT == byte; bit++) {
+                mask |= 1u << (bit % CHAR_BIT);
+            }
+            func(byte, 1, mask);
+        }
+    } else if (v->type == Var::VarType::Array) {
+        for (const int index : req.indices) {
+            func(v->offset + index * v->sizeof_ctype, v->sizeof_ctype, 0xff);
+        }
+    } else {
+        func(v->offset, v->size, 0xff);
+    }
+}
+
+static void copy_masked(uint8_t *dst, const uint8_t *src, size_t size, uint8_t mask) {
+    if (mask == 0xff) {
+        memcpy(dst, src, size);
+        return;
+    }
+    for (size_t i = 0; i < size; i++) {
+        dst[i] = (dst[i] & ~mask) | (src[i] & mask);
+    }
+}
+
+static int64_t now_ns() {
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+static bool cache_fresh(const StructCache &cache, size_t i, int64_t now) {
+    return cache.ttl_ns[i] >= 0 && cache.loaded_ns[i] >= 0 &&
+           (cache.ttl_ns[i] == 0 || now - cache.loaded_ns[i] < cache.ttl_ns[i]);
+}
+
+// The cache is for one address at a time, moving it forgets everything
+static void cache_move(StructCache &cache, size_t addr) {
+    if (cache.addr != addr) {
+        cache.addr = addr;
+        std::fill(cache.loaded_ns.begin(), cache.loaded_ns.end(), -1);
+    }
+}
+
+// Where a member's bytes are, the storage unit for bitfields
+static OpReq::Run member_run(const Struct *s, const Var *v) {
+    return v->type == Var::VarType::BField ? bitfield_unit(s, v, var_bits(s, v))
+                                           : OpReq::Run{v->offset, v->size};
+}
+
+//
+// Fill a print request's image from the cache if every member it covers is
+// fresh there, so it needs no transfer at all
+//
+static bool cache_read(OpReq &req, size_t addr) {
+    StructCache &cache = req.s->state->cache;
+    if (!cache.enabled.load(std::memory_order_relaxed) || req.mapped) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    const int64_t now = now_ns();
+    bool hit = cache.addr == addr;
+    if (hit) {
+        for_each_print_var(req, [&](const Var *v) {
+            hit = hit && cache_fresh(cache, v - req.s->vars, now);
+        });
+    }
+    if (hit) {
+        memcpy(req.data, cache.image.data() + req.struct_offset, req.size);
+    }
+    return hit;
+}
+
+// Keep the cacheable members a print request just read
+static void cache_fill(const OpReq &req, size_t addr) {
+    StructCache &cache = req.s->state->cache;
+    if (!cache.enabled.load(std::memory_order_relaxed) || req.mapped) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache_move(cache, addr);
+    const int64_t now = now_ns();
+    for_each_print_var(req, [&](const Var *v) {
+        const size_t i = v - req.s->vars;
+        const OpReq::Run run = member_run(req.s, v);
+
+        // a slice with gaps didn't read the whole member
+        const bool whole = run.struct_offset >= req.struct_offset &&
+                           run.struct_offset + run.size <= req.struct_offset + req.size &&
+                           (!req.v || req.runs.empty());
+        if (cache.ttl_ns[i] >= 0 && whole) {
+            memcpy(&cache.image[run.struct_offset], req.base + run.struct_offset, run.size);
+            cache.loaded_ns[i] = now;
+        }
+    });
+}
+
+// Write-through: the member a request wrote now has the request's value
+static void cache_write(const OpReq &req, size_t addr) {
+    StructCache &cache = req.s->state->cache;
+    if (!cache.enabled.load(std::memory_order_relaxed) || req.mapped || !req.v) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache_move(cache, addr);
+    const Var *v = req.v;
+    const size_t i = v - req.s->vars;
+    if (cache.ttl_ns[i] < 0) {
+        return;
+    }
+
+    for_each_written(req, [&](size_t offset, size_t size, uint8_t mask) {
+        copy_masked(&cache.image[offset], req.base + offset, size, mask);
+    });
+    const bool whole = v->type != Var::VarType::Array ||
+                       req.indices.size() == v->size / v->sizeof_ctype;
+
+    // a partial write only keeps an already cached member up to date
+    if (whole || cache.loaded_ns[i] >= 0) {
+        cache.loaded_ns[i] = now_ns();
+    }
+}
+
+static void cache_invalidate(const Struct *s) {
+    StructCache &cache = s->state->cache;
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    std::fill(cache.loaded_ns.begin(), cache.loaded_ns.end(), -1);
+}
+
+void cache_struct_write(const OpReq &req) {
+    if (req.instances.size() > 1) {
+        cache_invalidate(req.s);
+    } else {
+        cache_write(req, req.offset - req.struct_offset);
+    }
+}
+
+//
+// Mark the members of a struct matching a glob cacheable for ttl_ms, or
+// volatile if ttl_ms is negative
+//
+static bool set_cacheable(const Struct *s, std::string_view pattern, long ttl_ms,
+                          std::string *err) {
+    StructCache &cache = s->state->cache;
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    if (cache.ttl_ns.empty()) {
+        cache.image.assign(s->size, 0);
+        cache.ttl_ns.assign(s->n_vars, -1);
+        cache.loaded_ns.assign(s->n_vars, -1);
+    }
+
+    size_t n_matched = 0;
+    g_symbols.for_each_match(s->name, pattern.empty() ? "*" : pattern, [&](const Sym &sym) {
+        const size_t i = sym.v - s->vars;
+        cache.ttl_ns[i] = ttl_ms < 0 ? -1 : ttl_ms * 1000000;
+        cache.loaded_ns[i] = -1;
+        n_matched++;
+    });
+    if (n_matched == 0) {
+        *err = js::fmt("No members of \"%s\" match \"%.*s\"", s->name, (int)pattern.size(),
+                       pattern.data());
+        return false;
+    }
+
+    cache.enabled = std::any_of(cache.ttl_ns.begin(), cache.ttl_ns.end(),
+                                [](int64_t ttl) { return ttl >= 0; });
+    return true;
+}
+
+bool is_cache_cmd(const JStringList &args) {
+    return args.size() > 0 && (args[0] == "cache" || args[0] == "invalidate");
+}
+
+bool run_cache_cmd(const JStringList &args, std::string *err) {
+    const bool cache_cmd = args.size() == 3 && args[0] == "cache";
+    const bool invalidate_cmd = args.size() == 2 && args[0] == "invalidate";
+    if (!cache_cmd && !invalidate_cmd) {
+        *err = "Invalid args for cache, expected cache sname->[glob] <ttl_ms|off> or "
+               "invalidate sname->";
+        return false;
+    }
+
+    std::string_view sname;
+    std::string_view vname;
+    const Sym *sym = split_path(args[1], &sname, &vname) ? g_symbols.find(sname, {}) : nullptr;
+    if (!sym) {
+        *err = "Coulnd't find struct \"" + args[1] + "\"";
+        return false;
+    }
+
+    if (invalidate_cmd) {
+        cache_invalidate(sym->s);
+        return true;
+    }
+
+    long ttl_ms = -1;
+    if (args[2] != "off") {
+        size_t ms;
+        if (!parse_count(args[2], &ms) || ms > LONG_MAX / 1000000) {
+            *err = "Invalid cache ttl " + args[2] + ", expected milliseconds or off";
+            return false;
+        }
+        ttl_ms = (long)ms;
+    }
+    return set_cacheable(sym->s, vname, ttl_ms, err);
+}
+
+/*================================================================================*/
+
+bool in_transaction(const OpReq &req) {
+    StructTransaction &txn = req.s->state->txn;
+    std::lock_guard<std::mutex> lock(txn.mutex);
+    return txn.open;
+}
+
+//
+// If a write request's struct has a transaction open, set the value in the
+// transaction instead of on the device. Returns false if there's no
+// transaction, otherwise req.err says whether it worked.
+//
+static bool transaction_write(OpReq &req) {
+    StructTransaction &txn = req.s->state->txn;
+    std::lock_guard<std::mutex> lock(txn.mutex);
+    if (!txn.open) {
+        return false;
+    }
+
+    if (req.instances.size() > 1) {
+        req.err = js::fmt("can't write several instances of \"%s\" in a transaction", req.s->name);
+        return true;
+    }
+    if (struct_addr(req) != txn.addr) {
+        req.err = js::fmt("the transaction on \"%s\" is for 0x%lx", req.s->name, txn.addr);
+        return true;
+    }
+
+    req.err.clear();
+    req.base = (uint8_t *)req.s->data;
+    req.data = req.base + req.struct_offset;
+    req.set_val(req);
+    if (req.err.empty()) {
+        for_each_written(req, [&txn](size_t offset, size_t size, uint8_t mask) {
+            for (size_t i = offset; i < offset + size; i++) {
+                txn.dirty[i] |= mask;
+            }
+        });
+    }
+    return true;
+}
+
+static bool begin_transaction(const Struct *s, size_t addr, std::string *err) {
+    StructTransaction &txn = s->state->txn;
+    std::lock_guard<std::mutex> lock(txn.mutex);
+    if (txn.open) {
+        *err = js::fmt("\"%s\" already has a transaction open", s->name);
+        return false;
+    }
+    txn.open = true;
+    txn.addr = addr;
+    txn.dirty.assign(s->size, 0);
+    txn.log.clear();
+    return true;
+}
+
+// Append a committed transaction's log records to the command log, defined
+// with the rest of the logging below
+static void record_transaction(std::vector<uint8_t> *log);
+
+//
+// Write every run of dirty bytes of a transaction: the runs of whole bytes
+// in one vectored write, and runs with bytes that are only partly dirty
+// (bitfields) with masked writes so their neighbours are left alone. If
+// anything couldn't be written the transaction stays open, dirty bytes and
+// all, so it can be committed again or aborted.
+//
+static bool commit_transaction(const Struct *s, Transport &dev, std::string *err) {
+    StructTransaction &txn = s->state->txn;
+    const StructState *state = s->state;
+    std::lock_guard<std::mutex> lock(txn.mutex);
+    if (!txn.open) {
+        *err = js::fmt("\"%s\" has no transaction open", s->name);
+        return false;
+    }
+
+    const size_t length = state->mapped_length;
+    if (state->mapped && (txn.addr > length || s->size > length - txn.addr)) {
+        *err = js::fmt("struct \"%s\" at 0x%lx is outside its %lu byte mapping, the "
+                       "transaction is still open",
+                       s->name, txn.addr, state->mapped_length);
+        return false;
+    }
+
+    uint8_t *image = (uint8_t *)s->data;
+    uint8_t *dirty = txn.dirty.data();
+
+    // in the device's byte order the dirty bits move along with their bytes
+    std::vector<uint8_t> swapped;
+    if (state->swapped) {
+        swapped.assign(image, image + s->size);
+        swapped.insert(swapped.end(), dirty, dirty + s->size);
+        image = swapped.data();
+        dirty = swapped.data() + s->size;
+        swap_bytes(s, image, 0, s->size);
+        swap_bytes(s, dirty, 0, s->size);
+    }
+
+    std::vector<XferChunk> chunks;
+    size_t n_bytes = 0;
+    size_t n_runs = 0;
+    bool ok = true;
+
+    for (size_t begin = 0; begin < s->size;) {
+        if (!dirty[begin]) {
+            begin++;
+            continue;
+        }
+        size_t end = begin;
+        bool whole = true;
+        for (; end < s->size && dirty[end]; end++) {
+            whole &= dirty[end] == 0xff;
+        }
+
+        const size_t offset = txn.addr + begin;
+        if (state->mapped) {
+            for (size_t i = begin; i < end; i++) {
+                copy_masked(state->mapped + txn.addr + i, image + i, 1, dirty[i]);
+            }
+        } else if (whole) {
+            chunks.push_back({image + begin, end - begin, offset});
+        } else if (!dev.masked_write(image + begin, dirty + begin, end - begin, offset)) {
+            *err = xfer_err("masked write", end - begin, offset);
+            ok = false;
+        }
+        n_bytes += end - begin;
+        n_runs++;
+        begin = end;
+    }
+
+    if (!chunks.empty() && !dev.writev(chunks.data(), chunks.size())) {
+        *err = js::fmt("vectored write of %lu runs failed", chunks.size());
+        ok = false;
+    }
+    cache_invalidate(s);
+
+    if (!ok) {
+        *err += js::fmt(", the transaction on \"%s\" is still open", s->name);
+        return false;
+    }
+    txn.open = false;
+    record_transaction(&txn.log);
+    struct_out() << js::fmt("commit %s: %lu bytes in %lu runs\n", s->name, n_bytes, n_runs);
+    return true;
+}
+
+static void abort_transaction(const Struct *s) {
+    StructTransaction &txn = s->state->txn;
+    std::lock_guard<std::mutex> lock(txn.mutex);
+    txn.open = false;
+    txn.log.clear();
+}
+
+bool is_transaction_cmd(const JStringList &args) {
+    return args.size() > 0 && (args[0] == "begin" || args[0] == "commit" || args[0] == "abort");
+}
+
+bool run_transaction_cmd(const JStringList &args, Transport &dev, std::string *err) {
+    if (!is_transaction_cmd(args) || args.size() > 2 || (args[0] == "begin" && args.size() != 2)) {
+        *err = "Invalid args for transaction, expected begin sname-> or commit/abort [sname->]";
+        return false;
+    }
+
+    // commit/abort without a struct is for every open transaction
+    std::vector<const Struct *> structs;
+    if (args.size() == 2) {
+        std::string_view sname;
+        std::string_view vname;
+        const Sym *sym = split_path(args[1], &sname, &vname) ? g_symbols.find(sname, {}) : nullptr;
+        if (!sym) {
+            *err = "Coulnd't find struct \"" + args[1] + "\"";
+            return false;
+        }
+        structs.push_back(sym->s);
+    } else {
+        for (const Sym &sym : g_symbols) {
+            StructTransaction &txn = sym.s->state->txn;
+            std::lock_guard<std::mutex> lock(txn.mutex);
+            if (!sym.v && txn.open) {
+                structs.push_back(sym.s);
+            }
+        }
+    }
+
+    if (args[0] == "begin") {
+        size_t addr;
+        return single_instance_addr(structs[0], args[1], &addr, err) &&
+               begin_transaction(structs[0], addr, err);
+    }
+
+    bool ok = true;
+    for (const Struct *s : structs) {
+        if (args[0] == "abort") {
+            abort_transaction(s);
+        } else if (!commit_transaction(s, dev, err)) {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/*================================================================================*/
+
+static bool set_endian(const Struct *s, std::string_view endian, std::string *err) {
+    if (endian != "big" && endian != "little") {
+        *err = "Invalid byte order " + std::string(endian) + ", expected big or little";
+        return false;
+    }
+    StructState *state = s->state;
+    const bool swapped = (endian == "big") != HOST_BIG_ENDIAN;
+    if (swapped && state->mapped) {
+        *err = js::fmt("\"%s\" is mapped, it can't be byte swapped", s->name);
+        return false;
+    }
+
+    if (swapped && state->swaps.empty()) {
+        state->swaps = swap_runs(s);
+    }
+    if (swapped != state->swapped) {
+        // what's cached was read in the other order
+        state->swapped = swapped;
+        cache_invalidate(s);
+    }
+    return true;
+}
+
+bool is_endian_cmd(const JStringList &args) { return args.size() > 0 && args[0] == "endian"; }
+
+bool run_endian_cmd(const JStringList &args, std::string *err) {
+    if (!is_endian_cmd(args) || args.size() < 2 || args.size() > 3) {
+        *err = "Invalid args for endian, expected endian sname-> [big|little]";
+        return false;
+    }
+
+    std::string_view sname;
+    std::string_view vname;
+    const Sym *sym = split_path(args[1], &sname, &vname) ? g_symbols.find(sname, {}) : nullptr;
+    if (!sym) {
+        *err = "Coulnd't find struct \"" + args[1] + "\"";
+        return false;
+    }
+
+    if (args.size() == 3) {
+        return set_endian(sym->s, args[2], err);
+    }
+    const bool big = sym->s->state->swapped != HOST_BIG_ENDIAN;
+    struct_out() << js::fmt("%s: %s endian\n", sym->s->name, big ? "big" : "little");
+    return true;
+}
+
+/*================================================================================*/
+
+std::unique_ptr<CmdHandle> compile_struct_cmd(const JStringList &args, std::string *err) {
+    if (args.empty() || (args[0] != "ci" && args[0] != "co")) {
+        *err = "Only ci/co commands can be compiled";
+        return nullptr;
+    }
+
+    std::unique_ptr<CmdHandle> cmd{new CmdHandle};
+    cmd->m_args = args;
+
+    if (!parse_struct_cmd(cmd->m_args, &cmd->m_req)) {
+        *err = cmd->m_req.err;
+        return nullptr;
+    }
+
+    return cmd;
+}
+
+//
+// The chunks for a request's runs at a working address
+//
+static void run_chunks(const OpReq &req, size_t addr, std::vector<XferChunk> *chunks) {
+    chunks->clear();
+    for (const OpReq::Run &run : req.runs) {
+        chunks->push_back({req.base + run.struct_offset, run.size, addr + run.struct_offset});
+    }
+}
+
+//
+// Run a request covering several instances of a bank: every instance's
+// piece of the struct is moved in one vectored transfer, which devices
+// without vectored transfers do one piece at a time. Writes read first
+// unless the pieces are exactly the member.
+//
+static bool execute_bank(OpReq &req, std::vector<XferChunk> *chunks, Transport &dev) {
+    if (req.mapped) {
+        if (req.op == OpReq::PRINT) {
+            print_req(req);
+        } else {
+            req.set_val(req);
+        }
+        return req.err.empty();
+    }
+
+    chunks->clear();
+    for (size_t k = 0; k < req.instances.size(); k++) {
+        uint8_t *const base = instance_base(req, k);
+        const size_t addr = instance_addr(req, k);
+        if (req.op == OpReq::PRINT && !req.runs.empty()) {
+            for (const OpReq::Run &run : req.runs) {
+                chunks->push_back({base + run.struct_offset, run.size, addr + run.struct_offset});
+            }
+        } else {
+            chunks->push_back({base + req.struct_offset, req.size, addr + req.struct_offset});
+        }
+    }
+
+    const size_t n_bytes = req.instances.size() * req.size;
+    if (req.op != OpReq::WRITE) {
+        if (!dev.readv(chunks->data(), chunks->size())) {
+            req.err = xfer_err("vectored read", n_bytes, req.offset);
+            return false;
+        }
+        swap_struct_req(req);
+    }
+    if (req.op == OpReq::PRINT) {
+        print_req(req);
+        return true;
+    }
+
+    req.set_val(req);
+    if (req.err.length() > 0) {
+        return false;
+    }
+    swap_struct_req(req);
+    const bool ok = dev.writev(chunks->data(), chunks->size());
+    swap_struct_req(req);
+    if (!ok) {
+        req.err = xfer_err("vectored write", n_bytes, req.offset);
+        return false;
+    }
+    return true;
+}
+
+//
+// Run a request for a compiled command, chunks is its scratch list of
+// vectored transfers
+//
+static bool execute_req(OpReq &req, std::vector<XferChunk> *chunks, Transport &dev) {
+    const size_t addr = struct_addr(req);
+    const size_t offset = addr + req.struct_offset;
+
+    // the struct may have been bound/unbound or moved since it was compiled
+    req.err.clear();
+    if (!point_at_struct(&req, addr)) {
+        return false;
+    }
+
+    if (req.instances.size() > 1) {
+        return execute_bank(req, chunks, dev);
+    }
+
+    if (req.mapped) {
+        if (req.op == OpReq::PRINT) {
+            print_req(req);
+        } else {
+            req.set_val(req);
+        }
+        return req.err.empty();
+    }
+
+    // a bitfield's storage unit is at most two of its type
+    uint8_t mask[2 * sizeof(uint64_t)];
+
+    switch (req.op) {
+    case OpReq::PRINT:
+        if (cache_read(req, addr)) {
+            print_req(req);
+            return true;
+        }
+        if (dev.has_vectored() && !req.runs.empty()) {
+            run_chunks(req, addr, chunks);
+            if (!dev.readv(chunks->data(), chunks->size())) {
+                req.err = xfer_err("vectored read", req.size, offset);
+                return false;
+            }
+        } else if (!dev.read(req.data, req.size, offset)) {
+            req.err = xfer_err("read", req.size, offset);
+            return false;
+        }
+        swap_struct_req(req);
+        cache_fill(req, addr);
+        print_req(req);
+        return true;
+
+    case OpReq::READ_WRITE:
+        if (dev.has_masked_write() && req.width > 0 && req.size <= sizeof(mask)) {
+            memset(req.data, 0, req.size);
+            req.set_val(req);
+            if (req.err.length() > 0) {
+                return false;
+            }
+
+            memset(mask, 0, req.size);
+            for (size_t i = req.shift; i < req.shift + req.width; i++) {
+                mask[i / CHAR_BIT] |= 1u << (i % CHAR_BIT);
+            }
+            swap_bytes(req.s, mask, req.struct_offset, req.size);
+            swap_struct_req(req);
+            const bool ok = dev.masked_write(req.data, mask, req.size, offset);
+            swap_struct_req(req);
+            if (!ok) {
+                req.err = xfer_err("masked write", req.size, offset);
+                return false;
+            }
+            return true;
+        }
+        if (dev.has_vectored() && !req.runs.empty()) {
+            // only the gaps needed reading, and those aren't written
+            req.set_val(req);
+            if (req.err.length() > 0) {
+                return false;
+            }
+            run_chunks(req, addr, chunks);
+            swap_struct_req(req);
+            const bool ok = dev.writev(chunks->data(), chunks->size());
+            swap_struct_req(req);
+            if (!ok) {
+                req.err = xfer_err("vectored write", req.size, offset);
+                return false;
+            }
+            return true;
+        }
+        if (!dev.read(req.data, req.size, offset)) {
+            req.err = xfer_err("read", req.size, offset);
+            return false;
+        }
+        swap_struct_req(req);
+        // fall through
+    case OpReq::WRITE: {
+        req.set_val(req);
+        if (req.err.length() > 0) {
+            return false;
+        }
+        swap_struct_req(req);
+        const bool ok = dev.write(req.data, req.size, offset);
+        swap_struct_req(req);
+        if (!ok) {
+            req.err = xfer_err("write", req.size, offset);
+            return false;
+        }
+        return true;
+    }
+
+    default:
+        return false;
+    }
+}
+
+bool execute_struct_req(OpReq &req, std::vector<XferChunk> *chunks, Transport &dev) {
+    if (req.op != OpReq::PRINT && transaction_write(req)) {
+        if (!req.err.empty()) {
+            return false;
+        }
+        record_struct_cmd(req);
+        return true;
+    }
+    if (!execute_req(req, chunks, dev)) {
+        return false;
+    }
+    if (req.op != OpReq::PRINT) {
+        cache_struct_write(req);
+    }
+    record_struct_cmd(req);
+    return true;
+}
+
+bool execute_struct_cmd(CmdHandle &cmd, Transport &dev) {
+    return execute_struct_req(cmd.m_req, &cmd.m_chunks, dev);
+}
+
+bool execute_struct_cmd(CmdHandle &cmd, XferFunc read, XferFunc write,
+                        MaskedXferFunc masked_write, VecXferFunc readv, VecXferFunc writev) {
+    FuncTransport dev{read, write, masked_write, readv, writev};
+    return execute_struct_cmd(cmd, dev);
+}
+
+/*================================================================================*/
+
+//
+// A range of device memory belonging to one struct at one working address,
+// so the same range of a single struct image can be used as the buffer.
+//
+struct XferSpan {
+    const Struct *s;
+    uint8_t *base; // struct image
+    size_t addr;   // working address of the struct
+    size_t begin;  // offsets within the struct
+    size_t end;
+};
+
+//
+// Sort and merge overlapping or touching spans in place
+//
+static void coalesce_spans(std::vector<XferSpan> *spans) {
+    std::sort(spans->begin(), spans->end(), [](const XferSpan &a, const XferSpan &b) {
+        if (a.base != b.base) {
+            return a.base < b.base;
+        }
+        return a.begin < b.begin;
+    });
+
+    size_t n = 0;
+    for (const XferSpan &span : *spans) {
+        XferSpan *last = n > 0 ? &(*spans)[n - 1] : nullptr;
+        if (last && last->base == span.base && span.begin <= last->end) {
+            last->end = std::max(last->end, span.end);
+        } else {
+            (*spans)[n++] = span;
+        }
+    }
+    spans->resize(n);
+}
+
+//
+// Do the transfers for a list of spans, all in one go if the device does
+// vectored transfers. Failures are added to result and marked in failed,
+// one flag per span.
+//
+static void run_spans(const std::vector<XferSpan> &spans, Transport &dev, bool write,
+                      BatchResult *result, std::vector<bool> *failed) {
+    const char *what = write ? "write" : "read";
+    failed->assign(spans.size(), false);
+
+    // the images go to the device in its byte order and come back in ours
+    const auto swap = [&spans]() {
+        for (const XferSpan &span : spans) {
+            swap_bytes(span.s, span.base + span.begin, span.begin, span.end - span.begin);
+        }
+    };
+    if (write) {
+        swap();
+    }
+
+    if (dev.has_vectored() && spans.size() > 1) {
+        std::vector<XferChunk> chunks;
+        for (const XferSpan &span : spans) {
+            chunks.push_back(
+                {span.base + span.begin, span.end - span.begin, span.addr + span.begin});
+        }
+        result->n_transfers++;
+        if (!(write ? dev.writev(chunks.data(), chunks.size())
+                    : dev.readv(chunks.data(), chunks.size()))) {
+            result->errors.push_back(
+                js::fmt("vectored %s of %lu spans failed", what, spans.size()));
+            failed->assign(spans.size(), true);
+        }
+        swap();
+        return;
+    }
+
+    for (size_t i = 0; i < spans.size(); i++) {
+        const XferSpan &span = spans[i];
+        uint8_t *data = span.base + span.begin;
+        const size_t size = span.end - span.begin;
+        const size_t offset = span.addr + span.begin;
+
+        result->n_transfers++;
+        if (!(write ? dev.write(data, size, offset) : dev.read(data, size, offset))) {
+            result->errors.push_back(xfer_err(what, size, offset));
+            (*failed)[i] = true;
+        }
+    }
+    swap();
+}
+
+//
+// Whether any of the failed spans touches the bytes of a request
+//
+static bool spans_failed(const std::vector<XferSpan> &spans, const std::vector<bool> &failed,
+                         const OpReq &req) {
+    const size_t begin = req.struct_offset;
+    const size_t end = req.struct_offset + req.size;
+    for (size_t i = 0; i < spans.size(); i++) {
+        if (failed[i] && spans[i].base == req.base && spans[i].begin < end &&
+            begin < spans[i].end) {
+            return true;
+        }
+    }
+    return false;
+}
+
+BatchResult execute_struct_batch(const std::vector<JStringList> &cmds, XferFunc read,
+                                 XferFunc write) {
+    FuncTransport dev{read, write};
+    return execute_struct_batch(cmds, dev);
+}
+
+BatchResult execute_struct_batch(const std::vector<JStringList> &cmds, Transport &dev) {
+
+    // Every command on the same struct at the same working address shares
+    // one image, that's what lets their transfers be merged.
+    struct Group {
+        const Struct *s;
+        size_t addr;
+        std::vector<uint8_t> image;
+    };
+
+    BatchResult result;
+    std::deque<OpReq> reqs;
+    std::deque<Group> groups;
+    std::vector<XferSpan> reads;
+    std::vector<XferSpan> writes;
+    size_t n_unbatched = 0;
+
+    // mv/struct_src take effect while parsing, so later commands in the batch
+    // see the new working address
+    for (const JStringList &args : cmds) {
+        result.n_cmds++;
+        reqs.emplace_back();
+        OpReq &req = reqs.back();
+
+        if (!parse_struct_cmd(args, &req)) {
+            result.n_failed++;
+            result.errors.push_back(req.err);
+            reqs.pop_back();
+            continue;
+        }
+        if (req.op == OpReq::PASS) {
+            reqs.pop_back();
+            continue;
+        }
+        if (req.instances.size() > 1) {
+            result.n_failed++;
+            result.errors.push_back("Can't batch a command over several instances of a bank: " +
+                                    args[1]);
+            reqs.pop_back();
+            continue;
+        }
+        if (req.op != OpReq::PRINT && in_transaction(req)) {
+            result.n_failed++;
+            result.errors.push_back("Can't batch a write to a struct in a transaction: " + args[1]);
+            reqs.pop_back();
+            continue;
+        }
+        if (req.mapped) {
+            // works on the mapping directly, nothing to transfer
+            continue;
+        }
+
+        const size_t addr = req.offset - req.struct_offset;
+        auto group = std::find_if(groups.begin(), groups.end(), [&req, addr](const Group &g) {
+            return g.s == req.s && g.addr == addr;
+        });
+        if (group == groups.end()) {
+            groups.push_back({req.s, addr, std::move(req.image)});
+            group = groups.end() - 1;
+        }
+        req.base = group->image.data();
+        req.data = req.base + req.struct_offset;
+
+        const XferSpan span{req.s, req.base, addr, req.struct_offset,
+                            req.struct_offset + req.size};
+
+        // slices with gaps only move their runs, and don't need the gaps read
+        // to write them back
+        if (req.op == OpReq::PRINT && !req.runs.empty()) {
+            for (const OpReq::Run &run : req.runs) {
+                reads.push_back(
+                    {req.s, req.base, addr, run.struct_offset, run.struct_offset + run.size});
+            }
+        } else if (req.op == OpReq::PRINT || (req.op == OpReq::READ_WRITE && req.runs.empty())) {
+            reads.push_back(span);
+        }
+        if (req.op == OpReq::PRINT || req.op == OpReq::READ_WRITE) {
+            n_unbatched++;
+        }
+        if (req.op == OpReq::WRITE || req.op == OpReq::READ_WRITE) {
+            n_unbatched++;
+        }
+    }
+
+    std::vector<bool> failed;
+    coalesce_spans(&reads);
+    run_spans(reads, dev, false, &result, &failed);
+
+    for (OpReq &req : reqs) {
+        // like a single command, nothing is printed or written back from
+        // bytes that weren't read
+        if (!req.mapped && spans_failed(reads, failed, req)) {
+            req.err = xfer_err("read", req.size, req.offset);
+            result.n_failed++;
+            continue;
+        }
+        if (req.op == OpReq::PRINT) {
+            print_req(req);
+            record_struct_cmd(req);
+            continue;
+        }
+
+        req.set_val(req);
+        record_struct_cmd(req);
+        if (req.err.length() > 0) {
+            result.n_failed++;
+            result.errors.push_back(req.err);
+        } else if (req.mapped) {
+            continue;
+        } else if (!req.runs.empty()) {
+            for (const OpReq::Run &run : req.runs) {
+                writes.push_back({req.s, req.base, req.offset - req.struct_offset,
+                                  run.struct_offset, run.struct_offset + run.size});
+            }
+        } else {
+            writes.push_back({req.s, req.base, req.offset - req.struct_offset,
+                              req.struct_offset, req.struct_offset + req.size});
+        }
+    }
+
+    coalesce_spans(&writes);
+    const size_t n_errors = result.errors.size();
+    run_spans(writes, dev, true, &result, &failed);
+
+    // if a write failed there's no telling what the device has now
+    for (const OpReq &req : reqs) {
+        if (req.op == OpReq::PRINT || !req.err.empty()) {
+            continue;
+        }
+        if (result.errors.size() == n_errors) {
+            cache_struct_write(req);
+        } else {
+            cache_invalidate(req.s);
+        }
+    }
+
+    result.n_saved = n_unbatched - std::min(n_unbatched, result.n_transfers);
+    return result;
+}
+
+/*================================================================================*/
+
+void diff_images(const uint8_t *a, const uint8_t *b, size_t size, std::vector<OpReq::Run> *runs) {
+    runs->clear();
+
+    const auto mark = [runs](size_t offset) {
+        if (!runs->empty() && runs->back().struct_offset + runs->back().size == offset) {
+            runs->back().size++;
+        } else {
+            runs->push_back({offset, 1});
+        }
+    };
+
+    size_t i = 0;
+#ifdef __SSE2__
+    const auto eq = [a, b](size_t offset) {
+        return _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + offset)),
+                              _mm_loadu_si128((const __m128i *)(b + offset)));
+    };
+
+    for (; i + 64 <= size; i += 64) {
+        // equal blocks, which is nearly all of them, cost a single branch
+        const __m128i all_eq =
+            _mm_and_si128(_mm_and_si128(eq(i), eq(i + 16)), _mm_and_si128(eq(i + 32), eq(i + 48)));
+        if (_mm_movemask_epi8(all_eq) == 0xffff) {
+            continue;
+        }
+
+        for (size_t j = i; j < i + 64; j += 16) {
+            for (unsigned diff = ~_mm_movemask_epi8(eq(j)) & 0xffff; diff; diff &= diff - 1) {
+                mark(j + __builtin_ctz(diff));
+            }
+        }
+    }
+#endif
+
+    for (; i < size; i++) {
+        if (a[i] != b[i]) {
+            mark(i);
+        }
+    }
+}
+
+struct Snapshot {
+    const Struct *s;
+    size_t addr;
+    std::vector<uint8_t> image;
+};
+
+// Shared so a diff can keep using a snapshot that gets replaced meanwhile
+static std::mutex g_snapshots_mutex;
+static std::map<std::string, std::shared_ptr<const Snapshot>> g_snapshots;
+
+static std::shared_ptr<const Snapshot> find_snapshot(const std::string &name) {
+    std::lock_guard<std::mutex> lock(g_snapshots_mutex);
+    const auto snap = g_snapshots.find(name);
+    return snap == g_snapshots.end() ? nullptr : snap->second;
+}
+
+//
+// Read the whole struct at addr, or copy it out of the mapping if it's bound
+//
+static bool read_snapshot(const Struct *s, size_t addr, Transport &dev, Snapshot *snap,
+                          std::string *err) {
+    OpReq req;
+    req.s = s;
+    snap->s = s;
+    snap->addr = addr;
+
+    if (!point_at_struct(&req, snap->addr)) {
+        *err = req.err;
+        return false;
+    }
+    if (req.mapped) {
+        snap->image.assign(req.base, req.base + s->size);
+        return true;
+    }
+    if (!dev.read(req.base, s->size, snap->addr)) {
+        *err = xfer_err("read", s->size, snap->addr);
+        return false;
+    }
+    swap_bytes(s, req.base, 0, s->size);
+    snap->image = std::move(req.image);
+    return true;
+}
+
+//
+// The first of the (sorted) runs ending after offset
+//
+static std::vector<OpReq::Run>::const_iterator first_run_after(const std::vector<OpReq::Run> &runs,
+                                                               size_t offset) {
+    return std::upper_bound(runs.begin(), runs.end(), offset, [](size_t o, const OpReq::Run &r) {
+        return o < r.struct_offset + r.size;
+    });
+}
+
+// Whether any of the bytes [begin, end) are in the runs
+static bool in_runs(const std::vector<OpReq::Run> &runs, size_t begin, size_t end) {
+    const auto run = first_run_after(runs, begin);
+    return run != runs.end() && run->struct_offset < end;
+}
+
+//
+// Print the members matching pattern that differ between the old and new
+// images. Returns how many did.
+//
+static size_t print_changes(const Struct *s, std::string_view pattern, const uint8_t *old_image,
+                            const uint8_t *new_image) {
+    std::vector<OpReq::Run> changed;
+    diff_images(old_image, new_image, s->size, &changed);
+
+    size_t n_changed = 0;
+    if (changed.empty()) {
+        return n_changed;
+    }
+
+    OpReq old_req;
+    OpReq new_req;
+    old_req.s = new_req.s = s;
+    old_req.base = const_cast<uint8_t *>(old_image);
+    new_req.base = const_cast<uint8_t *>(new_image);
+
+    g_symbols.for_each_match(s->name, pattern, [&](const Sym &sym) {
+        const Var *v = sym.v;
+        old_req.v = new_req.v = v;
+        old_req.indices.clear();
+
+        switch (v->type) {
+        case Var::VarType::Std:
+            if (!in_runs(changed, v->offset, v->offset + v->size)) {
+                return;
+            }
+            break;
+
+        case Var::VarType::BField: {
+            const BitRange &bits = var_bits(s, v);
+            const size_t first_byte = bits.first / CHAR_BIT;
+            if (!in_runs(changed, first_byte, (bits.first + bits.count - 1) / CHAR_BIT + 1)) {
+                return;
+            }
+            bool bits_changed = false;
+            for (size_t i = bits.first; i < bits.first + bits.count && !bits_changed; i++) {
+                const uint8_t bit = 1u << (i % CHAR_BIT);
+                bits_changed = (old_image[i / CHAR_BIT] ^ new_image[i / CHAR_BIT]) & bit;
+            }
+            if (!bits_changed) {
+                return;
+            }
+            break;
+        }
+
+        case Var::VarType::Array: {
+            // only visit the changed runs inside the array, it may be huge
+            const size_t elem = v->sizeof_ctype;
+            const size_t end = v->offset + v->size;
+            for (auto run = first_run_after(changed, v->offset);
+                 run != changed.end() && run->struct_offset < end; ++run) {
+                const size_t begin = std::max(run->struct_offset, v->offset) - v->offset;
+                const size_t last = std::min(run->struct_offset + run->size, end) - 1 - v->offset;
+                for (size_t i = begin / elem; i <= last / elem; i++) {
+                    if (old_req.indices.empty() || old_req.indices.back() != (int)i) {
+                        old_req.indices.push_back(i);
+                    }
+                }
+            }
+            if (old_req.indices.empty()) {
+                return;
+            }
+
+            // old and new next to each other for every element
+            const std::vector<int> indices = std::move(old_req.indices);
+            for (const int i : indices) {
+                old_req.indices.assign(1, i);
+                new_req.indices.assign(1, i);
+                out_buf().put('-');
+                v->print(old_req);
+                out_buf().put('+');
+                v->print(new_req);
+            }
+            n_changed++;
+            return;
+        }
+        }
+
+        out_buf().put('-');
+        v->print(old_req);
+        out_buf().put('+');
+        v->print(new_req);
+        n_changed++;
+    });
+
+    return n_changed;
+}
+
+bool is_snapshot_cmd(const JStringList &args) {
+    return args.size() > 0 && (args[0] == "snap" || args[0] == "diff");
+}
+
+bool run_snapshot_cmd(const JStringList &args, Transport &dev, std::string *err) {
+    if (!is_snapshot_cmd(args) || args.size() != 3) {
+        *err = "Invalid args for snapshot, expected snap/diff <snap> sname-> or "
+               "diff <snap> <snap2>";
+        return false;
+    }
+
+    if (args[0] == "snap") {
+        const auto sv = get_struct(args[2]);
+        if (!sv.first) {
+            *err = "Coulnd't find struct \"" + args[2] + "\"";
+            return false;
+        }
+
+        size_t addr;
+        if (!single_instance_addr(sv.first, args[2], &addr, err)) {
+            return false;
+        }
+
+        auto snap = std::make_shared<Snapshot>();
+        if (!read_snapshot(sv.first, addr, dev, snap.get(), err)) {
+            return false;
+        }
+        struct_out() << js::fmt("snapshot %s: %s at 0x%lx, %lu bytes\n", args[1].c_str(),
+                                sv.first->name, snap->addr, snap->image.size());
+
+        std::lock_guard<std::mutex> lock(g_snapshots_mutex);
+        g_snapshots[args[1]] = std::move(snap);
+        return true;
+    }
+
+    const auto old_snap = find_snapshot(args[1]);
+    if (!old_snap) {
+        *err = "No snapshot \"" + args[1] + "\"";
+        return false;
+    }
+
+    // against another snapshot, or a fresh read of the struct
+    std::shared_ptr<const Snapshot> new_snap;
+    std::string_view pattern = "*";
+    if (js::contains(args[2], "->")) {
+        std::string_view sname;
+        std::string_view vname;
+        split_path(args[2], &sname, &vname);
+        if (sname != old_snap->s->name) {
+            *err = js::fmt("snapshot \"%s\" is of struct \"%s\"", args[1].c_str(),
+                           old_snap->s->name);
+            return false;
+        }
+        if (!vname.empty()) {
+            pattern = vname;
+        }
+
+        size_t addr;
+        if (!single_instance_addr(old_snap->s, args[2], &addr, err)) {
+            return false;
+        }
+
+        auto snap = std::make_shared<Snapshot>();
+        if (!read_snapshot(old_snap->s, addr, dev, snap.get(), err)) {
+            return false;
+        }
+        new_snap = std::move(snap);
+    } else {
+        new_snap = find_snapshot(args[2]);
+        if (!new_snap) {
+            *err = "No snapshot \"" + args[2] + "\"";
+            return false;
+        }
+        if (new_snap->s != old_snap->s) {
+            *err = js::fmt("snapshots \"%s\" and \"%s\" are of different structs", args[1].c_str(),
+                           args[2].c_str());
+            return false;
+        }
+    }
+
+    const size_t n_changed =
+        print_changes(old_snap->s, pattern, old_snap->image.data(), new_snap->image.data());
+    struct_out() << js::fmt("%lu members changed\n", n_changed);
+    return true;
+}
+
+std::vector<const Struct *> cmd_structs(const JStringList &args) {
+    std::vector<const Struct *> structs;
+    if (args.size() < 2) {
+        if (is_transaction_cmd(args)) {
+            for (const Sym &sym : g_symbols) {
+                if (!sym.v) {
+                    structs.push_back(sym.s);
+                }
+            }
+        }
+        return structs;
+    }
+
+    // the struct is in the path, apart from diffs which have it in the snapshot
+    std::string path = args[1];
+    if (is_snapshot_cmd(args) && args.size() > 2) {
+        if (args[0] == "diff") {
+            const auto snap = find_snapshot(args[1]);
+            if (snap) {
+                structs.push_back(snap->s);
+            }
+            return structs;
+        }
+        path = args[2];
+    } else if (!is_cache_cmd(args) && !is_transaction_cmd(args) && !is_endian_cmd(args)) {
+        return structs;
+    }
+
+    std::string_view sname;
+    std::string_view vname;
+    const Sym *sym = split_path(path, &sname, &vname) ? g_symbols.find(sname, {}) : nullptr;
+    if (sym) {
+        structs.push_back(sym->s);
+    }
+    return structs;
+}
+
+/*================================================================================*/
+
+//
+// Command logs are a LogHeader followed by LogRecords, each record followed
+// by its array indices (int32) and then its value bytes: what was written
+// for writes, the glob pattern for prints of a whole struct, and nothing
+// for any other print. Everything is in host byte order.
+//
+struct LogHeader {
+    char magic[8];
+    uint64_t registry; // registry_hash() of the registry that recorded it
+};
+
+struct LogRecord {
+    uint64_t time_ns; // since recording started
+    uint64_t addr;    // working address
+    uint32_t sym;     // index into the symbol table
+    uint32_t struct_offset;
+    uint32_t size;
+    uint8_t op;
+    uint8_t shift;
+    uint8_t width;
+    uint8_t pad;
+    uint32_t n_indices;
+    uint32_t value_size;
+};
+
+static const char LOG_MAGIC[8] = {'P', 'Y', 'C', 'S', 'L', 'O', 'G', '1'};
+
+static_assert(sizeof(int) == sizeof(int32_t), "indices are logged as int32");
+
+static std::mutex g_record_mutex;
+static std::atomic<bool> g_recording{false};
+static FILE *g_record_file = nullptr;
+static std::chrono::steady_clock::time_point g_record_start;
+
+//
+// Symbol indices and the offsets in records only mean something to the same
+// registry, so logs are tagged with a hash of every path, struct size and
+// member layout (offset, sizes, type and bitfield bits).
+//
+static uint64_t registry_hash() {
+    uint64_t hash = 14695981039346656037ull;
+    const auto mix = [&hash](const void *data, size_t size) {
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ ((const uint8_t *)data)[i]) * 1099511628211ull;
+        }
+    };
+
+    for (const Sym &sym : g_symbols) {
+        mix(sym.sname.data(), sym.sname.size());
+        mix("->", 2);
+        mix(sym.vname.data(), sym.vname.size());
+        mix(&sym.s->size, sizeof(sym.s->size));
+
+        if (const Var *v = sym.v) {
+            const uint64_t layout[] = {v->offset, v->size, v->sizeof_ctype, (uint64_t)v->type};
+            mix(layout, sizeof(layout));
+            if (v->type == Var::VarType::BField) {
+                const BitRange &bits = var_bits(sym.s, v);
+                const uint64_t range[] = {bits.first, bits.count};
+                mix(range, sizeof(range));
+            }
+        }
+    }
+    return hash;
+}
+
+bool start_recording(const std::string &path, std::string *err) {
+    std::lock_guard<std::mutex> lock(g_record_mutex);
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        *err = "open " + path + ": " + strerror(errno);
+        return false;
+    }
+    setvbuf(file, nullptr, _IOFBF, 1 << 20);
+
+    LogHeader header;
+    memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+    header.registry = registry_hash();
+    fwrite(&header, sizeof(header), 1, file);
+
+    if (g_record_file) {
+        fclose(g_record_file);
+    }
+    g_record_file = file;
+    g_record_start = std::chrono::steady_clock::now();
+    g_recording = true;
+    return true;
+}
+
+void stop_recording() {
+    std::lock_guard<std::mutex> lock(g_record_mutex);
+    g_recording = false;
+    if (g_record_file) {
+        fclose(g_record_file);
+        g_record_file = nullptr;
+    }
+}
+
+//
+// Append the records for a request to out, one per instance for a command
+// over several instances of a bank
+//
+static void encode_records(const OpReq &req, uint64_t time_ns, std::vector<uint8_t> *out) {
+    const Sym *sym = g_symbols.find(req.s->name, req.v ? req.v->name : "");
+
+    // a whole struct print keeps the glob it printed
+    std::string_view pattern;
+    if (!req.v && req.args) {
+        std::string_view sname;
+        split_path((*req.args)[1], &sname, &pattern);
+    }
+
+    LogRecord rec{};
+    rec.time_ns = time_ns;
+    rec.addr = req.offset - req.struct_offset;
+    rec.sym = sym - g_symbols.begin();
+    rec.struct_offset = req.struct_offset;
+    rec.size = req.size;
+    rec.op = req.op;
+    rec.shift = req.shift;
+    rec.width = req.width;
+    rec.n_indices = req.indices.size();
+    rec.value_size = req.op == OpReq::PRINT ? pattern.size() : req.size;
+
+    const auto append = [out](const void *data, size_t size) {
+        out->insert(out->end(), (const uint8_t *)data, (const uint8_t *)data + size);
+    };
+
+    const size_t n_instances = req.instances.size() > 1 ? req.instances.size() : 1;
+    for (size_t k = 0; k < n_instances; k++) {
+        const uint8_t *value = req.data;
+        if (req.op == OpReq::PRINT) {
+            value = (const uint8_t *)pattern.data();
+        } else if (n_instances > 1) {
+            value = instance_base(req, k) + req.struct_offset;
+        }
+        if (n_instances > 1) {
+            rec.addr = instance_addr(req, k);
+        }
+
+        append(&rec, sizeof(rec));
+        append(req.indices.data(), rec.n_indices * sizeof(int32_t));
+        append(value, rec.value_size);
+    }
+}
+
+static uint64_t record_time_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                                g_record_start)
+        .count();
+}
+
+void record_struct_cmd(const OpReq &req) {
+    if (!g_recording.load(std::memory_order_relaxed) || !req.err.empty() ||
+        (req.op != OpReq::PRINT && req.op != OpReq::WRITE && req.op != OpReq::READ_WRITE)) {
+        return;
+    }
+
+    // writes into an open transaction wait for it to be committed, an
+    // aborted one never reaches the device so it isn't logged
+    if (req.op != OpReq::PRINT) {
+        StructTransaction &txn = req.s->state->txn;
+        std::lock_guard<std::mutex> lock(txn.mutex);
+        if (txn.open) {
+            encode_records(req, 0, &txn.log);
+            return;
+        }
+    }
+
+    static thread_local std::vector<uint8_t> records;
+    records.clear();
+
+    std::lock_guard<std::mutex> lock(g_record_mutex);
+    if (!g_record_file) {
+        return;
+    }
+    encode_records(req, record_time_ns(), &records);
+    fwrite(records.data(), 1, records.size(), g_record_file);
+}
+
+static void record_transaction(std::vector<uint8_t> *log) {
+    std::lock_guard<std::mutex> lock(g_record_mutex);
+    if (g_record_file && !log->empty()) {
+        // the writes happen when they're committed, so that's when they ran
+        const uint64_t time_ns = record_time_ns();
+        for (size_t pos = 0; pos < log->size();) {
+            LogRecord rec;
+            memcpy(&rec, &(*log)[pos], sizeof(rec));
+            rec.time_ns = time_ns;
+            memcpy(&(*log)[pos], &rec, sizeof(rec));
+            pos += sizeof(rec) + rec.n_indices * sizeof(int32_t) + rec.value_size;
+        }
+        fwrite(log->data(), 1, log->size(), g_record_file);
+    }
+    log->clear();
+}
+
+//
+// Re-execute one logged command. req and chunks are reused between records.
+//
+static bool replay_record(const LogRecord &rec, const int32_t *indices, const uint8_t *value,
+                          Transport &dev, bool print, OpReq *req, std::vector<XferChunk> *chunks) {
+    const Sym &sym = g_symbols.begin()[rec.sym];
+    const Struct *s = sym.s;
+    const Var *v = sym.v;
+
+    bool valid = rec.struct_offset <= s->size && rec.size <= s->size - rec.struct_offset;
+    valid &= rec.op == OpReq::PRINT ||
+             ((rec.op == OpReq::WRITE || rec.op == OpReq::READ_WRITE) && v &&
+              rec.value_size == rec.size);
+    for (size_t i = 0; i < rec.n_indices && valid; i++) {
+        valid = v && indices[i] >= 0 && (size_t)indices[i] < v->size / v->sizeof_ctype;
+    }
+    if (!valid) {
+        req->err = js::fmt("bad record for %s->%s", s->name, v ? v->name : "");
+        return false;
+    }
+
+    req->err.clear();
+    req->s = s;
+    req->v = v;
+    req->op = (decltype(req->op))rec.op;
+    req->struct_offset = rec.struct_offset;
+    req->size = rec.size;
+    req->shift = rec.shift;
+    req->width = rec.width;
+    req->indices.assign(indices, indices + rec.n_indices);
+    req->runs.clear();
+
+    // prints of a whole struct rebuild the command only for the print
+    // function, which wants to see the glob
+    static thread_local JStringList args;
+    const size_t pattern_size = rec.op == OpReq::PRINT ? rec.value_size : 0;
+    const std::string_view pattern{(const char *)value, pattern_size};
+    if (v && v->type == Var::VarType::Array) {
+        locate_elements(v, req);
+    } else if (!v && is_glob(pattern)) {
+        locate_matches(s, pattern, req);
+    }
+    if (!v && print) {
+        args = {"ci", std::string(s->name) + "->" + std::string(pattern)};
+        req->args = &args;
+    }
+    req->print = v ? v->print : print_struct;
+
+    if (!point_at_struct(req, rec.addr)) {
+        return false;
+    }
+    const size_t offset = req->offset;
+
+    if (req->op == OpReq::PRINT) {
+        if (req->mapped) {
+            // nothing to transfer
+        } else if (dev.has_vectored() && !req->runs.empty()) {
+            run_chunks(*req, rec.addr, chunks);
+            if (!dev.readv(chunks->data(), chunks->size())) {
+                req->err = xfer_err("vectored read", req->size, offset);
+                return false;
+            }
+        } else if (!dev.read(req->data, req->size, offset)) {
+            req->err = xfer_err("read", req->size, offset);
+            return false;
+        }
+        swap_struct_req(*req);
+        if (print) {
+            print_req(*req);
+        }
+        return true;
+    }
+
+    // which bits of the value were actually written
+    uint8_t mask[2 * sizeof(uint64_t)];
+    if (req->width > 0) {
+        if (req->size > sizeof(mask)) {
+            req->err = js::fmt("bad record for %s->%s", s->name, v ? v->name : "");
+            return false;
+        }
+        memset(mask, 0, req->size);
+        for (size_t i = req->shift; i < req->shift + req->width; i++) {
+            mask[i / CHAR_BIT] |= 1u << (i % CHAR_BIT);
+        }
+    }
+
+    if (req->mapped) {
+        if (req->width > 0) {
+            for (size_t i = 0; i < req->size; i++) {
+                req->data[i] = (req->data[i] & ~mask[i]) | (value[i] & mask[i]);
+            }
+        } else if (!req->runs.empty()) {
+            for (const OpReq::Run &run : req->runs) {
+                const size_t begin = run.struct_offset - req->struct_offset;
+                memcpy(req->data + begin, value + begin, run.size);
+            }
+        } else {
+            memcpy(req->data, value, req->size);
+        }
+        return true;
+    }
+
+    memcpy(req->data, value, req->size);
+    swap_struct_req(*req);
+    bool ok;
+    if (req->width > 0) {
+        swap_bytes(s, mask, req->struct_offset, req->size);
+        ok = dev.masked_write(req->data, mask, req->size, offset);
+    } else if (!req->runs.empty()) {
+        run_chunks(*req, rec.addr, chunks);
+        ok = dev.writev(chunks->data(), chunks->size());
+    } else {
+        ok = dev.write(req->data, req->size, offset);
+    }
+    swap_struct_req(*req);
+    if (!ok) {
+        const char *what = req->width > 0 ? "masked write"
+                           : req->runs.empty() ? "write"
+                                               : "vectored write";
+        req->err = xfer_err(what, req->size, offset);
+        return false;
+    }
+    cache_write(*req, rec.addr);
+    return true;
+}
+
+bool replay_struct_log(const std::string &path, Transport &dev, bool original_timing,
+                       bool print, ReplayResult *result, std::string *err) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) {
+        *err = "open " + path + ": " + strerror(errno);
+        return false;
+    }
+    std::vector<uint8_t> log;
+    uint8_t buf[1 << 16];
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), file)) > 0;) {
+        log.insert(log.end(), buf, buf + n);
+    }
+    fclose(file);
+
+    LogHeader header;
+    if (log.size() < sizeof(header)) {
+        *err = path + " isn't a command log";
+        return false;
+    }
+    memcpy(&header, log.data(), sizeof(header));
+    if (memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) != 0) {
+        *err = path + " isn't a command log";
+        return false;
+    }
+    if (header.registry != registry_hash()) {
+        *err = path + " was recorded with a different struct registry";
+        return false;
+    }
+
+    OpReq req;
+    std::vector<XferChunk> chunks;
+    std::vector<int32_t> indices;
+    const auto start = std::chrono::steady_clock::now();
+
+    for (size_t pos = sizeof(header); pos < log.size();) {
+        LogRecord rec;
+        if (log.size() - pos < sizeof(rec)) {
+            result->errors.push_back(js::fmt("truncated record at %lu", pos));
+            break;
+        }
+        memcpy(&rec, &log[pos], sizeof(rec));
+        pos += sizeof(rec);
+
+        const size_t extra = rec.n_indices * sizeof(int32_t) + rec.value_size;
+        if (rec.sym >= g_symbols.size() || log.size() - pos < extra) {
+            result->errors.push_back(js::fmt("truncated record at %lu", pos - sizeof(rec)));
+            break;
+        }
+
+        // the log isn't aligned for int32
+        indices.resize(rec.n_indices);
+        if (rec.n_indices > 0) {
+            memcpy(indices.data(), log.data() + pos, rec.n_indices * sizeof(int32_t));
+        }
+        const uint8_t *value = log.data() + pos + rec.n_indices * sizeof(int32_t);
+        pos += extra;
+
+        if (original_timing) {
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds(rec.time_ns));
+        }
+
+        result->n_records++;
+        if (!replay_record(rec, indices.data(), value, dev, print, &req, &chunks)) {
+            result->n_failed++;
+            result->errors.push_back(req.err);
+        }
+    }
+    return true;
+}
+
+/*================================================================================*/
+
+#ifndef COMPILE_EPOCH
+#define COMPILE_EPOCH LONG_MAX
+#endif
+
+void init_structs() {
+
+#ifndef PYCSTRUCT_CONSTEXPR_REGISTRY
+// include the macro calls generated by the python
+#include "pycstruct_macros.txt"
+
+    index_structs();
+#endif
+
+    for (const Sym &sym : g_symbols) {
+        if (sym.v) {
+            continue;
+        }
+        const Struct &s = *sym.s;
+        s.state->bits.assign(s.n_vars, BitRange{0, 0});
+        for (size_t i = 0; i < s.n_vars; i++) {
+            if (s.vars[i].type == Var::VarType::BField) {
+                s.state->bits[i] = s.vars[i].bits();
+            }
+        }
+    }
+
+#ifdef PYCSTRUCT_ENDIAN_RULES
+    for (const EndianRule &rule : pycstruct_endian_rules) {
+        std::string err;
+        const Sym *sym = g_symbols.find(rule.sname, {});
+        if (sym && !set_endian(sym->s, rule.endian, &err)) {
+            std::cout << "PYCSTRUCT_ENDIAN: " << err << "\n";
+        }
+    }
+#endif
+
+#ifdef PYCSTRUCT_CACHE_RULES
+    for (const CacheRule &rule : pycstruct_cache_rules) {
+        std::string err;
+        const Sym *sym = g_symbols.find(rule.sname, {});
+        if (sym && !set_cacheable(sym->s, rule.pattern, rule.ttl_ms, &err)) {
+            std::cout << "PYCSTRUCT_CACHEABLE: " << err << "\n";
+        }
+    }
+#endif
+
+    JStringList mod_time_warnings;
+    struct stat struct_stat;
+
+    // Go through all the structs that have been registered and see if any of
+    // their source files have modification times after the struct macros were
+    // generated and compiled.
+    for (const Sym &sym : g_symbols) {
+        if (sym.v) {
+            continue;
+        }
+        const Struct &s = *sym.s;
+
+        if (::stat(s.src_filepath, &struct_stat) < 0) {
+            std::cout << "Cannot stat source for " << s.type << " \"" << s.name << "\" ("
+                      << s.src_filepath << "): " << strerror(errno) << "\n";
+            continue;
+        }
+
+        if (struct_stat.st_mtim.tv_sec > COMPILE_EPOCH) {
+            mod_time_warnings.push_back("struct " + std::string(s.type) + " \"" + s.name +
+                                        "\": " + s.src_filepath + " last modified " +
+                                        DateTime::date_str(struct_stat.st_mtim.tv_sec) + " " +
+                                        DateTime::time_str(struct_stat.st_mtim.tv_sec));
+        }
+    }
+
+    if (mod_time_warnings.size()) {
+        std::cout
+            << "Source files of structs have been modified since this program was compiled on "
+            << DateTime::date_str(COMPILE_EPOCH) + " " + DateTime::time_str(COMPILE_EPOCH) << "\n"
+            << js::join(mod_time_warnings, "\n", " -> ") << "\n";
+    }
+}
+
+bool bind_struct(const std::string &sname, uint8_t *base, size_t length, std::string *err) {
+    // either "sname" or "sname->"
+    std::string_view name = sname;
+    std::string_view vname;
+    split_path(sname, &name, &vname);
+
+    const Sym *sym = g_symbols.find(name, {});
+    if (!sym) {
+        *err = "Coulnd't find struct \"" + sname + "\"";
+        return false;
+    }
+
+    if (base && sym->s->state->swapped) {
+        *err = js::fmt("\"%s\" is byte swapped, it can't be mapped", sym->s->name);
+        return false;
+    }
+
+    sym->s->state->mapped = base;
+    sym->s->state->mapped_length = base ? length : 0;
+    return true;
+}
+
+JStringList struct_names() {
+    JStringList ret;
+    for (const Sym &sym : g_symbols) {
+        if (!sym.v) {
+            ret.push_back(std::string(sym.sname));
+        }
+    }
+
+    return ret;
+}
+
+JStringList member_names(const std::string &arg) {
+    JStringList ret;
     const auto sv = get_struct(arg);
 
     if (!sv.first) {
@@ -512,8 +3545,17 @@ JStringList member_names(const std::string &arg) {
         return {};
     }
 
-    for (const auto &v : sv.first->vars) {
-        ret.push_back(v.first);
+    for (size_t i = 0; i < sv.first->n_vars; i++) {
+        ret.push_back(sv.first->vars[i].name);
+    }
+
+    return ret;
+}
+
+JStringList symbol_paths() {
+    JStringList ret;
+    for (const Sym &sym : g_symbols) {
+        ret.push_back(std::string(sym.sname) + "->" + std::string(sym.vname));
     }
 
     return ret;
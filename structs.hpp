@@ -1,28 +1,425 @@
 #pragma once
 
+#include "transport.hpp"
 #include "utils/jstrings/jstrings.hpp"
 // #include "src/utils/jstrings/jstrings.hpp"
 
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
 #define REGISTER_PYCSTRUCT(typename, instance_name)
 #define REGISTER_PYCSTRUCT_PACK(typename, instance_name, pragma_pack)
 
+// count identical instances, each stride bytes after the one before it (a
+// literal, the python can't evaluate sizeof). Address them as
+// 'instance_name[i]->' or 'instance_name[a:b]->', without an index it's
+// instance 0.
+#define REGISTER_PYCSTRUCT_BANK(typename, instance_name, count, stride)
+
+// Members of instance_name matching member_glob (a string literal) can be
+// served from its read cache for ttl_ms milliseconds, 0 being until it's
+// invalidated. See run_cache_cmd().
+#define PYCSTRUCT_CACHEABLE(instance_name, member_glob, ttl_ms)
+
+// instance_name is big or little endian on the device. See run_endian_cmd().
+#define PYCSTRUCT_ENDIAN(instance_name, endian)
+
 namespace Structs {
 
 void init_structs();
 
+struct Struct;
+struct Var;
+
+// How print functions write values, see run_output_cmd()
+enum class OutputMode { Text, Json, Csv, Binary };
+
+//
+// A struct command parsed by parse_struct_cmd(). Requests are owned by the
+// caller and carry their own image of the struct and their own error, so
+// commands can be parsed and executed from several threads at once as long
+// as each thread uses its own requests. Reusing a request for the next
+// command reuses its buffers.
+//
 struct OpReq {
     uint8_t *data = nullptr;
     size_t size = 0;
     size_t offset = 0;
-    void (*set_val)(const JStringList &) = nullptr;
-    void (*print)(const JStringList &) = nullptr;
+    void (*set_val)(OpReq &) = nullptr;
+    void (*print)(const OpReq &) = nullptr;
     enum { ERROR, PRINT, WRITE, READ_WRITE, PASS } op = ERROR;
+
+    // What the command resolved to. The set/print functions take these
+    // instead of re-parsing the command.
+    const Struct *s = nullptr;
+    const Var *v = nullptr;
+    size_t struct_offset = 0; // offset of data within the struct
+    unsigned shift = 0;       // bitfields only: the member is bits [shift, shift + width)
+    unsigned width = 0;       // of the size bytes at data, bit 0 being the low bit of data[0]
+    std::vector<int> indices; // array members only
+
+    // Array members only: if the slice has gaps, the contiguous runs of
+    // elements within the span at data, otherwise empty
+    struct Run {
+        size_t struct_offset;
+        size_t size;
+    };
+    std::vector<Run> runs;
+
+    // Banks only: the instances the command picked, empty if it didn't pick
+    // any. For a single instance offset is already that instance's. For
+    // more, each instance has its own image (one after the other in image,
+    // or stride apart in the mapping), offset is for the bank's working
+    // address, and only execute_struct_cmd() knows how to move them all.
+    std::vector<int> instances;
+
+    const JStringList *args = nullptr;
+
+    // The struct image set/print work on and data points into. Normally the
+    // request's own image, but it can be pointed at a shared one.
+    uint8_t *base = nullptr;
+    std::vector<uint8_t> image;
+
+    // The struct is bound to mapped memory and base points into it, so
+    // there's nothing to transfer. set/print work on the mapping directly.
+    bool mapped = false;
+
+    // How print writes the values: the command's own mode, or the calling
+    // thread's when it was parsed. Sampled requests (watch) set stamp_ns to
+    // when the values were read, which machine readable modes print.
+    OutputMode output = OutputMode::Text;
+    int64_t stamp_ns = -1;
+
+    // summary commands only: how many elements to print at each end
+    size_t n_edge = 0;
+
+    // Why parsing or set_val failed
+    std::string err;
+
+    OpReq() = default;
+    OpReq(OpReq &&) = default;
+    OpReq &operator=(OpReq &&) = default;
+
+    // base would still point into the other request's image
+    OpReq(const OpReq &) = delete;
+    OpReq &operator=(const OpReq &) = delete;
 };
 
+//
+// Where print functions write: std::cout, unless the calling thread pointed
+// its output at another stream (null goes back to std::cout). Lets a server
+// hand each client its own output.
+//
+// Print functions format into a per-thread buffer rather than the stream,
+// which is written out in one go at the end of each command (or as soon as
+// anything else uses struct_out()). Anything calling a request's print
+// function itself calls flush_struct_out() after.
+//
+std::ostream &struct_out();
+void set_struct_out(std::ostream *out);
+void flush_struct_out();
+
+// A mutex per struct, for callers executing commands from several threads
+// that mustn't interleave on the same struct (e.g. read-modify-writes of
+// bitfields). Nothing in here takes it.
+std::mutex &struct_mutex(const Struct *s);
+
+// The structs a snap/diff, cache/invalidate, begin/commit/abort or endian
+// command works on, whose struct_mutex() to take before running it: every
+// struct for a commit/abort without one, in the same order each time. None
+// for any other command, or if the struct isn't found.
+std::vector<const Struct *> cmd_structs(const JStringList &args);
+
+// A count given in decimal (workers, elements, milliseconds), with no sign.
+// Returns false if str is anything else.
+bool parse_count(const std::string &str, size_t *n);
+
 bool is_struct_cmd(const JStringList &args);
-const OpReq &parse_struct_cmd(const JStringList &args);
+
+// Fills in req. Returns false (with req->err set) if the command is invalid.
+bool parse_struct_cmd(const JStringList &args, OpReq *req);
+
+//
+// A ci/co command resolved once so it can be executed over and over without
+// re-parsing the path, re-resolving the member or re-slicing the indices.
+// The working address is picked up when the handle is executed so 'mv'
+// still applies to compiled commands. Like OpReq, a handle can only be
+// executed by one thread at a time.
+//
+class CmdHandle {
+  public:
+    CmdHandle(const CmdHandle &) = delete;
+    CmdHandle &operator=(const CmdHandle &) = delete;
+
+    const std::string &err() const { return m_req.err; }
+
+  private:
+    CmdHandle() = default;
+    friend std::unique_ptr<CmdHandle> compile_struct_cmd(const JStringList &args,
+                                                         std::string *err);
+    friend bool execute_struct_cmd(CmdHandle &cmd, Transport &dev);
+
+    JStringList m_args;
+    OpReq m_req;
+    std::vector<XferChunk> m_chunks;
+};
+
+// Returns nullptr (with err set) if the command is invalid or isn't a ci/co.
+std::unique_ptr<CmdHandle> compile_struct_cmd(const JStringList &args, std::string *err);
+
+// Run a compiled command, using dev to move data to/from the device.
+// Returns false if the value couldn't be set or a transfer failed, see
+// cmd.err(). If the device supports masked writes, setting a bitfield does a
+// single masked write instead of a read-modify-write of its storage unit. If
+// it supports vectored transfers, a slice of an array with gaps only moves
+// the elements in the slice (and a write needs no read). A command over
+// several instances of a bank moves all of them in one vectored transfer
+// and prints them as a table.
+bool execute_struct_cmd(CmdHandle &cmd, Transport &dev);
+
+// Run a request from parse_struct_cmd() the same way, chunks being scratch
+// space for its vectored transfers. Commands over several instances of a
+// bank can't be run with a single read/write so need this.
+bool execute_struct_req(OpReq &req, std::vector<XferChunk> *chunks, Transport &dev);
+
+// Same thing with the transfer functions wrapped in a FuncTransport
+bool execute_struct_cmd(CmdHandle &cmd, XferFunc read, XferFunc write,
+                        MaskedXferFunc masked_write = nullptr, VecXferFunc readv = nullptr,
+                        VecXferFunc writev = nullptr);
+
+//
+// Run a list of commands with as few transfers as possible. Every read the
+// batch needs is done up front, then all the set/print functions run in
+// order, then all the writes are done. Overlapping or adjacent ranges of the
+// same struct are merged into a single transfer. Commands over several
+// instances of a bank can't be batched.
+//
+struct BatchResult {
+    size_t n_cmds = 0;
+    size_t n_failed = 0;
+    size_t n_transfers = 0; // transfers actually done
+    size_t n_saved = 0;     // compared to running the commands one at a time
+    JStringList errors;
+};
+
+BatchResult execute_struct_batch(const std::vector<JStringList> &cmds, Transport &dev);
+BatchResult execute_struct_batch(const std::vector<JStringList> &cmds, XferFunc read,
+                                 XferFunc write);
+
+//
+// Bind a struct to memory that's already mapped into this process, e.g. an
+// mmap'd device or file, length bytes long. The struct's working address is
+// then its offset into the mapping, and ci/co print and set the mapped
+// memory in place instead of copying through an image. A null base unbinds
+// it. The mapping has to outlive the binding, and binding mustn't race with
+// commands on the same struct.
+//
+bool bind_struct(const std::string &sname, uint8_t *base, size_t length, std::string *err);
+
+//
+// Snapshots of whole struct images, kept by name:
+//
+//  - 'snap <snap> sname->' reads the struct at its working address into a
+//    snapshot (replacing any snapshot with the same name).
+//  - 'diff <snap> sname->[glob]' prints the members that changed between
+//    the snapshot and a fresh read of the struct, optionally only the ones
+//    matching a glob.
+//  - 'diff <snap> <snap2>' prints the members that changed between two
+//    snapshots of the same struct.
+//
+// Changed members are printed old then new, prefixed with '-' and '+'.
+// Only the changed elements of arrays are printed, and bitfields only count
+// as changed if their own bits did.
+//
+bool is_snapshot_cmd(const JStringList &args);
+
+// Returns false (with err set) if the command is invalid or the read failed
+bool run_snapshot_cmd(const JStringList &args, Transport &dev, std::string *err);
+
+//
+// Binary command logs. While recording, every command that's executed is
+// appended to the log as the member it resolved to (its index in the symbol
+// table), the working address, the op and for writes the raw bytes that
+// were written, along with when it ran. Replaying a log re-executes it
+// against a transport without going near the string parsing, either as
+// fast as possible or with the original timing. A log only replays against
+// the same registry it was recorded with. Writes to a struct with a
+// transaction open are logged when it's committed, and not at all if it's
+// aborted.
+//
+// execute_struct_cmd(), execute_struct_batch() and AsyncQueue record what
+// they execute. Anything executing parsed requests itself calls
+// record_struct_cmd() once the request's print or set step has run.
+//
+bool start_recording(const std::string &path, std::string *err);
+void stop_recording();
+void record_struct_cmd(const OpReq &req);
+
+struct ReplayResult {
+    size_t n_records = 0;
+    size_t n_failed = 0;
+    JStringList errors;
+};
+
+// Returns false (with err set) if the log can't be read or is from another
+// registry, otherwise failed records end up in result.
+bool replay_struct_log(const std::string &path, Transport &dev, bool original_timing,
+                       bool print, ReplayResult *result, std::string *err);
+
+// The runs of bytes that differ between a and b (both size bytes), in order.
+// Compares 64 bytes at a time with SSE2 where it's available.
+void diff_images(const uint8_t *a, const uint8_t *b, size_t size, std::vector<OpReq::Run> *runs);
+
+// Reverse the bytes of each of n units of unit (2, 4 or 8) bytes at data.
+// 16 bytes at a time with SSE2 where it's available.
+void swap_units(uint8_t *data, size_t unit, size_t n);
+
+//
+// Big arrays, which ci would print a line per element of:
+//
+//  - 'summary sname->array[slice] [n]' reads like a ci of the same path and
+//    prints how many elements it covers, their min, max, sum and mean, and
+//    the first and last n of them (4 without one).
+//  - 'page sname->array[slice] <offset> [limit]' is a ci of limit elements
+//    (32 without one) of the slice, starting at its offset'th element, and
+//    only reads those. In text mode it's followed by which elements those
+//    were.
+//
+// Every instance of a bank is summarized, and summaries are always text.
+//
+// reduce_array() is the reduction summaries use for float and double
+// arrays: the min, max and sum of the n (> 0) elements at a. With SSE2
+// where it's available.
+//
+void reduce_array(const float *a, size_t n, float *min, float *max, double *sum);
+void reduce_array(const double *a, size_t n, double *min, double *max, double *sum);
+
+//
+// 'hexdump sname->[member|glob]' reads like a ci of the same path, but
+// prints the raw bytes of the image (in host byte order): 16 bytes a line
+// with their struct offset, in hex and as ASCII, followed by the members
+// starting on the line. Every instance of a bank it covers is dumped, and
+// output modes don't apply.
+//
+// hexdump_line() formats one line of it, up to 16 bytes at data, into line
+// (room for HEXDUMP_LINE_MAX chars, no newline) and returns its length.
+// Converts to hex and ASCII with SSE2 where it's available.
+//
+static const size_t HEXDUMP_LINE_MAX = 96;
+size_t hexdump_line(const uint8_t *data, size_t n, size_t offset, char *line);
+
+//
+// Per struct read cache. Members are volatile (read from the device every
+// time) unless they're marked cacheable, either with PYCSTRUCT_CACHEABLE()
+// next to the struct's registration or with a cache command:
+//
+//  - 'cache sname->[glob] <ttl_ms|off>' marks the members matching the glob
+//    (every member without one) cacheable for ttl_ms milliseconds, 0 being
+//    until invalidated, or volatile again.
+//  - 'invalidate sname->' forgets everything cached for the struct.
+//
+// A ci of members that are all cached and fresh is served from the cache
+// without touching the transport. A read fills the cache with the cacheable
+// members it read, and a co updates the cache write-through. Moving the
+// struct forgets what was cached.
+//
+// execute_struct_cmd() serves reads from the cache. Batches, AsyncQueue and
+// replays always read the device but keep the cache up to date with their
+// writes. Anything writing parsed requests itself calls cache_struct_write()
+// once the write is done, or the cache can go stale.
+//
+bool is_cache_cmd(const JStringList &args);
+bool run_cache_cmd(const JStringList &args, std::string *err);
+void cache_struct_write(const OpReq &req);
+
+//
+// Transactions, for programming lots of members of a struct before the
+// device sees any of them:
+//
+//  - 'begin sname->' opens a transaction on the struct at its working
+//    address (or an instance of a bank, 'sname[i]->').
+//  - Until it's committed, every co of the struct only sets the value in
+//    the struct's static instance and marks the bits it set dirty.
+//  - 'commit [sname->]' writes just the dirty bytes: the runs of whole
+//    bytes in one vectored write, runs with partly dirty bytes (bitfields)
+//    with masked writes. 'abort [sname->]' throws them away. Without a
+//    struct, every open transaction is committed/aborted.
+//
+// Transactions are per struct, not per caller, and ci still reads the
+// device. execute_struct_cmd() writes into an open transaction, batches
+// and AsyncQueue refuse to write to a struct with one open, and anything
+// executing parsed requests itself should check in_transaction().
+//
+bool is_transaction_cmd(const JStringList &args);
+bool run_transaction_cmd(const JStringList &args, Transport &dev, std::string *err);
+bool in_transaction(const OpReq &req);
+
+//
+// Device byte order. Struct images are always in host order, but a struct
+// can be in the other order on the device, either with PYCSTRUCT_ENDIAN()
+// next to its registration or with 'endian sname-> [big|little]' (which
+// prints the order without one).
+//
+// Every transfer of a struct in the other order swaps its scalars, array
+// elements and bitfield storage units on the way, using the layout the
+// registry recorded for it (whole arrays with SSE2 where it's available).
+// Mapped structs are used in place so can't be swapped. Setting the order
+// mustn't race with commands on the same struct.
+//
+// Anything executing parsed requests itself calls swap_struct_req() on the
+// request after a read, and before and after a write (swapping twice puts
+// the image back).
+//
+bool is_endian_cmd(const JStringList &args);
+bool run_endian_cmd(const JStringList &args, std::string *err);
+void swap_struct_req(const OpReq &req);
+
+//
+// Machine readable output, for programs that would otherwise have to parse
+// the 'sname->member = value' lines. 'output [text|json|csv|binary]' sets
+// the calling thread's mode for the commands it parses from then on (and
+// prints it without one), and 'ci <path> <mode>' picks one for a single
+// command. Values are written straight from the request's image:
+//
+//  - json: an object per struct instance printed, one per line, e.g.
+//    {"struct":"name","instance":0,"members":{"a":-1,"d":[1.5,2],"s":"text"}}
+//    plus "time" (seconds) for samples. Infinities and NaNs are null.
+//  - csv: a row per value, 'time,struct,instance,member,value', array
+//    elements as 'member[i]' and strings quoted. time is empty except for
+//    samples.
+//  - binary: per struct instance an OutRecord, then per member an OutValue
+//    and its value's bytes in host order (bitfields as their type, the
+//    printed elements of arrays one after the other, strings without the
+//    terminator).
+//
+// Integers are printed in decimal and floats as the shortest text that
+// reads back the same, whatever the member's printf format. Symbol indices
+// are the same as in command logs, symbol_paths() has the path of each.
+//
+struct OutRecord {
+    uint32_t size;     // bytes of OutValues following this
+    uint32_t sym;      // the struct's index into the symbol table
+    uint32_t instance; // of a bank, 0 otherwise
+    uint32_t pad;
+    int64_t time_ns; // when a sample was read, -1 otherwise
+};
+
+struct OutValue {
+    uint32_t sym; // the member's index into the symbol table
+    uint32_t size;
+};
+
+bool is_output_cmd(const JStringList &args);
+bool run_output_cmd(const JStringList &args, std::string *err);
+OutputMode output_mode();
+void set_output_mode(OutputMode mode);
 
 JStringList struct_names();
 JStringList member_names(const std::string &arg);
 
+// 'sname->' or 'sname->member' for every index into the symbol table
+JStringList symbol_paths();
+
 } // namespace Structs
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <algorithm>
+#include <string_view>
+#include <vector>
+
+namespace Structs {
+
+struct Struct;
+struct Var;
+
+//
+// One entry of the flat symbol table. Every registered member gets an entry
+// keyed on its full "sname->vname" path, and every struct gets one with an
+// empty vname so that "sname->" resolves through the same table.
+//
+// The views point into the names owned by the registry, so the table never
+// owns or copies any strings. Syms are literal types so that a generated
+// registry can emit its table as a constexpr array.
+//
+struct Sym {
+    std::string_view sname;
+    std::string_view vname;
+    const Struct *s = nullptr;
+    const Var *v = nullptr;
+};
+
+//
+// Ordering on (sname, vname). Identifiers only contain characters that sort
+// after '-', so this is the same order as comparing the full "sname->vname"
+// strings.
+//
+inline bool sym_less(std::string_view sname_a, std::string_view vname_a, std::string_view sname_b,
+                     std::string_view vname_b) {
+    const int c = sname_a.compare(sname_b);
+    return c < 0 || (c == 0 && vname_a < vname_b);
+}
+
+//
+// Member names containing '*' or '?' are glob patterns. A '[...]' in a glob is
+// a character class rather than an array slice, e.g. "ch[0-3]*".
+//
+inline bool is_glob(std::string_view vname) { return vname.find_first_of("*?") != vname.npos; }
+
+//
+// Match str against a shell style glob pattern: '*' matches any run of
+// characters, '?' any single character, and '[abc]', '[a-z]', '[!a-z]' a
+// character class.
+//
+inline bool glob_match(std::string_view pattern, std::string_view str) {
+    size_t p = 0;
+    size_t s = 0;
+    size_t star_p = std::string_view::npos;
+    size_t star_s = 0;
+
+    // Matches a '[...]' class at pattern[p] against c, setting *len to the
+    // length of the class. An unclosed '[' is matched literally.
+    const auto match_class = [pattern](size_t p, char c, size_t *len) {
+        const size_t close = pattern.find(']', p + 2);
+        if (close == std::string_view::npos) {
+            *len = 1;
+            return c == '[';
+        }
+        *len = close - p + 1;
+
+        size_t i = p + 1;
+        const bool negate = pattern[i] == '!';
+        if (negate) {
+            i++;
+        }
+
+        bool found = false;
+        for (; i < close; i++) {
+            if (i + 2 < close && pattern[i + 1] == '-') {
+                found |= pattern[i] <= c && c <= pattern[i + 2];
+                i += 2;
+            } else {
+                found |= pattern[i] == c;
+            }
+        }
+        return found != negate;
+    };
+
+    while (s < str.length()) {
+        size_t len = 1;
+        if (p < pattern.length() && pattern[p] == '*') {
+            star_p = p++;
+            star_s = s;
+            continue;
+        }
+
+        if (p < pattern.length() &&
+            (pattern[p] == '?' ||
+             (pattern[p] == '[' ? match_class(p, str[s], &len) : pattern[p] == str[s]))) {
+            p += len;
+            s++;
+        } else if (star_p != std::string_view::npos) {
+            // backtrack, let the last '*' eat one more character
+            p = star_p + 1;
+            s = ++star_s;
+        } else {
+            return false;
+        }
+    }
+
+    while (p < pattern.length() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.length();
+}
+
+//
+// Split "sname[...]->vname[...]" into its struct and member names without
+// allocating. Whitespace around either name is trimmed, an instance slice
+// is dropped from the struct name and an array slice suffix is dropped from
+// the member name (unless it's a glob). Returns false if there isn't exactly
+// one "->".
+//
+inline bool split_path(std::string_view svname, std::string_view *sname, std::string_view *vname) {
+    const auto trim = [](std::string_view sv) {
+        const char *ws = " \t\n\r\f\v";
+        const size_t first = sv.find_first_not_of(ws);
+        if (first == std::string_view::npos) {
+            return std::string_view{};
+        }
+        return sv.substr(first, sv.find_last_not_of(ws) - first + 1);
+    };
+
+    const size_t arrow = svname.find("->");
+    if (arrow == std::string_view::npos || svname.find("->", arrow + 2) != std::string_view::npos) {
+        return false;
+    }
+
+    *sname = trim(svname.substr(0, arrow));
+    *vname = trim(svname.substr(arrow + 2));
+
+    const size_t instance = sname->find('[');
+    if (instance != std::string_view::npos) {
+        *sname = trim(sname->substr(0, instance));
+    }
+
+    const size_t brace = vname->find('[');
+    if (brace != std::string_view::npos && vname->find(']') != std::string_view::npos &&
+        !is_glob(*vname)) {
+        *vname = trim(vname->substr(0, brace));
+    }
+
+    return true;
+}
+
+//
+// Read-only view over a sorted array of Syms. Either points at a constexpr
+// table emitted by pycstruct3.py or at a vector sorted by sorted().
+//
+class SymbolTable {
+  public:
+    constexpr SymbolTable() = default;
+    constexpr SymbolTable(const Sym *begin, const Sym *end) : m_begin(begin), m_end(end) {}
+
+    //
+    // Sort syms in place and return a table over them. The vector has to
+    // outlive the table and can't be modified afterwards.
+    //
+    static SymbolTable sorted(std::vector<Sym> *syms) {
+        std::sort(syms->begin(), syms->end(), [](const Sym &a, const Sym &b) {
+            return sym_less(a.sname, a.vname, b.sname, b.vname);
+        });
+        return {syms->data(), syms->data() + syms->size()};
+    }
+
+    //
+    // Binary search for an exact path. Returns nullptr if it isn't registered.
+    //
+    const Sym *find(std::string_view sname, std::string_view vname) const {
+        const Sym *it =
+            std::lower_bound(m_begin, m_end, sname, [vname](const Sym &sym, std::string_view sn) {
+                return sym_less(sym.sname, sym.vname, sn, vname);
+            });
+
+        if (it == m_end || it->sname != sname || it->vname != vname) {
+            return nullptr;
+        }
+        return it;
+    }
+
+    struct Range {
+        const Sym *first;
+        const Sym *last;
+        const Sym *begin() const { return first; }
+        const Sym *end() const { return last; }
+    };
+
+    //
+    // All the members of sname whose names start with prefix. The struct's
+    // own entry is never included.
+    //
+    Range prefix(std::string_view sname, std::string_view prefix) const {
+        const auto before = [prefix](const Sym &sym, std::string_view sn) {
+            return sym_less(sym.sname, sym.vname.substr(0, prefix.length()), sn, prefix);
+        };
+        const auto after = [prefix](std::string_view sn, const Sym &sym) {
+            return sym_less(sn, prefix, sym.sname, sym.vname.substr(0, prefix.length()));
+        };
+
+        Range r{std::lower_bound(m_begin, m_end, sname, before),
+                std::upper_bound(m_begin, m_end, sname, after)};
+
+        // the struct entry has an empty vname so it always sorts first
+        if (r.first != r.last && !r.first->v) {
+            r.first++;
+        }
+        return r;
+    }
+
+    //
+    // Walk the members of sname matching a glob pattern, only visiting the
+    // range that shares the pattern's literal prefix.
+    //
+    template <typename Func>
+    void for_each_match(std::string_view sname, std::string_view pattern, Func func) const {
+        const size_t literal = std::min(pattern.find_first_of("*?["), pattern.length());
+
+        for (const Sym &sym : prefix(sname, pattern.substr(0, literal))) {
+            if (literal == pattern.length() ? sym.vname.length() == literal
+                                            : glob_match(pattern.substr(literal),
+                                                         sym.vname.substr(literal))) {
+                func(sym);
+            }
+        }
+    }
+
+    const Sym *begin() const { return m_begin; }
+    const Sym *end() const { return m_end; }
+    size_t size() const { return m_end - m_begin; }
+
+  private:
+    const Sym *m_begin = nullptr;
+    const Sym *m_end = nullptr;
+};
+
+} // namespace Structs
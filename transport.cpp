@@ -0,0 +1,325 @@
+#include "transport.hpp"
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+namespace Structs {
+
+bool Transport::masked_write(const uint8_t *data, const uint8_t *mask, size_t size,
+                             size_t offset) {
+    std::vector<uint8_t> merged(size);
+    if (!read(merged.data(), size, offset)) {
+        return false;
+    }
+    for (size_t i = 0; i < size; i++) {
+        merged[i] = (merged[i] & ~mask[i]) | (data[i] & mask[i]);
+    }
+    return write(merged.data(), size, offset);
+}
+
+bool Transport::readv(const XferChunk *chunks, size_t n_chunks) {
+    for (size_t i = 0; i < n_chunks; i++) {
+        if (!read(chunks[i].data, chunks[i].size, chunks[i].offset)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Transport::writev(const XferChunk *chunks, size_t n_chunks) {
+    for (size_t i = 0; i < n_chunks; i++) {
+        if (!write(chunks[i].data, chunks[i].size, chunks[i].offset)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*================================================================================*/
+
+bool FuncTransport::read(uint8_t *data, size_t size, size_t offset) {
+    m_read(data, size, offset);
+    return true;
+}
+
+bool FuncTransport::write(const uint8_t *data, size_t size, size_t offset) {
+    m_write(const_cast<uint8_t *>(data), size, offset);
+    return true;
+}
+
+bool FuncTransport::masked_write(const uint8_t *data, const uint8_t *mask, size_t size,
+                                 size_t offset) {
+    if (!m_masked_write) {
+        return Transport::masked_write(data, mask, size, offset);
+    }
+    m_masked_write(const_cast<uint8_t *>(data), mask, size, offset);
+    return true;
+}
+
+bool FuncTransport::readv(const XferChunk *chunks, size_t n_chunks) {
+    if (!m_readv) {
+        return Transport::readv(chunks, n_chunks);
+    }
+    m_readv(chunks, n_chunks);
+    return true;
+}
+
+bool FuncTransport::writev(const XferChunk *chunks, size_t n_chunks) {
+    if (!m_writev) {
+        return Transport::writev(chunks, n_chunks);
+    }
+    m_writev(chunks, n_chunks);
+    return true;
+}
+
+/*================================================================================*/
+
+std::unique_ptr<FileTransport> FileTransport::open(const std::string &path, size_t size,
+                                                   std::string *err) {
+    std::unique_ptr<FileTransport> dev{new FileTransport};
+
+    dev->m_fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (dev->m_fd < 0) {
+        *err = "open " + path + ": " + strerror(errno);
+        return nullptr;
+    }
+
+    struct stat file_stat;
+    if (fstat(dev->m_fd, &file_stat) < 0) {
+        *err = "stat " + path + ": " + strerror(errno);
+        return nullptr;
+    }
+
+    if ((size_t)file_stat.st_size < size && ftruncate(dev->m_fd, size) < 0) {
+        *err = "resize " + path + ": " + strerror(errno);
+        return nullptr;
+    }
+    dev->m_length = std::max(size, (size_t)file_stat.st_size);
+
+    if (dev->m_length == 0) {
+        *err = path + " is empty";
+        return nullptr;
+    }
+
+    void *base = mmap(nullptr, dev->m_length, PROT_READ | PROT_WRITE, MAP_SHARED, dev->m_fd, 0);
+    if (base == MAP_FAILED) {
+        *err = "mmap " + path + ": " + strerror(errno);
+        return nullptr;
+    }
+    dev->m_base = (uint8_t *)base;
+
+    return dev;
+}
+
+FileTransport::~FileTransport() {
+    if (m_base) {
+        munmap(m_base, m_length);
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+bool FileTransport::read(uint8_t *data, size_t size, size_t offset) {
+    if (!in_bounds(size, offset)) {
+        return false;
+    }
+    memcpy(data, m_base + offset, size);
+    return true;
+}
+
+bool FileTransport::write(const uint8_t *data, size_t size, size_t offset) {
+    if (!in_bounds(size, offset)) {
+        return false;
+    }
+    memcpy(m_base + offset, data, size);
+    return true;
+}
+
+bool FileTransport::masked_write(const uint8_t *data, const uint8_t *mask, size_t size,
+                                 size_t offset) {
+    if (!in_bounds(size, offset)) {
+        return false;
+    }
+    uint8_t *dst = m_base + offset;
+    for (size_t i = 0; i < size; i++) {
+        dst[i] = (dst[i] & ~mask[i]) | (data[i] & mask[i]);
+    }
+    return true;
+}
+
+bool FileTransport::readv(const XferChunk *chunks, size_t n_chunks) {
+    for (size_t i = 0; i < n_chunks; i++) {
+        if (!in_bounds(chunks[i].size, chunks[i].offset)) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < n_chunks; i++) {
+        memcpy(chunks[i].data, m_base + chunks[i].offset, chunks[i].size);
+    }
+    return true;
+}
+
+bool FileTransport::writev(const XferChunk *chunks, size_t n_chunks) {
+    for (size_t i = 0; i < n_chunks; i++) {
+        if (!in_bounds(chunks[i].size, chunks[i].offset)) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < n_chunks; i++) {
+        memcpy(m_base + chunks[i].offset, chunks[i].data, chunks[i].size);
+    }
+    return true;
+}
+
+bool FileTransport::flush() { return msync(m_base, m_length, MS_SYNC) == 0; }
+
+uint8_t *FileTransport::mapping(size_t *length) {
+    *length = m_length;
+    return m_base;
+}
+
+/*================================================================================*/
+
+using VecSyscall = ssize_t (*)(int fd, const iovec *iov, int iovcnt, off_t offset);
+
+//
+// Keep calling preadv()/pwritev() until all of iov has been moved, picking
+// up where a short transfer left off. Clobbers iov.
+//
+static bool xfer_all(VecSyscall xfer, int fd, iovec *iov, size_t n_iov, size_t offset) {
+    while (true) {
+        // skip any empty entries so a zero length transfer isn't an error
+        while (n_iov > 0 && iov->iov_len == 0) {
+            iov++;
+            n_iov--;
+        }
+        if (n_iov == 0) {
+            return true;
+        }
+
+        const ssize_t n = xfer(fd, iov, std::min(n_iov, (size_t)IOV_MAX), offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+
+        offset += n;
+        for (size_t done = n; done > 0;) {
+            if (done >= iov->iov_len) {
+                done -= iov->iov_len;
+                iov++;
+                n_iov--;
+            } else {
+                iov->iov_base = (uint8_t *)iov->iov_base + done;
+                iov->iov_len -= done;
+                done = 0;
+            }
+        }
+    }
+}
+
+std::unique_ptr<FdTransport> FdTransport::open(const std::string &path, size_t base,
+                                               std::string *err) {
+    std::unique_ptr<FdTransport> dev{new FdTransport};
+
+    dev->m_fd = ::open(path.c_str(), O_RDWR);
+    if (dev->m_fd < 0) {
+        *err = "open " + path + ": " + strerror(errno);
+        return nullptr;
+    }
+    dev->m_base = base;
+
+    return dev;
+}
+
+FdTransport::~FdTransport() {
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+bool FdTransport::read(uint8_t *data, size_t size, size_t offset) {
+    iovec iov{data, size};
+    return xfer_all(preadv, m_fd, &iov, 1, m_base + offset);
+}
+
+bool FdTransport::write(const uint8_t *data, size_t size, size_t offset) {
+    iovec iov{const_cast<uint8_t *>(data), size};
+    return xfer_all(pwritev, m_fd, &iov, 1, m_base + offset);
+}
+
+bool FdTransport::readv(const XferChunk *chunks, size_t n_chunks) {
+    static thread_local uint8_t gap[MAX_READ_GAP];
+    static thread_local std::vector<iovec> iov;
+
+    for (size_t i = 0; i < n_chunks;) {
+        const size_t begin = chunks[i].offset;
+        size_t end = begin;
+
+        iov.clear();
+        for (; i < n_chunks; i++) {
+            const XferChunk &chunk = chunks[i];
+            if (chunk.offset < end || chunk.offset - end > m_max_read_gap) {
+                break;
+            }
+            if (chunk.offset > end) {
+                iov.push_back({gap, chunk.offset - end});
+            }
+            iov.push_back({chunk.data, chunk.size});
+            end = chunk.offset + chunk.size;
+        }
+
+        if (!xfer_all(preadv, m_fd, iov.data(), iov.size(), m_base + begin)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FdTransport::writev(const XferChunk *chunks, size_t n_chunks) {
+    static thread_local std::vector<iovec> iov;
+
+    for (size_t i = 0; i < n_chunks;) {
+        const size_t begin = chunks[i].offset;
+        size_t end = begin;
+
+        iov.clear();
+        for (; i < n_chunks && chunks[i].offset == end; i++) {
+            iov.push_back({chunks[i].data, chunks[i].size});
+            end += chunks[i].size;
+        }
+
+        if (!xfer_all(pwritev, m_fd, iov.data(), iov.size(), m_base + begin)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FdTransport::flush() { return fsync(m_fd) == 0; }
+
+bool FdTransport::set_read_gap(size_t max_gap, std::string *err) {
+    struct stat st;
+    if (fstat(m_fd, &st) < 0) {
+        *err = std::string("fstat: ") + strerror(errno);
+        return false;
+    }
+    if (max_gap > 0 && !S_ISREG(st.st_mode)) {
+        *err = "Gaps can only be read on a regular file";
+        return false;
+    }
+    m_max_read_gap = std::min(max_gap, (size_t)MAX_READ_GAP);
+    return true;
+}
+
+} // namespace Structs
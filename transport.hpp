@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace Structs {
+
+// Moves size bytes between data and the device at offset.
+using XferFunc = void (*)(uint8_t *data, size_t size, size_t offset);
+
+// Writes only the bits of data that are set in mask (also size bytes) to the
+// device at offset, leaving the rest of the device's bits alone.
+using MaskedXferFunc = void (*)(uint8_t *data, const uint8_t *mask, size_t size, size_t offset);
+
+// One piece of a vectored transfer: size bytes at data to/from the device at
+// offset.
+struct XferChunk {
+    uint8_t *data;
+    size_t size;
+    size_t offset;
+};
+
+// Moves all the chunks in one go, e.g. with preadv()/pwritev().
+using VecXferFunc = void (*)(const XferChunk *chunks, size_t n_chunks);
+
+//
+// Whatever actually moves bytes to and from the device. Only read and write
+// have to be implemented; the rest fall back to doing the same thing with
+// reads and writes. Every operation returns false if the transfer failed.
+//
+class Transport {
+  public:
+    virtual ~Transport() = default;
+
+    virtual bool read(uint8_t *data, size_t size, size_t offset) = 0;
+    virtual bool write(const uint8_t *data, size_t size, size_t offset) = 0;
+
+    // Falls back to a read-modify-write of the size bytes at offset
+    virtual bool masked_write(const uint8_t *data, const uint8_t *mask, size_t size,
+                              size_t offset);
+
+    // Fall back to one read/write per chunk
+    virtual bool readv(const XferChunk *chunks, size_t n_chunks);
+    virtual bool writev(const XferChunk *chunks, size_t n_chunks);
+
+    // Whether the device does masked writes itself, so a bitfield can be set
+    // without reading its storage unit first.
+    virtual bool has_masked_write() const { return false; }
+
+    // Whether readv/writev are cheaper than reading/writing the span covering
+    // all the chunks, i.e. whether gaps are worth skipping.
+    virtual bool has_vectored() const { return false; }
+
+    // Make the writes so far visible to whoever else is looking at the device
+    virtual bool flush() { return true; }
+
+    // If the device is mapped into this process, the mapping so structs can
+    // be bound to it with bind_struct().
+    virtual uint8_t *mapping(size_t *length) {
+        *length = 0;
+        return nullptr;
+    }
+};
+
+//
+// A transport made out of plain transfer functions, for devices that are
+// just a pair of read/write calls. The optional ones are used if given.
+//
+class FuncTransport : public Transport {
+  public:
+    FuncTransport(XferFunc read, XferFunc write, MaskedXferFunc masked_write = nullptr,
+                  VecXferFunc readv = nullptr, VecXferFunc writev = nullptr)
+        : m_read(read), m_write(write), m_masked_write(masked_write), m_readv(readv),
+          m_writev(writev) {}
+
+    bool read(uint8_t *data, size_t size, size_t offset) override;
+    bool write(const uint8_t *data, size_t size, size_t offset) override;
+    bool masked_write(const uint8_t *data, const uint8_t *mask, size_t size,
+                      size_t offset) override;
+    bool readv(const XferChunk *chunks, size_t n_chunks) override;
+    bool writev(const XferChunk *chunks, size_t n_chunks) override;
+    bool has_masked_write() const override { return m_masked_write; }
+    bool has_vectored() const override { return m_readv && m_writev; }
+
+  private:
+    XferFunc m_read;
+    XferFunc m_write;
+    MaskedXferFunc m_masked_write;
+    VecXferFunc m_readv;
+    VecXferFunc m_writev;
+};
+
+//
+// Uses a regular file as the device image by mmap'ing it, so the same
+// commands can be run against a local image of a device.
+//
+class FileTransport : public Transport {
+  public:
+    // Opens (or creates) path and grows it to at least size bytes. A size of
+    // 0 maps the file as it is. Returns nullptr (with err set) on failure.
+    static std::unique_ptr<FileTransport> open(const std::string &path, size_t size,
+                                               std::string *err);
+    ~FileTransport() override;
+
+    FileTransport(const FileTransport &) = delete;
+    FileTransport &operator=(const FileTransport &) = delete;
+
+    bool read(uint8_t *data, size_t size, size_t offset) override;
+    bool write(const uint8_t *data, size_t size, size_t offset) override;
+    bool masked_write(const uint8_t *data, const uint8_t *mask, size_t size,
+                      size_t offset) override;
+    bool readv(const XferChunk *chunks, size_t n_chunks) override;
+    bool writev(const XferChunk *chunks, size_t n_chunks) override;
+    bool has_masked_write() const override { return true; }
+    bool has_vectored() const override { return true; }
+    bool flush() override;
+    uint8_t *mapping(size_t *length) override;
+
+  private:
+    FileTransport() = default;
+    bool in_bounds(size_t size, size_t offset) const {
+        return offset <= m_length && size <= m_length - offset;
+    }
+
+    int m_fd = -1;
+    uint8_t *m_base = nullptr;
+    size_t m_length = 0;
+};
+
+//
+// Moves data with pread()/pwrite() on a file descriptor, e.g. /dev/mem, a
+// UIO node or a plain file. Vectored transfers become a single
+// preadv()/pwritev() per run of chunks that are contiguous on the device
+// rather than a syscall per chunk. Nothing between the chunks is touched
+// unless gap reads have been turned on for a plain file.
+//
+class FdTransport : public Transport {
+  public:
+    // The biggest gap between read chunks set_read_gap() allows
+    static const size_t MAX_READ_GAP = 4096;
+
+    // Opens path for reading and writing, with device offset 0 at byte base
+    // of the file. Returns nullptr (with err set) on failure.
+    static std::unique_ptr<FdTransport> open(const std::string &path, size_t base,
+                                             std::string *err);
+    ~FdTransport() override;
+
+    FdTransport(const FdTransport &) = delete;
+    FdTransport &operator=(const FdTransport &) = delete;
+
+    bool read(uint8_t *data, size_t size, size_t offset) override;
+    bool write(const uint8_t *data, size_t size, size_t offset) override;
+    bool readv(const XferChunk *chunks, size_t n_chunks) override;
+    bool writev(const XferChunk *chunks, size_t n_chunks) override;
+    bool has_vectored() const override { return true; }
+    bool flush() override;
+
+    // Let reads soak up gaps of up to max_gap bytes (at most MAX_READ_GAP)
+    // between chunks into a scratch buffer, so they take fewer preadv()s.
+    // Only for regular files: on a device, reading registers nobody asked
+    // for can change their state. Returns false (with err set) otherwise.
+    bool set_read_gap(size_t max_gap, std::string *err);
+
+  private:
+    FdTransport() = default;
+
+    int m_fd = -1;
+    size_t m_base = 0;
+    size_t m_max_read_gap = 0;
+};
+
+} // namespace Structs
@@ -0,0 +1,224 @@
+#include "watch.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+#include "utils/jstrings/jstrings.hpp"
+
+namespace js = JStrings;
+
+namespace Structs {
+
+// Samples are stored as a nanosecond timestamp followed by the member's bytes
+static const size_t STAMP_SIZE = sizeof(int64_t);
+
+// How long before a sample is due the sampler stops sleeping and spins, since
+// sleeps can overshoot by tens of microseconds.
+static const std::chrono::microseconds SPIN_TIME{50};
+
+bool parse_duration(const std::string &str, std::chrono::nanoseconds *d) {
+    char *end = nullptr;
+    const double n = strtod(str.c_str(), &end);
+    if (end == str.c_str() || !(n > 0)) {
+        return false;
+    }
+
+    double scale;
+    const std::string unit = end;
+    if (unit == "" || unit == "s") {
+        scale = 1e9;
+    } else if (unit == "ms") {
+        scale = 1e6;
+    } else if (unit == "us") {
+        scale = 1e3;
+    } else if (unit == "ns") {
+        scale = 1;
+    } else {
+        return false;
+    }
+
+    *d = std::chrono::nanoseconds((int64_t)(n * scale));
+    return d->count() > 0;
+}
+
+std::unique_ptr<Watch> Watch::start(const JStringList &args, Transport &dev, std::string *err) {
+    if (args.size() < 3 || args.size() > 4 || args[0] != "watch") {
+        *err = "Invalid args for watch, expected watch sname->vname <period> [duration]";
+        return nullptr;
+    }
+
+    std::chrono::nanoseconds period, duration{0};
+    if (!parse_duration(args[2], &period)) {
+        *err = "Invalid watch period: " + args[2];
+        return nullptr;
+    }
+    if (args.size() > 3 && !parse_duration(args[3], &duration)) {
+        *err = "Invalid watch duration: " + args[3];
+        return nullptr;
+    }
+
+    // the member is read like a ci of it
+    JStringList ci_args = {"ci", args[1]};
+    OpReq req;
+    if (!parse_struct_cmd(ci_args, &req)) {
+        *err = req.err;
+        return nullptr;
+    }
+    if (req.op != OpReq::PRINT || req.instances.size() > 1) {
+        *err = "Can only watch struct members of a single instance";
+        return nullptr;
+    }
+
+    const size_t record_size = (STAMP_SIZE + req.size + 7) & ~(size_t)7;
+    std::unique_ptr<Watch> w{new Watch(record_size)};
+    w->m_args = std::move(ci_args);
+    w->m_req = std::move(req);
+    w->m_req.args = &w->m_args;
+    w->m_dev = &dev;
+    w->m_period = period;
+    w->m_duration = duration;
+
+    OpReq &r = w->m_req;
+
+    // A bound struct is sampled straight out of the mapping, but printed
+    // from an image of our own so the printed value is the sampled one.
+    if (r.mapped) {
+        w->m_src = r.data;
+        r.image.assign(r.struct_offset + r.size, 0);
+        r.base = r.image.data();
+        r.data = r.base + r.struct_offset;
+    }
+
+    w->m_mask.assign(r.size, 0);
+    if (r.width > 0) {
+        for (unsigned bit = r.shift; bit < r.shift + r.width; bit++) {
+            w->m_mask[bit / 8] |= 1 << (bit % 8);
+        }
+    } else if (r.runs.size() > 0) {
+        for (const OpReq::Run &run : r.runs) {
+            memset(&w->m_mask[run.struct_offset - r.struct_offset], 0xff, run.size);
+        }
+    } else {
+        memset(w->m_mask.data(), 0xff, r.size);
+    }
+    w->m_last.resize(r.size);
+
+    w->m_start = std::chrono::steady_clock::now();
+    w->m_sampler = std::thread(&Watch::sample, w.get());
+    return w;
+}
+
+Watch::~Watch() { stop(); }
+
+void Watch::stop() {
+    m_stop = true;
+    if (m_sampler.joinable()) {
+        m_sampler.join();
+    }
+}
+
+void Watch::sample() {
+    using namespace std::chrono;
+
+    const size_t size = m_req.size;
+    auto next = steady_clock::now();
+
+    while (!m_stop.load(std::memory_order_relaxed)) {
+        uint8_t *record = m_ring.reserve();
+        if (!record) {
+            m_n_dropped.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            const int64_t stamp = duration_cast<nanoseconds>(steady_clock::now() - m_start).count();
+            memcpy(record, &stamp, STAMP_SIZE);
+
+            bool ok = true;
+            if (m_src) {
+                memcpy(record + STAMP_SIZE, m_src, size);
+            } else {
+                ok = m_dev->read(record + STAMP_SIZE, size, m_req.offset);
+            }
+
+            if (ok) {
+                m_ring.publish();
+                m_n_samples.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                m_n_failed.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        // if a sample was late don't try to catch up with a burst of them
+        next += m_period;
+        auto now = steady_clock::now();
+        if (now > next) {
+            next = now;
+            continue;
+        }
+
+        if (next - now > SPIN_TIME) {
+            std::this_thread::sleep_until(next - SPIN_TIME);
+        }
+        while (steady_clock::now() < next) {
+        }
+    }
+}
+
+size_t Watch::poll() {
+    const size_t size = m_req.size;
+    size_t n_printed = 0;
+
+    while (const uint8_t *record = m_ring.front()) {
+        // samples are in the device's byte order, the mask is in ours
+        const uint8_t *bytes = m_req.data;
+        memcpy(m_req.data, record + STAMP_SIZE, size);
+        swap_struct_req(m_req);
+
+        bool changed = !m_have_last;
+        for (size_t i = 0; i < size && !changed; i++) {
+            changed = ((bytes[i] ^ m_last[i]) & m_mask[i]) != 0;
+        }
+
+        if (changed) {
+            int64_t stamp;
+            memcpy(&stamp, record, STAMP_SIZE);
+            memcpy(m_last.data(), bytes, size);
+            m_have_last = true;
+
+            // machine readable modes print the time themselves
+            m_req.stamp_ns = stamp;
+            if (m_req.output == OutputMode::Text) {
+                struct_out() << js::fmt("%12.6f ", stamp / 1e9);
+            }
+            m_req.print(m_req);
+            flush_struct_out();
+            m_n_changes++;
+            n_printed++;
+        }
+
+        m_ring.pop();
+    }
+    return n_printed;
+}
+
+bool run_watch(const JStringList &args, Transport &dev, std::string *err) {
+    using namespace std::chrono;
+
+    std::unique_ptr<Watch> w = Watch::start(args, dev, err);
+    if (!w) {
+        return false;
+    }
+
+    const auto end = steady_clock::now() + w->duration();
+    while (w->duration().count() == 0 || steady_clock::now() < end) {
+        w->poll();
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+
+    w->stop();
+    w->poll();
+
+    struct_out() << js::fmt("%lu samples, %lu changes, %lu dropped, %lu failed\n",
+                            w->n_samples(), w->n_changes(), w->n_dropped(), w->n_failed());
+    return true;
+}
+
+} // namespace Structs
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "structs.hpp"
+#include "transport.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Structs {
+
+//
+// Lock-free single producer/single consumer ring of fixed size records.
+// The producer fills the record from reserve() in place and publishes it,
+// the consumer reads front() in place and pops it, so nothing is copied
+// through the ring. Each side keeps a cached copy of the other side's index
+// so it only touches the shared cache line when it looks full/empty.
+//
+class SampleRing {
+  public:
+    // capacity is rounded up to a power of two
+    SampleRing(size_t record_size, size_t capacity)
+        : m_record_size(record_size), m_mask(round_up(capacity) - 1),
+          m_buf(record_size * (m_mask + 1)) {}
+
+    // producer: the next free record, or nullptr if the ring is full
+    uint8_t *reserve() {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head_cache > m_mask) {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            if (tail - m_head_cache > m_mask) {
+                return nullptr;
+            }
+        }
+        return &m_buf[(tail & m_mask) * m_record_size];
+    }
+
+    void publish() {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // consumer: the oldest record, or nullptr if the ring is empty
+    const uint8_t *front() {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail_cache) {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+            if (head == m_tail_cache) {
+                return nullptr;
+            }
+        }
+        return &m_buf[(head & m_mask) * m_record_size];
+    }
+
+    void pop() {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+  private:
+    static size_t round_up(size_t n) {
+        size_t p = 1;
+        while (p < n) {
+            p <<= 1;
+        }
+        return p;
+    }
+
+    const size_t m_record_size;
+    const size_t m_mask;
+    std::vector<uint8_t> m_buf;
+
+    // producer side
+    alignas(64) std::atomic<size_t> m_tail{0};
+    size_t m_head_cache = 0;
+
+    // consumer side
+    alignas(64) std::atomic<size_t> m_head{0};
+    size_t m_tail_cache = 0;
+};
+
+// A number with an optional ns/us/ms/s suffix, seconds if there isn't one
+bool parse_duration(const std::string &str, std::chrono::nanoseconds *d);
+
+//
+// 'watch sname->vname <period> [duration]'
+//
+// A sampler thread reads the member's bytes every period straight into a
+// SampleRing, and poll() on the consumer side formats and prints only the
+// samples where the member changed. Periods and durations are a number with
+// an optional ns/us/ms/s suffix (seconds if there isn't one).
+//
+// If the ring fills up because the consumer isn't keeping up, samples are
+// dropped (and counted) rather than blocking the sampler. The transport is
+// used from the sampler thread, so it has to be safe to share if anything
+// else is using it at the same time.
+//
+class Watch {
+  public:
+    static std::unique_ptr<Watch> start(const JStringList &args, Transport &dev,
+                                        std::string *err);
+    ~Watch();
+
+    Watch(const Watch &) = delete;
+    Watch &operator=(const Watch &) = delete;
+
+    void stop();
+
+    // Print every sample that changed since the last one, returns how many
+    // were printed.
+    size_t poll();
+
+    size_t n_samples() const { return m_n_samples; }
+    size_t n_changes() const { return m_n_changes; }
+    size_t n_dropped() const { return m_n_dropped; }
+    size_t n_failed() const { return m_n_failed; }
+
+    // how long to watch for, zero if it wasn't given
+    std::chrono::nanoseconds duration() const { return m_duration; }
+
+  private:
+    Watch(size_t record_size) : m_ring(record_size, 4096) {}
+    void sample();
+
+    JStringList m_args;
+    OpReq m_req;
+    Transport *m_dev = nullptr;
+    const uint8_t *m_src = nullptr; // the mapped member, if its struct is bound
+    std::chrono::nanoseconds m_period{0};
+    std::chrono::nanoseconds m_duration{0};
+    std::chrono::steady_clock::time_point m_start;
+
+    SampleRing m_ring;
+    std::thread m_sampler;
+    std::atomic<bool> m_stop{false};
+
+    // which bits of a sample belong to the member, changes elsewhere (e.g.
+    // a bitfield's neighbours) don't count. Host byte order, like m_last.
+    std::vector<uint8_t> m_mask;
+    std::vector<uint8_t> m_last;
+    bool m_have_last = false;
+
+    std::atomic<size_t> m_n_samples{0};
+    std::atomic<size_t> m_n_dropped{0};
+    std::atomic<size_t> m_n_failed{0};
+    size_t m_n_changes = 0;
+};
+
+// Run a watch command on this thread until its duration is up (or forever
+// if it doesn't have one). Returns false (with err set) if it's invalid.
+bool run_watch(const JStringList &args, Transport &dev, std::string *err);
+
+} // namespace Structs